@@ -0,0 +1,709 @@
+//--------------------------------------------------------------------------------------------------
+// Copyright (C) 2022 Marcus Geelnard
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//   1. Redistributions of source code must retain the above copyright notice, this list of
+//      conditions and the following disclaimer.
+//
+//   2. Redistributions in binary form must reproduce the above copyright notice, this list of
+//      conditions and the following disclaimer in the documentation and/or other materials provided
+//      with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+// WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//--------------------------------------------------------------------------------------------------
+
+// We need O_DIRECT and syscall().
+#define _GNU_SOURCE
+
+#include "mfat_posix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+//--------------------------------------------------------------------------------------------------
+// Configuration.
+//--------------------------------------------------------------------------------------------------
+
+// Enable the io_uring based asynchronous reads?
+#ifndef MFAT_POSIX_ENABLE_IO_URING
+#if defined(__linux__)
+#define MFAT_POSIX_ENABLE_IO_URING 1
+#else
+#define MFAT_POSIX_ENABLE_IO_URING 0
+#endif
+#endif
+
+// Number of entries of the io_uring submission queue.
+#ifndef MFAT_POSIX_URING_ENTRIES
+#define MFAT_POSIX_URING_ENTRIES 64
+#endif
+
+// Number of registered bounce buffers for unaligned asynchronous direct reads.
+#ifndef MFAT_POSIX_URING_BOUNCE_BUFFERS
+#define MFAT_POSIX_URING_BOUNCE_BUFFERS 16
+#endif
+
+// Size of each registered bounce buffer, in bytes (a multiple of MFAT_POSIX_DIRECT_ALIGNMENT).
+#ifndef MFAT_POSIX_URING_BOUNCE_SIZE
+#define MFAT_POSIX_URING_BOUNCE_SIZE 65536
+#endif
+
+// Size of the bounce buffer of a device for synchronous direct I/O, in bytes (a multiple of
+// MFAT_POSIX_DIRECT_ALIGNMENT).
+#ifndef MFAT_POSIX_BOUNCE_SIZE
+#define MFAT_POSIX_BOUNCE_SIZE 65536
+#endif
+
+// Memory alignment of the bounce buffers for direct I/O.
+#define MFAT_POSIX_DIRECT_ALIGNMENT 4096
+
+#if MFAT_POSIX_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+//--------------------------------------------------------------------------------------------------
+// Private types and structs.
+//--------------------------------------------------------------------------------------------------
+
+#if MFAT_POSIX_ENABLE_IO_URING
+// An asynchronous read request that is in flight (indexed by the MFAT request tag).
+typedef struct {
+  char* ptr;         // Target buffer.
+  int bounce_idx;    // Registered bounce buffer for direct I/O (-1 if not used).
+  int status;        // Status of a request that was completed at submission (0 = success).
+  size_t num_bytes;  // Size of the request (zero if the request was completed at submission).
+  off_t offset;      // Device offset of the request.
+} mfat_posix_req_t;
+
+// An io_uring instance, with the submission queue (SQ) and completion queue (CQ) rings mapped into
+// our address space.
+typedef struct {
+  int ring_fd;
+  void* sq_ptr;
+  size_t sq_size;
+  void* cq_ptr;
+  size_t cq_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned* sq_mask;
+  unsigned* sq_array;
+  unsigned sq_entries;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned* cq_mask;
+  struct io_uring_cqe* cqes;
+  unsigned num_queued;    // Number of SQ entries that have not yet been submitted to the kernel.
+  unsigned num_inflight;  // Number of requests that have not yet been reaped.
+  mfat_posix_req_t* req;  // Request table (grows on demand).
+  unsigned num_req;       // Size of the request table.
+  char* bounce;           // Bounce buffers (NULL if direct I/O is not used).
+  int bounce_registered;  // Are the bounce buffers registered with io_uring?
+  unsigned char bounce_busy[MFAT_POSIX_URING_BOUNCE_BUFFERS];
+  pthread_mutex_t mutex;  // MFAT may call the I/O functions concurrently (in thread safe mode).
+} mfat_posix_uring_t;
+#endif
+
+// Forward declared in mfat_posix.h, refered to as the type mfat_posix_t.
+struct mfat_posix_struct {
+  int fd;
+  int flags;
+  void* map;                     // Memory mapped device (NULL if the device is not mapped).
+  uint32_t map_blocks;           // Size of the mapping, in blocks.
+  char* bounce;                  // Bounce buffer for direct I/O (NULL if direct I/O is not used).
+  pthread_mutex_t bounce_mutex;  // MFAT may call the I/O functions concurrently.
+#if MFAT_POSIX_ENABLE_IO_URING
+  mfat_posix_uring_t* uring;  // NULL if io_uring is not used.
+#endif
+};
+
+//--------------------------------------------------------------------------------------------------
+// Synchronous block I/O.
+//--------------------------------------------------------------------------------------------------
+
+// Check if a buffer can be used for direct I/O as is.
+static int _mfat_posix_is_aligned(const mfat_posix_t* dev, const void* ptr) {
+  return (dev->flags & MFAT_POSIX_DIRECT) == 0 ||
+         ((uintptr_t)ptr % MFAT_POSIX_DIRECT_ALIGNMENT) == 0U;
+}
+
+static char* _mfat_posix_alloc_bounce(size_t num_bytes) {
+  void* ptr;
+  if (posix_memalign(&ptr, MFAT_POSIX_DIRECT_ALIGNMENT, num_bytes) != 0) {
+    return NULL;
+  }
+  return (char*)ptr;
+}
+
+// Get the alignment of buffers and offsets that the device requires.
+static size_t _mfat_posix_alignment(const mfat_posix_t* dev) {
+  return ((dev->flags & MFAT_POSIX_DIRECT) != 0) ? MFAT_POSIX_DIRECT_ALIGNMENT : 1U;
+}
+
+// Read an entire range of bytes (retrying interrupted and short reads). Blocks beyond the end of
+// the image (e.g. a truncated image file) read as zeros. Short reads are continued from the last
+// aligned position, since direct I/O requires aligned buffers and offsets.
+static int _mfat_posix_pread_all(int fd, char* ptr, size_t num_bytes, off_t offset, size_t align) {
+  while (num_bytes > 0U) {
+    ssize_t n = pread(fd, ptr, num_bytes, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return -1;
+    }
+    size_t step = (size_t)n - ((size_t)n % align);
+    if (step == 0U) {
+      // Less than one aligned unit was read, so we are at the end of the image.
+      memset(&ptr[n], 0, num_bytes - (size_t)n);
+      break;
+    }
+    ptr += step;
+    num_bytes -= step;
+    offset += (off_t)step;
+  }
+  return 0;
+}
+
+// Write an entire range of bytes (retrying interrupted and short writes).
+static int _mfat_posix_pwrite_all(int fd, const char* ptr, size_t num_bytes, off_t offset) {
+  while (num_bytes > 0U) {
+    ssize_t n = pwrite(fd, ptr, num_bytes, offset);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return -1;
+    }
+    ptr += n;
+    num_bytes -= (size_t)n;
+    offset += n;
+  }
+  return 0;
+}
+
+// Read a range of bytes via the bounce buffer of the device (for buffers that are not aligned for
+// direct I/O). Large ranges are read in several chunks.
+static int _mfat_posix_read_bounced(mfat_posix_t* dev, char* ptr, size_t num_bytes, off_t offset) {
+  int result = 0;
+  pthread_mutex_lock(&dev->bounce_mutex);
+  for (size_t pos = 0U; pos < num_bytes && result == 0; pos += MFAT_POSIX_BOUNCE_SIZE) {
+    size_t count = num_bytes - pos;
+    if (count > MFAT_POSIX_BOUNCE_SIZE) {
+      count = MFAT_POSIX_BOUNCE_SIZE;
+    }
+    result = _mfat_posix_pread_all(
+        dev->fd, dev->bounce, count, offset + (off_t)pos, MFAT_POSIX_DIRECT_ALIGNMENT);
+    if (result == 0) {
+      memcpy(&ptr[pos], dev->bounce, count);
+    }
+  }
+  pthread_mutex_unlock(&dev->bounce_mutex);
+  return result;
+}
+
+// Write a range of bytes via the bounce buffer of the device (for buffers that are not aligned for
+// direct I/O). Large ranges are written in several chunks.
+static int _mfat_posix_write_bounced(mfat_posix_t* dev,
+                                     const char* ptr,
+                                     size_t num_bytes,
+                                     off_t offset) {
+  int result = 0;
+  pthread_mutex_lock(&dev->bounce_mutex);
+  for (size_t pos = 0U; pos < num_bytes && result == 0; pos += MFAT_POSIX_BOUNCE_SIZE) {
+    size_t count = num_bytes - pos;
+    if (count > MFAT_POSIX_BOUNCE_SIZE) {
+      count = MFAT_POSIX_BOUNCE_SIZE;
+    }
+    memcpy(dev->bounce, &ptr[pos], count);
+    result = _mfat_posix_pwrite_all(dev->fd, dev->bounce, count, offset + (off_t)pos);
+  }
+  pthread_mutex_unlock(&dev->bounce_mutex);
+  return result;
+}
+
+static int _mfat_posix_read_blocks(char* ptr,
+                                   unsigned first_block,
+                                   unsigned num_blocks,
+                                   void* custom) {
+  mfat_posix_t* dev = (mfat_posix_t*)custom;
+  size_t num_bytes = (size_t)num_blocks * MFAT_BLOCK_SIZE;
+  off_t offset = (off_t)first_block * MFAT_BLOCK_SIZE;
+  if (_mfat_posix_is_aligned(dev, ptr)) {
+    return _mfat_posix_pread_all(dev->fd, ptr, num_bytes, offset, _mfat_posix_alignment(dev));
+  }
+  return _mfat_posix_read_bounced(dev, ptr, num_bytes, offset);
+}
+
+static int _mfat_posix_write_blocks(const char* ptr,
+                                    unsigned first_block,
+                                    unsigned num_blocks,
+                                    void* custom) {
+  mfat_posix_t* dev = (mfat_posix_t*)custom;
+  size_t num_bytes = (size_t)num_blocks * MFAT_BLOCK_SIZE;
+  off_t offset = (off_t)first_block * MFAT_BLOCK_SIZE;
+  if (_mfat_posix_is_aligned(dev, ptr)) {
+    return _mfat_posix_pwrite_all(dev->fd, ptr, num_bytes, offset);
+  }
+  return _mfat_posix_write_bounced(dev, ptr, num_bytes, offset);
+}
+
+static int _mfat_posix_read_block(char* ptr, unsigned block_no, void* custom) {
+  return _mfat_posix_read_blocks(ptr, block_no, 1U, custom);
+}
+
+static int _mfat_posix_write_block(const char* ptr, unsigned block_no, void* custom) {
+  return _mfat_posix_write_blocks(ptr, block_no, 1U, custom);
+}
+
+//--------------------------------------------------------------------------------------------------
+// Asynchronous reads (io_uring).
+//--------------------------------------------------------------------------------------------------
+
+#if MFAT_POSIX_ENABLE_IO_URING
+static int _mfat_posix_uring_enter(int ring_fd,
+                                   unsigned to_submit,
+                                   unsigned min_complete,
+                                   unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void _mfat_posix_uring_destroy(mfat_posix_uring_t* uring) {
+  if (uring->sqes != NULL && uring->sqes != MAP_FAILED) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if (uring->cq_ptr != NULL && uring->cq_ptr != MAP_FAILED && uring->cq_ptr != uring->sq_ptr) {
+    munmap(uring->cq_ptr, uring->cq_size);
+  }
+  if (uring->sq_ptr != NULL && uring->sq_ptr != MAP_FAILED) {
+    munmap(uring->sq_ptr, uring->sq_size);
+  }
+  if (uring->ring_fd >= 0) {
+    close(uring->ring_fd);
+  }
+  free(uring->bounce);
+  free(uring->req);
+  pthread_mutex_destroy(&uring->mutex);
+  free(uring);
+}
+
+// Allocate the bounce buffers for unaligned direct reads, and register them with io_uring so that
+// the kernel does not have to map them for every request.
+static int _mfat_posix_uring_alloc_bounce(mfat_posix_uring_t* uring) {
+  uring->bounce =
+      _mfat_posix_alloc_bounce(MFAT_POSIX_URING_BOUNCE_BUFFERS * MFAT_POSIX_URING_BOUNCE_SIZE);
+  if (uring->bounce == NULL) {
+    return 0;
+  }
+
+  // Failing to register the buffers is not fatal (e.g. due to RLIMIT_MEMLOCK).
+  struct iovec iov[MFAT_POSIX_URING_BOUNCE_BUFFERS];
+  for (unsigned i = 0U; i < MFAT_POSIX_URING_BOUNCE_BUFFERS; ++i) {
+    iov[i].iov_base = &uring->bounce[i * MFAT_POSIX_URING_BOUNCE_SIZE];
+    iov[i].iov_len = MFAT_POSIX_URING_BOUNCE_SIZE;
+  }
+  uring->bounce_registered = syscall(__NR_io_uring_register,
+                                     uring->ring_fd,
+                                     IORING_REGISTER_BUFFERS,
+                                     &iov[0],
+                                     MFAT_POSIX_URING_BOUNCE_BUFFERS) == 0;
+  return 1;
+}
+
+static mfat_posix_uring_t* _mfat_posix_uring_create(int direct) {
+  mfat_posix_uring_t* uring = (mfat_posix_uring_t*)calloc(1U, sizeof(mfat_posix_uring_t));
+  if (uring == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&uring->mutex, NULL);
+
+  // Create the io_uring instance.
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  uring->ring_fd = (int)syscall(__NR_io_uring_setup, MFAT_POSIX_URING_ENTRIES, &p);
+  if (uring->ring_fd < 0) {
+    _mfat_posix_uring_destroy(uring);
+    return NULL;
+  }
+
+  // Map the rings. With IORING_FEAT_SINGLE_MMAP, the SQ and CQ rings share a single mapping.
+  uring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  uring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    uring->sq_size = uring->cq_size = (uring->sq_size > uring->cq_size) ? uring->sq_size
+                                                                        : uring->cq_size;
+  }
+  uring->sq_ptr = mmap(NULL,
+                       uring->sq_size,
+                       PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE,
+                       uring->ring_fd,
+                       IORING_OFF_SQ_RING);
+  if (uring->sq_ptr == MAP_FAILED) {
+    _mfat_posix_uring_destroy(uring);
+    return NULL;
+  }
+  if (single_mmap) {
+    uring->cq_ptr = uring->sq_ptr;
+  } else {
+    uring->cq_ptr = mmap(NULL,
+                         uring->cq_size,
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE,
+                         uring->ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (uring->cq_ptr == MAP_FAILED) {
+      _mfat_posix_uring_destroy(uring);
+      return NULL;
+    }
+  }
+  uring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = (struct io_uring_sqe*)mmap(NULL,
+                                           uring->sqes_size,
+                                           PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE,
+                                           uring->ring_fd,
+                                           IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    _mfat_posix_uring_destroy(uring);
+    return NULL;
+  }
+
+  char* sq = (char*)uring->sq_ptr;
+  uring->sq_head = (unsigned*)(sq + p.sq_off.head);
+  uring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+  uring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+  uring->sq_array = (unsigned*)(sq + p.sq_off.array);
+  uring->sq_entries = p.sq_entries;
+  char* cq = (char*)uring->cq_ptr;
+  uring->cq_head = (unsigned*)(cq + p.cq_off.head);
+  uring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+  uring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  if (direct && !_mfat_posix_uring_alloc_bounce(uring)) {
+    _mfat_posix_uring_destroy(uring);
+    return NULL;
+  }
+
+  return uring;
+}
+
+// Submit all the queued SQ entries to the kernel (optionally waiting for a completion).
+static int _mfat_posix_uring_flush(mfat_posix_uring_t* uring, unsigned min_complete) {
+  while (uring->num_queued > 0U || min_complete > 0U) {
+    unsigned flags = (min_complete > 0U) ? IORING_ENTER_GETEVENTS : 0U;
+    int n = _mfat_posix_uring_enter(uring->ring_fd, uring->num_queued, min_complete, flags);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    uring->num_queued -= (unsigned)n;
+    if (min_complete > 0U || n == 0) {
+      break;
+    }
+  }
+  return 0;
+}
+
+// Make sure that the request table can hold the given tag.
+static mfat_posix_req_t* _mfat_posix_uring_get_req(mfat_posix_uring_t* uring, unsigned tag) {
+  if (tag >= uring->num_req) {
+    unsigned num_req = (tag + 1U) * 2U;
+    mfat_posix_req_t* req =
+        (mfat_posix_req_t*)realloc(uring->req, num_req * sizeof(mfat_posix_req_t));
+    if (req == NULL) {
+      return NULL;
+    }
+    memset(&req[uring->num_req], 0, (num_req - uring->num_req) * sizeof(mfat_posix_req_t));
+    uring->req = req;
+    uring->num_req = num_req;
+  }
+  return &uring->req[tag];
+}
+
+// Get a free registered bounce buffer (returns -1 if there is none).
+static int _mfat_posix_uring_get_bounce(mfat_posix_uring_t* uring, size_t num_bytes) {
+  if (num_bytes <= MFAT_POSIX_URING_BOUNCE_SIZE) {
+    for (int i = 0; i < MFAT_POSIX_URING_BOUNCE_BUFFERS; ++i) {
+      if (!uring->bounce_busy[i]) {
+        uring->bounce_busy[i] = 1U;
+        return i;
+      }
+    }
+  }
+  return -1;
+}
+
+static int _mfat_posix_submit_read(char* ptr,
+                                   unsigned first_block,
+                                   unsigned num_blocks,
+                                   unsigned tag,
+                                   void* custom) {
+  mfat_posix_t* dev = (mfat_posix_t*)custom;
+  mfat_posix_uring_t* uring = dev->uring;
+  int result = -1;
+  pthread_mutex_lock(&uring->mutex);
+
+  mfat_posix_req_t* req = _mfat_posix_uring_get_req(uring, tag);
+  if (req == NULL) {
+    goto done;
+  }
+
+  // Make room in the SQ ring (if it is full, submit the queued entries first).
+  unsigned tail = *uring->sq_tail;
+  if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+    if (_mfat_posix_uring_flush(uring, 0U) != 0 ||
+        tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+      goto done;
+    }
+  }
+  unsigned idx = tail & *uring->sq_mask;
+  struct io_uring_sqe* sqe = &uring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+
+  req->ptr = ptr;
+  req->num_bytes = (size_t)num_blocks * MFAT_BLOCK_SIZE;
+  req->offset = (off_t)first_block * MFAT_BLOCK_SIZE;
+  req->bounce_idx = -1;
+  req->status = 0;
+  if (_mfat_posix_is_aligned(dev, ptr)) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->addr = (uint64_t)(uintptr_t)ptr;
+  } else {
+    req->bounce_idx = _mfat_posix_uring_get_bounce(uring, req->num_bytes);
+    if (req->bounce_idx >= 0) {
+      // Read into a registered bounce buffer (copied to the target buffer at completion).
+      sqe->opcode = uring->bounce_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+      char* bounce = &uring->bounce[req->bounce_idx * MFAT_POSIX_URING_BOUNCE_SIZE];
+      sqe->addr = (uint64_t)(uintptr_t)bounce;
+      sqe->buf_index = uring->bounce_registered ? (uint16_t)req->bounce_idx : 0U;
+    } else {
+      // The request does not fit in a registered bounce buffer, or they are all busy. Complete the
+      // read right away via the bounce buffer of the device, and queue a no-op that reports the
+      // completion.
+      req->status = _mfat_posix_read_bounced(dev, ptr, req->num_bytes, req->offset);
+      req->num_bytes = 0U;
+      sqe->opcode = IORING_OP_NOP;
+    }
+  }
+
+  // Queue the request. It is submitted to the kernel together with other queued requests when MFAT
+  // polls for completions.
+  if (sqe->opcode != IORING_OP_NOP) {
+    sqe->fd = dev->fd;
+    sqe->len = (uint32_t)req->num_bytes;
+    sqe->off = (uint64_t)req->offset;
+  }
+  sqe->user_data = tag;
+  uring->sq_array[idx] = idx;
+  __atomic_store_n(uring->sq_tail, tail + 1U, __ATOMIC_RELEASE);
+  ++uring->num_queued;
+  ++uring->num_inflight;
+  result = 0;
+
+done:
+  pthread_mutex_unlock(&uring->mutex);
+  return result;
+}
+
+static int _mfat_posix_poll(int wait, unsigned* tag, int* status, void* custom) {
+  mfat_posix_t* dev = (mfat_posix_t*)custom;
+  mfat_posix_uring_t* uring = dev->uring;
+  int result = -1;
+  pthread_mutex_lock(&uring->mutex);
+
+  if (_mfat_posix_uring_flush(uring, 0U) != 0) {
+    goto done;
+  }
+  while (1) {
+    // Is there a completion in the CQ ring?
+    unsigned head = *uring->cq_head;
+    if (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &uring->cqes[head & *uring->cq_mask];
+      *tag = (unsigned)cqe->user_data;
+      int res = cqe->res;
+      __atomic_store_n(uring->cq_head, head + 1U, __ATOMIC_RELEASE);
+      --uring->num_inflight;
+
+      mfat_posix_req_t* req = _mfat_posix_uring_get_req(uring, *tag);
+      if (req == NULL) {
+        goto done;
+      }
+      char* target = (req->bounce_idx >= 0)
+                         ? &uring->bounce[req->bounce_idx * MFAT_POSIX_URING_BOUNCE_SIZE]
+                         : req->ptr;
+      *status = req->status;
+      if (res < 0) {
+        *status = -1;
+      } else if ((size_t)res < req->num_bytes) {
+        // A short read: finish the request synchronously (this also handles EOF). Direct I/O
+        // requires that we continue from an aligned position.
+        size_t align = _mfat_posix_alignment(dev);
+        size_t done = (size_t)res - ((size_t)res % align);
+        *status = _mfat_posix_pread_all(
+            dev->fd, &target[done], req->num_bytes - done, req->offset + (off_t)done, align);
+      }
+      if (req->bounce_idx >= 0) {
+        if (*status == 0) {
+          memcpy(req->ptr, target, req->num_bytes);
+        }
+        uring->bounce_busy[req->bounce_idx] = 0U;
+        req->bounce_idx = -1;
+      }
+      result = 1;
+      break;
+    }
+
+    // Nothing has completed yet.
+    if (!wait) {
+      result = 0;
+      break;
+    }
+    if (uring->num_inflight == 0U || _mfat_posix_uring_flush(uring, 1U) != 0) {
+      break;
+    }
+  }
+
+done:
+  pthread_mutex_unlock(&uring->mutex);
+  return result;
+}
+#endif  // MFAT_POSIX_ENABLE_IO_URING
+
+//--------------------------------------------------------------------------------------------------
+// Memory mapping.
+//--------------------------------------------------------------------------------------------------
+
+static int _mfat_posix_map(mfat_posix_t* dev) {
+  // A mapping is read only.
+  if ((dev->flags & MFAT_POSIX_WRITE) != 0) {
+    return 0;
+  }
+
+  // Get the size of the device (this works for both image files and block devices).
+  off_t size = lseek(dev->fd, 0, SEEK_END);
+  if (size < MFAT_BLOCK_SIZE) {
+    return 0;
+  }
+  off_t num_blocks = size / MFAT_BLOCK_SIZE;
+  dev->map_blocks = (num_blocks > (off_t)UINT32_MAX) ? UINT32_MAX : (uint32_t)num_blocks;
+
+  void* map =
+      mmap(NULL, (size_t)dev->map_blocks * MFAT_BLOCK_SIZE, PROT_READ, MAP_SHARED, dev->fd, 0);
+  if (map == MAP_FAILED) {
+    return 0;
+  }
+  dev->map = map;
+  return 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Public API functions.
+//--------------------------------------------------------------------------------------------------
+
+mfat_posix_t* mfat_posix_open(const char* path, int flags) {
+  mfat_posix_t* dev = (mfat_posix_t*)calloc(1U, sizeof(mfat_posix_t));
+  if (dev == NULL) {
+    return NULL;
+  }
+  dev->flags = flags;
+  pthread_mutex_init(&dev->bounce_mutex, NULL);
+
+  int oflag = ((flags & MFAT_POSIX_WRITE) != 0) ? O_RDWR : O_RDONLY;
+#ifdef O_DIRECT
+  if ((flags & MFAT_POSIX_DIRECT) != 0) {
+    oflag |= O_DIRECT;
+  }
+#endif
+  dev->fd = open(path, oflag);
+  if (dev->fd == -1) {
+    pthread_mutex_destroy(&dev->bounce_mutex);
+    free(dev);
+    return NULL;
+  }
+
+  // Direct I/O with unaligned buffers goes via a bounce buffer, which is allocated once.
+  if ((flags & MFAT_POSIX_DIRECT) != 0) {
+    dev->bounce = _mfat_posix_alloc_bounce(MFAT_POSIX_BOUNCE_SIZE);
+    if (dev->bounce == NULL) {
+      close(dev->fd);
+      pthread_mutex_destroy(&dev->bounce_mutex);
+      free(dev);
+      return NULL;
+    }
+  }
+
+  // Memory map the device?
+  if ((flags & MFAT_POSIX_MMAP) != 0 && !_mfat_posix_map(dev)) {
+    free(dev->bounce);
+    close(dev->fd);
+    pthread_mutex_destroy(&dev->bounce_mutex);
+    free(dev);
+    return NULL;
+  }
+
+#if MFAT_POSIX_ENABLE_IO_URING
+  // Failing to set up io_uring is not fatal (we fall back to synchronous reads).
+  if ((flags & MFAT_POSIX_IO_URING) != 0) {
+    dev->uring = _mfat_posix_uring_create((flags & MFAT_POSIX_DIRECT) != 0);
+  }
+#endif
+
+  return dev;
+}
+
+void mfat_posix_close(mfat_posix_t* dev) {
+  if (dev == NULL) {
+    return;
+  }
+#if MFAT_POSIX_ENABLE_IO_URING
+  if (dev->uring != NULL) {
+    _mfat_posix_uring_destroy(dev->uring);
+  }
+#endif
+  if (dev->map != NULL) {
+    munmap(dev->map, (size_t)dev->map_blocks * MFAT_BLOCK_SIZE);
+  }
+  close(dev->fd);
+  free(dev->bounce);
+  pthread_mutex_destroy(&dev->bounce_mutex);
+  free(dev);
+}
+
+void mfat_posix_get_mount_opts(mfat_posix_t* dev, mfat_mount_opts_t* opts) {
+  opts->read = _mfat_posix_read_block;
+  opts->write = _mfat_posix_write_block;
+  opts->read_blocks = _mfat_posix_read_blocks;
+  opts->write_blocks = _mfat_posix_write_blocks;
+  opts->custom = dev;
+  opts->image = dev->map;
+  opts->image_blocks = dev->map_blocks;
+#if MFAT_POSIX_ENABLE_IO_URING
+  if (dev->uring != NULL) {
+    opts->submit_read = _mfat_posix_submit_read;
+    opts->poll = _mfat_posix_poll;
+  }
+#endif
+}
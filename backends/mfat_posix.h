@@ -0,0 +1,86 @@
+//--------------------------------------------------------------------------------------------------
+// Copyright (C) 2022 Marcus Geelnard
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//   1. Redistributions of source code must retain the above copyright notice, this list of
+//      conditions and the following disclaimer.
+//
+//   2. Redistributions in binary form must reproduce the above copyright notice, this list of
+//      conditions and the following disclaimer in the documentation and/or other materials provided
+//      with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+// WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//--------------------------------------------------------------------------------------------------
+
+#ifndef MFAT_POSIX_H_
+#define MFAT_POSIX_H_
+
+#include <mfat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Flags for mfat_posix_open().
+#define MFAT_POSIX_WRITE 1     ///< Open the device for writing (default: read only).
+#define MFAT_POSIX_DIRECT 2    ///< Bypass the OS page cache (O_DIRECT).
+#define MFAT_POSIX_IO_URING 4  ///< Use io_uring for asynchronous reads (Linux only).
+#define MFAT_POSIX_MMAP 8      ///< Memory map the device (read only).
+
+/// A block device backend for POSIX systems (image files or block devices).
+struct mfat_posix_struct;
+typedef struct mfat_posix_struct mfat_posix_t;
+
+/// @brief Open an image file or a block device.
+///
+/// All block I/O is done with pread()/pwrite(), i.e. with a single system call per request
+/// (multi-block requests included).
+///
+/// With MFAT_POSIX_DIRECT, the device is opened with O_DIRECT. Requests with buffers that are not
+/// suitably aligned are transparently bounced via an aligned buffer, which is allocated once per
+/// device (large requests are bounced in several chunks). Note that the logical block size of the
+/// device must be MFAT_BLOCK_SIZE (512 bytes) for direct I/O to work.
+///
+/// With MFAT_POSIX_IO_URING, asynchronous reads (see mfat_read_async()) are queued in an io_uring
+/// submission queue, and all the queued requests are submitted with a single system call when MFAT
+/// polls for completions. If io_uring is not supported by the system, MFAT falls back to
+/// synchronous reads. Unaligned direct reads use a pool of bounce buffers that are registered with
+/// the io_uring instance (IORING_OP_READ_FIXED), so no memory is allocated per request.
+///
+/// With MFAT_POSIX_MMAP, the entire device is memory mapped, and MFAT accesses the blocks directly
+/// in the mapping (bypassing the I/O functions and the MFAT block caches). The device can not be
+/// opened for writing (MFAT_POSIX_WRITE) in this mode.
+/// @param path Path to the image file or the block device.
+/// @param flags A combination of MFAT_POSIX_* flags.
+/// @returns a device object, or NULL on failure.
+mfat_posix_t* mfat_posix_open(const char* path, int flags);
+
+/// @brief Close a device.
+///
+/// The device must be unmounted first.
+/// @param dev The device object.
+void mfat_posix_close(mfat_posix_t* dev);
+
+/// @brief Fill out the I/O functions of a set of mount options.
+///
+/// The read/write functions, the custom data pointer and (if available) the asynchronous I/O
+/// functions and the memory mapped image are set. Other fields of the mount options are left
+/// unchanged.
+/// @param dev The device object.
+/// @param opts The mount options to fill out.
+void mfat_posix_get_mount_opts(mfat_posix_t* dev, mfat_mount_opts_t* opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // MFAT_POSIX_H_
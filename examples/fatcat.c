@@ -22,29 +22,15 @@
 //--------------------------------------------------------------------------------------------------
 
 #include <mfat.h>
+#include <mfat_posix.h>
 
-#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-static int blkread(char* ptr, unsigned block_no, void* custom) {
-  int fd = *(int*)custom;
-  if (lseek(fd, MFAT_BLOCK_SIZE * (size_t)block_no, SEEK_SET) == -1) {
-    return -1;
-  }
-  size_t num_bytes = read(fd, ptr, MFAT_BLOCK_SIZE);
-  return (num_bytes != MFAT_BLOCK_SIZE) && (num_bytes != 0) ? -1 : 0;
-}
-
-static int blkwrite(const char* ptr, unsigned block_no, void* custom) {
-  int fd = *(int*)custom;
-  if (lseek(fd, MFAT_BLOCK_SIZE * (size_t)block_no, SEEK_SET) == -1) {
-    return -1;
-  }
-  size_t num_bytes = write(fd, ptr, MFAT_BLOCK_SIZE);
-  return (num_bytes != MFAT_BLOCK_SIZE) && (num_bytes != 0) ? -1 : 0;
-}
+// Number of blocks in the data block cache.
+#define DATA_CACHE_BLOCKS 64U
 
 int main(int argc, char** argv) {
   // Get arguments.
@@ -56,15 +42,22 @@ int main(int argc, char** argv) {
   const char* file_name = argv[2];
 
   // Open the FAT image file or device.
-  int img_fd = open(img_path, O_RDONLY);
-  if (img_fd == -1) {
+  mfat_posix_t* dev = mfat_posix_open(img_path, 0);
+  if (dev == NULL) {
     fprintf(stderr, "*** Failed to open the FAT image\n");
     return 1;
   }
 
-  // Mount the image in MFAT.
-  if (mfat_mount(blkread, blkwrite, &img_fd) == -1) {
-    close(img_fd);
+  // Mount the image in MFAT (the backend uses multi-block reads for better performance). We use a
+  // larger data cache than the built-in one, so that read-ahead can prefetch entire clusters.
+  void* data_cache_mem = malloc(mfat_cache_mem_size(DATA_CACHE_BLOCKS));
+  mfat_mount_opts_t opts = {0};
+  mfat_posix_get_mount_opts(dev, &opts);
+  opts.data_cache_mem = data_cache_mem;
+  opts.data_cache_blocks = DATA_CACHE_BLOCKS;
+  if (mfat_mount_ex(&opts) == -1) {
+    free(data_cache_mem);
+    mfat_posix_close(dev);
     fprintf(stderr, "*** Failed to init MFAT\n");
     return 1;
   }
@@ -95,7 +88,8 @@ int main(int argc, char** argv) {
 
   // Unmount and close down.
   mfat_unmount();
-  close(img_fd);
+  free(data_cache_mem);
+  mfat_posix_close(dev);
 
   return 0;
 }
\ No newline at end of file
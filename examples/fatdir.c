@@ -22,30 +22,10 @@
 //--------------------------------------------------------------------------------------------------
 
 #include <mfat.h>
+#include <mfat_posix.h>
 
-#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/types.h>
-#include <unistd.h>
-
-static int blkread(char* ptr, unsigned block_no, void* custom) {
-  int fd = *(int*)custom;
-  if (lseek(fd, MFAT_BLOCK_SIZE * (size_t)block_no, SEEK_SET) == -1) {
-    return -1;
-  }
-  size_t num_bytes = read(fd, ptr, MFAT_BLOCK_SIZE);
-  return (num_bytes != MFAT_BLOCK_SIZE) && (num_bytes != 0) ? -1 : 0;
-}
-
-static int blkwrite(const char* ptr, unsigned block_no, void* custom) {
-  int fd = *(int*)custom;
-  if (lseek(fd, MFAT_BLOCK_SIZE * (size_t)block_no, SEEK_SET) == -1) {
-    return -1;
-  }
-  size_t num_bytes = write(fd, ptr, MFAT_BLOCK_SIZE);
-  return (num_bytes != MFAT_BLOCK_SIZE) && (num_bytes != 0) ? -1 : 0;
-}
 
 int main(int argc, char** argv) {
   // Get arguments.
@@ -57,15 +37,17 @@ int main(int argc, char** argv) {
   const char* dir_name = argv[2];
 
   // Open the FAT image file or device.
-  int img_fd = open(img_path, O_RDONLY);
-  if (img_fd == -1) {
+  mfat_posix_t* dev = mfat_posix_open(img_path, 0);
+  if (dev == NULL) {
     fprintf(stderr, "*** Failed to open the FAT image\n");
     return 1;
   }
 
   // Mount the image in MFAT.
-  if (mfat_mount(blkread, blkwrite, &img_fd) == -1) {
-    close(img_fd);
+  mfat_mount_opts_t opts = {0};
+  mfat_posix_get_mount_opts(dev, &opts);
+  if (mfat_mount_ex(&opts) == -1) {
+    mfat_posix_close(dev);
     fprintf(stderr, "*** Failed to init MFAT\n");
     return 1;
   }
@@ -75,27 +57,18 @@ int main(int argc, char** argv) {
   if (dirp != NULL) {
     mfat_dirent_t* dirent;
     while ((dirent = mfat_readdir(dirp)) != NULL) {
-      // Construct full path.
-      char path[256];
-      snprintf(&path[0], 255, "%s/%s", dir_name, dirent->d_name);
-      path[255] = 0;
-
-      // Stat and print file info + name.
-      mfat_stat_t stat;
-      if (mfat_stat(path, &stat) != -1) {
-        printf("%u-%02u-%02u %02u:%02u:%02u\t%s\t%u\t%s\n",
-               stat.st_mtim.year,
-               stat.st_mtim.month,
-               stat.st_mtim.day,
-               stat.st_mtim.hour,
-               stat.st_mtim.minute,
-               stat.st_mtim.second,
-               MFAT_S_ISDIR(stat.st_mode) ? "<DIR>" : "",
-               stat.st_size,
-               dirent->d_name);
-      } else {
-        fprintf(stderr, "*** Failed to stat %s\n", path);
-      }
+      // Print file info + name (the directory entry holds the file status, so no stat is needed).
+      const mfat_stat_t* stat = &dirent->d_stat;
+      printf("%u-%02u-%02u %02u:%02u:%02u\t%s\t%u\t%s\n",
+             stat->st_mtim.year,
+             stat->st_mtim.month,
+             stat->st_mtim.day,
+             stat->st_mtim.hour,
+             stat->st_mtim.minute,
+             stat->st_mtim.second,
+             MFAT_S_ISDIR(stat->st_mode) ? "<DIR>" : "",
+             stat->st_size,
+             dirent->d_name);
     }
     mfat_closedir(dirp);
   } else {
@@ -104,7 +77,7 @@ int main(int argc, char** argv) {
 
   // Unmount and close down.
   mfat_unmount();
-  close(img_fd);
+  mfat_posix_close(dev);
 
   return 0;
 }
\ No newline at end of file
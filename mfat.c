@@ -55,7 +55,69 @@
 #define MFAT_ENABLE_GPT 1
 #endif
 
-// Number of cached blocks.
+// Enable cluster extent maps for open files?
+#ifndef MFAT_ENABLE_EXTENTS
+#define MFAT_ENABLE_EXTENTS 1
+#endif
+
+// Enable thread-safe operation (using caller-provided lock functions)?
+#ifndef MFAT_ENABLE_THREADS
+#define MFAT_ENABLE_THREADS 0
+#endif
+
+// Enable sequential read-ahead?
+#ifndef MFAT_ENABLE_READAHEAD
+#define MFAT_ENABLE_READAHEAD 1
+#endif
+
+// Enable asynchronous block reads (using caller-provided submit/poll functions)?
+#ifndef MFAT_ENABLE_AIO
+#define MFAT_ENABLE_AIO 1
+#endif
+
+// Enable memory mapped volume images (block reads resolve to addresses in the image)?
+#ifndef MFAT_ENABLE_MMAP
+#define MFAT_ENABLE_MMAP 1
+#endif
+
+// Enable the directory entry cache (using caller-provided memory)?
+#ifndef MFAT_ENABLE_DENTRY_CACHE
+#define MFAT_ENABLE_DENTRY_CACHE 1
+#endif
+
+// Enable hashed name indexes for directories (using caller-provided memory)?
+#ifndef MFAT_ENABLE_DIR_INDEX
+#define MFAT_ENABLE_DIR_INDEX 1
+#endif
+
+// Enable long file name (VFAT LFN) support for path lookups and directory reading?
+#ifndef MFAT_ENABLE_LFN
+#define MFAT_ENABLE_LFN 1
+#endif
+
+// Enable vectorized (SIMD) scanning of directory blocks, where supported by the target?
+#ifndef MFAT_ENABLE_SIMD
+#define MFAT_ENABLE_SIMD 1
+#endif
+
+// Maximum number of asynchronous block read requests that can be in flight at the same time.
+#ifndef MFAT_AIO_QUEUE_DEPTH
+#define MFAT_AIO_QUEUE_DEPTH 8
+#endif
+
+// Default read-ahead window for new file descriptors (number of clusters).
+#ifndef MFAT_READAHEAD_CLUSTERS
+#define MFAT_READAHEAD_CLUSTERS 1
+#endif
+
+// Maximum number of dirty FAT block ranges that are tracked per partition (for FAT mirroring).
+#ifndef MFAT_NUM_FAT_DIRTY_RANGES
+#define MFAT_NUM_FAT_DIRTY_RANGES 8
+#endif
+
+// Number of blocks in each of the built-in block caches (the data cache and the FAT cache). The
+// built-in caches are used for caches that are not given caller-provided memory at mount time (zero
+// leaves out the built-in caches, which makes cache memory a required mount option).
 #ifndef MFAT_NUM_CACHED_BLOCKS
 #define MFAT_NUM_CACHED_BLOCKS 2
 #endif
@@ -70,6 +132,11 @@
 #define MFAT_NUM_DIRS 2
 #endif
 
+// Maximum number of directory name indexes (see MFAT_ENABLE_DIR_INDEX).
+#ifndef MFAT_NUM_DIR_INDEXES
+#define MFAT_NUM_DIR_INDEXES 4
+#endif
+
 // Maximum number of partitions to support.
 #ifndef MFAT_NUM_PARTITIONS
 #define MFAT_NUM_PARTITIONS 4
@@ -88,6 +155,18 @@
 #define DBGF(_fmt, ...)
 #endif  //  MFAT_ENABLE_DEBUG
 
+//--------------------------------------------------------------------------------------------------
+// SIMD support.
+//--------------------------------------------------------------------------------------------------
+
+#if MFAT_ENABLE_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#define MFAT_SIMD_SSE2 1
+#elif MFAT_ENABLE_SIMD && defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define MFAT_SIMD_NEON 1
+#endif
+
 //--------------------------------------------------------------------------------------------------
 // FAT definitions (used for encoding/decoding).
 //--------------------------------------------------------------------------------------------------
@@ -100,13 +179,7 @@
 #define MFAT_PART_ID_FAT32_LBA 0x0c
 #define MFAT_PART_ID_FAT16_GT32GB_LBA 0x0e
 
-// File attribute flags.
-#define MFAT_ATTR_READ_ONLY 0x01
-#define MFAT_ATTR_HIDDEN 0x02
-#define MFAT_ATTR_SYSTEM 0x04
-#define MFAT_ATTR_VOLUME_ID 0x08
-#define MFAT_ATTR_DIRECTORY 0x10
-#define MFAT_ATTR_ARCHIVE 0x20
+// File attribute flags (the individual attribute bits are defined in mfat.h).
 #define MFAT_ATTR_LONG_NAME 0x0f
 
 //--------------------------------------------------------------------------------------------------
@@ -143,17 +216,34 @@ typedef int mfat_bool_t;
 // read/write operations.
 typedef struct {
   uint32_t cluster_no;         ///< The cluster number.
+  uint32_t cluster_idx;        ///< The index of the cluster in the cluster chain (0 = first).
   uint32_t block_in_cluster;   ///< The block offset within the cluster (0..blocks_per_cluster-1).
   uint32_t cluster_start_blk;  ///< Absolute block number of the first block of the cluster.
 } mfat_cluster_pos_t;
 
+// A range of consecutive blocks.
+typedef struct {
+  uint32_t first;  // First block.
+  uint32_t count;  // Number of blocks.
+} mfat_block_range_t;
+
 typedef struct {
   uint32_t type;
   uint32_t first_block;
   uint32_t num_blocks;
   uint32_t blocks_per_cluster;
 #if MFAT_ENABLE_WRITE
-  uint32_t num_clusters;
+  uint32_t num_clusters;  // Highest valid cluster number (valid cluster numbers start at 2).
+  uint32_t fsinfo_block;  // Absolute block number of the FAT32 FSInfo sector (0 = none).
+  uint32_t free_count;    // Number of free clusters (0xffffffff = unknown).
+  uint32_t next_free;     // Hint: Where to start looking for free clusters.
+  mfat_bool_t fsinfo_dirty;
+  uint32_t* free_bitmap;  // One bit per cluster number (1 = free), or NULL if there is no bitmap.
+
+  // Blocks of the first FAT (relative to the start of the FAT) that have been modified since the
+  // FAT was last mirrored to the other FAT copies. The ranges are sorted and non-adjacent.
+  mfat_block_range_t fat_dirty[MFAT_NUM_FAT_DIRTY_RANGES];
+  uint32_t num_fat_dirty;
 #endif
   uint32_t blocks_per_fat;
   uint32_t num_fats;
@@ -172,6 +262,9 @@ typedef struct {
   uint32_t first_cluster;     // Starting cluster for the file.
   uint32_t dir_entry_block;   // Block number for the directory entry of this file.
   uint32_t dir_entry_offset;  // Offset (in bytes) into the directory entry block.
+#if MFAT_ENABLE_DENTRY_CACHE
+  uint32_t dir_cluster;  // First cluster of the parent directory (part of the dentry cache key).
+#endif
 } mfat_file_info_t;
 
 // File handle, corresponding to a file descriptor (fd).
@@ -182,48 +275,189 @@ typedef struct {
   uint32_t offset;           // Current byte offset relative to the file start (seek offset).
   uint32_t current_cluster;  // Current cluster (representing the current seek offset)
   mfat_file_info_t info;
+#if MFAT_ENABLE_WRITE
+  uint32_t last_cluster;  // Last cluster of the cluster chain (0 = not yet known).
+#endif
+#if MFAT_ENABLE_EXTENTS
+  mfat_extent_t* extents;        // Cluster extent map (NULL if the file has no extent map).
+  uint32_t num_extents;          // Number of extents in the extent map.
+  uint32_t max_extents;          // Capacity of the extent map.
+  mfat_bool_t extents_complete;  // true if the extent map covers the entire cluster chain.
+#endif
+#if MFAT_ENABLE_READAHEAD
+  uint32_t ra_clusters;  // Read-ahead window, in clusters (0 = read-ahead is disabled).
+  uint32_t ra_offset;    // File offset after the last read (for detecting sequential reads).
+#endif
 } mfat_file_t;
 
 // Forward declared in mfat.h, refered to as the type mfat_dir_t.
 struct mfat_dir_struct {
-  mfat_file_t* file;        // File corresponding to this directory (NULL if not open).
   mfat_dirent_t dirent;     // The current dirent (as returned by readdir()).
+  mfat_bool_t open;         // true if the directory stream is open.
+  int fd;                   // The fd that the stream was opened from (-1 if it does not have one).
+  int type;                 // MFAT_FILE_TYPE_DIR or MFAT_FILE_TYPE_FAT16ROOTDIR.
+  uint32_t part_no;         // Partition number.
   mfat_cluster_pos_t cpos;  // Cluster position.
   uint32_t blocks_left;     // Blocks left to read (only used for FAT16 root dirs).
   uint32_t block_offset;    // Offset relative to the block start.
-  int items_left;           // HACK!!!!
+#if MFAT_ENABLE_LFN
+  // The long file name that is being collected. The name is built backwards (as UTF-8) at the end
+  // of dirent.d_name, since the LFN entries are stored in reverse order.
+  uint8_t lfn_seq;       // Sequence number of the last collected LFN entry (0 = none).
+  uint8_t lfn_checksum;  // Checksum of the short name that the LFN entries belong to.
+  uint16_t lfn_pos;      // Start of the collected name in dirent.d_name.
+  uint16_t lfn_low;      // Pending low surrogate (0 = none).
+#endif
 };
 
+// Caller-allocated directory streams are stored in mfat_dir_storage_t objects, which must be large
+// enough (a negative array size gives a compilation error otherwise).
+typedef char mfat_dir_storage_size_check_t
+    [(sizeof(mfat_dir_t) <= sizeof(mfat_dir_storage_t)) ? 1 : -1];
+
 typedef struct {
   int state;
   uint32_t blk_no;
-  uint8_t buf[MFAT_BLOCK_SIZE];
+  uint8_t* buf;  // Points to one of the blocks in mfat_cache_t::data.
+  int pins;      // Number of outstanding read views of the block (pinned blocks are not evicted).
+  int lru_prev;  // Previous (more recently used) item in the LRU list (-1 = none).
+  int lru_next;  // Next (less recently used) item in the LRU list (-1 = none).
 } mfat_cached_block_t;
 
+// Size of the block cache hash index: The smallest power of two that is at least twice the number
+// of cached blocks (this keeps the load factor of the open addressing hash table at or below 50%).
+#define MFAT_SMEAR1(x) ((x) | ((x) >> 1))
+#define MFAT_SMEAR2(x) (MFAT_SMEAR1(x) | (MFAT_SMEAR1(x) >> 2))
+#define MFAT_SMEAR4(x) (MFAT_SMEAR2(x) | (MFAT_SMEAR2(x) >> 4))
+#define MFAT_SMEAR8(x) (MFAT_SMEAR4(x) | (MFAT_SMEAR4(x) >> 8))
+#define MFAT_SMEAR16(x) (MFAT_SMEAR8(x) | (MFAT_SMEAR8(x) >> 16))
+#define MFAT_CACHE_HASH_SIZE(n) (MFAT_SMEAR16(2U * (uint32_t)(n)-1U) + 1U)
+
+// Maximum number of blocks in a block cache (512 MiB).
+#define MFAT_MAX_CACHED_BLOCKS 0x100000U
+
+// Size of the memory for a block cache with n blocks: The block buffers, followed by the cached
+// block items, the owner and slots arrays and the hash index (see _mfat_cache_init()).
+#define MFAT_CACHE_MEM_SIZE(n)                                                        \
+  ((size_t)(n) * (MFAT_BLOCK_SIZE + sizeof(mfat_cached_block_t) + 2U * sizeof(int)) + \
+   (size_t)MFAT_CACHE_HASH_SIZE(n) * sizeof(int))
+
 typedef struct {
-  mfat_cached_block_t block[MFAT_NUM_CACHED_BLOCKS];
-#if MFAT_NUM_CACHED_BLOCKS > 1
-  // This is a priority queue: The last item in the queue is an index to the
-  // least recently used cached block item.
-  int pri[MFAT_NUM_CACHED_BLOCKS];
-#endif
+  mfat_cached_block_t* block;  // The cached block items (num_blocks items).
+  int num_blocks;
+
+  // This is a doubly linked LRU list: The head is the most recently used cached block item, and the
+  // tail is the least recently used cached block item.
+  int lru_head;
+  int lru_tail;
+
+  // This is an open addressing (linear probing) hash index that maps block numbers to cached block
+  // items (-1 = empty slot).
+  int* hash;
+  uint32_t hash_mask;
+
+  // Total number of pins of the cached blocks (the buffers of pinned blocks must not be moved).
+  int num_pins;
+
+  // The block buffers are kept in a separate array, so that the buffers of cached blocks can be
+  // rearranged in memory (e.g. for writing a run of adjacent blocks with a single request).
+  uint8_t* data;
+
+  // The index of the cached block item that currently owns each buffer in the data array.
+  int* owner;
+
+  // Scratch space for collecting runs of cached block items (num_blocks items).
+  int* slots;
 } mfat_cache_t;
 
+#if MFAT_NUM_CACHED_BLOCKS > 0
+// Memory for a built-in block cache.
+typedef union {
+  uint8_t bytes[MFAT_CACHE_MEM_SIZE(MFAT_NUM_CACHED_BLOCKS)];
+  mfat_cached_block_t align;  // Makes the memory suitably aligned for the cached block items.
+} mfat_cache_mem_t;
+#endif
+
+#if MFAT_ENABLE_AIO
+// An asynchronous block read request that is in flight. The request tag is the index of the request
+// in the request table.
 typedef struct {
+  mfat_aio_t* aio;      // The asynchronous operation that the request belongs to (NULL = unused).
+  uint8_t* buf;         // Target buffer.
+  uint32_t first_blk;   // First block of the run of blocks to read.
+  uint32_t num_blocks;  // Number of blocks to read.
+} mfat_aio_req_t;
+#endif
+
+#if MFAT_ENABLE_DIR_INDEX
+// A hashed name index of a directory. The index data lives in the caller-provided index memory,
+// and consists of a hash table (num_slots words) followed by the cluster chain of the directory
+// (num_clusters words). A hash table slot holds the entry number of a directory entry (bits 0-15)
+// and 15 bits of the hash of its name (bits 16-30), with bit 31 set (0 = empty slot). With LFN
+// support, entries that have a long file name get a second slot (for the hash of the long name).
+typedef struct {
+  uint32_t* mem;          // Start of the index data (NULL = unused item).
+  uint32_t num_slots;     // Size of the hash table (a power of two).
+  uint32_t num_clusters;  // Number of clusters of the directory (0 for FAT16 root directories).
+  uint32_t num_entries;   // Number of entries in the hash table.
+  uint32_t dir_cluster;   // First cluster of the directory (0 = FAT16 root directory).
+  int part_no;            // Partition of the directory.
+  uint32_t last_use;      // Time stamp of the last use (for LRU eviction).
+} mfat_dir_index_t;
+#endif
+
+// Forward declared in mfat.h, refered to as the type mfat_ctx_t.
+struct mfat_ctx_struct {
   mfat_bool_t initialized;
   int active_partition;
   mfat_read_block_fun_t read;
+  mfat_read_blocks_fun_t read_blocks;
 #if MFAT_ENABLE_WRITE
   mfat_write_block_fun_t write;
+  mfat_write_blocks_fun_t write_blocks;
+  int fat_mirroring;  // When to update the FAT copies (MFAT_FAT_MIRROR_*).
+#endif
+#if MFAT_ENABLE_THREADS
+  mfat_lock_fun_t lock;
+  mfat_lock_fun_t unlock;
+#endif
+#if MFAT_ENABLE_AIO
+  mfat_submit_read_fun_t submit_read;
+  mfat_poll_fun_t poll;
+  mfat_aio_req_t aio_req[MFAT_AIO_QUEUE_DEPTH];  // Protected by the data cache lock.
+  mfat_aio_t aio_detached;  // Owner of requests whose operation was abandoned (see aio_wait).
+#endif
+#if MFAT_ENABLE_DENTRY_CACHE
+  // A hash table of recently looked up directory entries (protected by the data cache lock).
+  mfat_dentry_t* dentries;
+  uint32_t num_dentries;
+#endif
+#if MFAT_ENABLE_DIR_INDEX
+  // Hashed name indexes of recently searched directories. The index data is kept packed at the
+  // start of the index memory (protected by the data cache lock).
+  uint32_t* dir_index_mem;
+  uint32_t dir_index_words;
+  uint32_t dir_index_clock;
+  mfat_dir_index_t dir_index[MFAT_NUM_DIR_INDEXES];
+#endif
+#if MFAT_ENABLE_MMAP
+  // A memory mapped image of the storage medium (NULL = none). It is read only, and blocks are only
+  // accessed via read only views (see _mfat_view_block()).
+  const uint8_t* image;
+  uint32_t image_blocks;
 #endif
   void* custom;
   mfat_partition_t partition[MFAT_NUM_PARTITIONS];
   mfat_file_t file[MFAT_NUM_FDS];
   mfat_dir_t dir[MFAT_NUM_DIRS];
   mfat_cache_t cache[MFAT_NUM_CACHES];
-} mfat_ctx_t;
+#if MFAT_NUM_CACHED_BLOCKS > 0
+  mfat_cache_mem_t cache_mem[MFAT_NUM_CACHES];
+#endif
+};
 
-// Statically allocated state.
+// Statically allocated state of the default context (used by the functions that do not take a
+// context argument).
 static mfat_ctx_t s_ctx;
 
 //--------------------------------------------------------------------------------------------------
@@ -234,6 +468,61 @@ static inline uint32_t _mfat_min(uint32_t a, uint32_t b) {
   return (a < b) ? a : b;
 }
 
+static inline uint32_t _mfat_max(uint32_t a, uint32_t b) {
+  return (a > b) ? a : b;
+}
+
+// Acquire one of the locks of a context (no-op unless thread-safe operation is enabled).
+//
+// In order to avoid deadlocks, locks are always acquired in this order (and a lock is never
+// acquired twice by the same thread):
+//   1. The lock of a file (MFAT_LOCK_FILE).
+//   2. The data cache lock (MFAT_LOCK_DATA_CACHE).
+//   3. The FAT cache lock (MFAT_LOCK_FAT_CACHE), which also protects the cluster allocation state
+//      of the partitions.
+// No other lock is acquired while the FD table lock (MFAT_LOCK_FD_TABLE) is held.
+static inline void _mfat_lock(mfat_ctx_t* ctx, unsigned lock_id) {
+#if MFAT_ENABLE_THREADS
+  if (ctx->lock != NULL) {
+    ctx->lock(lock_id, ctx->custom);
+  }
+#else
+  (void)ctx;
+  (void)lock_id;
+#endif
+}
+
+// Release one of the locks of a context.
+static inline void _mfat_unlock(mfat_ctx_t* ctx, unsigned lock_id) {
+#if MFAT_ENABLE_THREADS
+  if (ctx->unlock != NULL) {
+    ctx->unlock(lock_id, ctx->custom);
+  }
+#else
+  (void)ctx;
+  (void)lock_id;
+#endif
+}
+
+// Get the lock ID of an open file.
+static inline unsigned _mfat_file_lock_id(const mfat_ctx_t* ctx, const mfat_file_t* f) {
+  return MFAT_LOCK_FILE((unsigned)(f - &ctx->file[0]));
+}
+
+// Count trailing zero bits (x must be non-zero).
+static inline uint32_t _mfat_ctz(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (uint32_t)__builtin_ctz(x);
+#else
+  uint32_t n = 0U;
+  while ((x & 1U) == 0U) {
+    x >>= 1;
+    ++n;
+  }
+  return n;
+#endif
+}
+
 static uint32_t _mfat_get_word(const uint8_t* buf) {
   return ((uint32_t)buf[0]) | (((uint32_t)buf[1]) << 8);
 }
@@ -243,6 +532,20 @@ static uint32_t _mfat_get_dword(const uint8_t* buf) {
          (((uint32_t)buf[3]) << 24);
 }
 
+#if MFAT_ENABLE_WRITE
+static void _mfat_set_word(uint8_t* buf, uint32_t value) {
+  buf[0] = (uint8_t)value;
+  buf[1] = (uint8_t)(value >> 8);
+}
+
+static void _mfat_set_dword(uint8_t* buf, uint32_t value) {
+  buf[0] = (uint8_t)value;
+  buf[1] = (uint8_t)(value >> 8);
+  buf[2] = (uint8_t)(value >> 16);
+  buf[3] = (uint8_t)(value >> 24);
+}
+#endif
+
 static mfat_bool_t _mfat_cmpbuf(const uint8_t* a, const uint8_t* b, const uint32_t nbyte) {
   for (uint32_t i = 0; i < nbyte; ++i) {
     if (a[i] != b[i]) {
@@ -317,53 +620,329 @@ static mfat_bool_t _mfat_is_valid_bpb(const uint8_t* bpb_buf) {
   return true;
 }
 
-static mfat_bool_t _mfat_is_valid_shortname_file(const uint8_t* dir_entry) {
-  const uint8_t attr = dir_entry[11];
-  if (((attr & MFAT_ATTR_LONG_NAME) == MFAT_ATTR_LONG_NAME) ||
-      ((attr & MFAT_ATTR_VOLUME_ID) == MFAT_ATTR_VOLUME_ID)) {
-    return false;
+// Number of directory entries in a block.
+#define MFAT_DIR_ENTRIES_PER_BLOCK (MFAT_BLOCK_SIZE / 32U)
+
+// The result of scanning a directory block. Bit i of each mask represents entry i of the block.
+typedef struct {
+  uint32_t free;   // Free entry slots (deleted or unused entries).
+  uint32_t files;  // File/dir entries (before the end of the directory).
+  uint32_t match;  // File/dir entries with a matching name.
+#if MFAT_ENABLE_LFN
+  uint32_t lfn;  // Long file name entries (before the end of the directory).
+#endif
+  uint32_t end;  // Entry number of the end of the directory (MFAT_DIR_ENTRIES_PER_BLOCK = none).
+} mfat_dir_scan_t;
+
+#if defined(MFAT_SIMD_SSE2)
+typedef __m128i mfat_entry_bytes_t;
+
+// Gather byte number offset of each of the 16 entries of a directory block into one vector. The
+// entry vectors are narrowed pairwise (keeping the even bytes) in four rounds.
+static inline mfat_entry_bytes_t _mfat_gather_entry_bytes(const uint8_t* buf, uint32_t offset) {
+  const __m128i even = _mm_set1_epi16(0x00ff);
+  __m128i v[MFAT_DIR_ENTRIES_PER_BLOCK];
+  for (uint32_t i = 0U; i < MFAT_DIR_ENTRIES_PER_BLOCK; ++i) {
+    v[i] = _mm_and_si128(_mm_loadu_si128((const __m128i*)&buf[i * 32U + offset]), even);
   }
-  return true;
+  for (uint32_t n = MFAT_DIR_ENTRIES_PER_BLOCK / 2U; n > 0U; n /= 2U) {
+    for (uint32_t i = 0U; i < n; ++i) {
+      v[i] = _mm_packus_epi16(v[2U * i], v[2U * i + 1U]);
+      if (n > 1U) {
+        v[i] = _mm_and_si128(v[i], even);
+      }
+    }
+  }
+  return v[0];
 }
 
-static mfat_cached_block_t* _mfat_get_cached_block(uint32_t blk_no, int cache_type) {
-  // Pick the relevant cache.
-  mfat_cache_t* cache = &s_ctx.cache[cache_type];
+// Get a bit mask of the bytes of x that are equal to y.
+static inline uint32_t _mfat_bytes_eq_mask(mfat_entry_bytes_t x, uint8_t y) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_set1_epi8((char)y)));
+}
+
+// Get a bit mask of the bytes of x that are equal to y after masking with m.
+static inline uint32_t _mfat_bytes_masked_eq_mask(mfat_entry_bytes_t x, uint8_t m, uint8_t y) {
+  return _mfat_bytes_eq_mask(_mm_and_si128(x, _mm_set1_epi8((char)m)), y);
+}
+#elif defined(MFAT_SIMD_NEON)
+typedef uint8x16_t mfat_entry_bytes_t;
+
+// Gather byte number offset of each of the 16 entries of a directory block into one vector. The
+// entry vectors are narrowed pairwise (keeping the even bytes) in four rounds.
+static inline mfat_entry_bytes_t _mfat_gather_entry_bytes(const uint8_t* buf, uint32_t offset) {
+  uint8x16_t v[MFAT_DIR_ENTRIES_PER_BLOCK];
+  for (uint32_t i = 0U; i < MFAT_DIR_ENTRIES_PER_BLOCK; ++i) {
+    v[i] = vld1q_u8(&buf[i * 32U + offset]);
+  }
+  for (uint32_t n = MFAT_DIR_ENTRIES_PER_BLOCK / 2U; n > 0U; n /= 2U) {
+    for (uint32_t i = 0U; i < n; ++i) {
+      v[i] = vuzp1q_u8(v[2U * i], v[2U * i + 1U]);
+    }
+  }
+  return v[0];
+}
+
+// Get a bit mask of the bytes of x that are equal to y.
+static inline uint32_t _mfat_bytes_eq_mask(mfat_entry_bytes_t x, uint8_t y) {
+  static const uint8_t s_bits[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  const uint8x16_t bits = vandq_u8(vceqq_u8(x, vdupq_n_u8(y)), vld1q_u8(&s_bits[0]));
+  return (uint32_t)vaddv_u8(vget_low_u8(bits)) | ((uint32_t)vaddv_u8(vget_high_u8(bits)) << 8);
+}
+
+// Get a bit mask of the bytes of x that are equal to y after masking with m.
+static inline uint32_t _mfat_bytes_masked_eq_mask(mfat_entry_bytes_t x, uint8_t m, uint8_t y) {
+  return _mfat_bytes_eq_mask(vandq_u8(x, vdupq_n_u8(m)), y);
+}
+#else
+typedef uint64_t mfat_entry_bytes_t;
+
+// Gather byte number offset of eight consecutive directory entries into a 64-bit word.
+static inline mfat_entry_bytes_t _mfat_gather_entry_bytes(const uint8_t* buf, uint32_t offset) {
+  uint64_t x = 0U;
+  for (uint32_t i = 0U; i < 8U; ++i) {
+    x |= ((uint64_t)buf[i * 32U + offset]) << (i * 8U);
+  }
+  return x;
+}
+
+// Get a bit mask of the bytes of x that are equal to y (SWAR, without false positives).
+static inline uint32_t _mfat_bytes_eq_mask(mfat_entry_bytes_t x, uint8_t y) {
+  const uint64_t low7 = 0x7f7f7f7f7f7f7f7fULL;
+  x ^= 0x0101010101010101ULL * y;
+  const uint64_t zero = ~(((x & low7) + low7) | x | low7);
+  return (uint32_t)(((zero >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+// Get a bit mask of the bytes of x that are equal to y after masking with m.
+static inline uint32_t _mfat_bytes_masked_eq_mask(mfat_entry_bytes_t x, uint8_t m, uint8_t y) {
+  return _mfat_bytes_eq_mask(x & (0x0101010101010101ULL * m), y);
+}
+#endif
+
+// Classify all the entries of a directory block at once, and optionally match their names against
+// a canonical (8.3) file name (fname may be NULL). The first byte and the attribute byte of all the
+// entries are gathered into one vector (or two 64-bit words when SIMD is not available), and the
+// end marker, deleted, volume ID and LFN tests are done with a few vector compares. Only the
+// entries whose first byte matches the name are compared in full.
+static void _mfat_scan_dir_block(const uint8_t* buf, const char* fname, mfat_dir_scan_t* scan) {
+  const uint8_t first = (fname != NULL) ? (uint8_t)fname[0] : 0U;
+#if defined(MFAT_SIMD_SSE2) || defined(MFAT_SIMD_NEON)
+  const uint32_t num_parts = 1U;
+#else
+  const uint32_t num_parts = 2U;
+#endif
+  uint32_t unused = 0U;
+  uint32_t deleted = 0U;
+  uint32_t no_file = 0U;
+  uint32_t candidates = 0U;
+#if MFAT_ENABLE_LFN
+  uint32_t long_name = 0U;
+#endif
+  for (uint32_t k = 0U; k < num_parts; ++k) {
+    const uint8_t* part_buf = &buf[k * (MFAT_BLOCK_SIZE / num_parts)];
+    const uint32_t shift = k * (MFAT_DIR_ENTRIES_PER_BLOCK / num_parts);
+    const mfat_entry_bytes_t b0 = _mfat_gather_entry_bytes(part_buf, 0U);
+    const mfat_entry_bytes_t attr = _mfat_gather_entry_bytes(part_buf, 11U);
+    unused |= _mfat_bytes_eq_mask(b0, 0x00U) << shift;
+    deleted |= _mfat_bytes_eq_mask(b0, 0xe5U) << shift;
+    // Note: MFAT_ATTR_LONG_NAME includes MFAT_ATTR_VOLUME_ID.
+    no_file |= _mfat_bytes_masked_eq_mask(attr, MFAT_ATTR_VOLUME_ID, MFAT_ATTR_VOLUME_ID) << shift;
+#if MFAT_ENABLE_LFN
+    long_name |= _mfat_bytes_masked_eq_mask(attr, 0x3fU, MFAT_ATTR_LONG_NAME) << shift;
+#endif
+    if (fname != NULL) {
+      candidates |= _mfat_bytes_eq_mask(b0, first) << shift;
+    }
+  }
+
+  // Entries after the first unused entry are not part of the directory.
+  uint32_t before_end = (unused != 0U) ? (unused & (0U - unused)) - 1U
+                                       : (1U << MFAT_DIR_ENTRIES_PER_BLOCK) - 1U;
+  scan->free = unused | deleted;
+  scan->files = ~(unused | deleted | no_file) & before_end;
+
+  // Compare the full names of the entries that passed the first byte test.
+  uint32_t match = 0U;
+  candidates &= scan->files;
+  while (candidates != 0U) {
+    const uint32_t i = _mfat_ctz(candidates);
+    candidates &= candidates - 1U;
+    if (_mfat_cmpbuf(&buf[i * 32U], (const uint8_t*)fname, 11U)) {
+      match |= 1U << i;
+    }
+  }
+  scan->match = match;
+#if MFAT_ENABLE_LFN
+  scan->lfn = long_name & ~(unused | deleted) & before_end;
+#endif
+  scan->end = (unused != 0U) ? _mfat_ctz(unused) : MFAT_DIR_ENTRIES_PER_BLOCK;
+}
+
+#if MFAT_ENABLE_WRITE
+// Write a run of consecutive blocks from the source buffer to storage (bypassing the cache). If
+// possible, the entire run is written with a single request.
+static mfat_bool_t _mfat_write_blocks(mfat_ctx_t* ctx,
+                                      const uint8_t* buf,
+                                      uint32_t first_blk,
+                                      uint32_t num_blocks) {
+  if (ctx->write_blocks != NULL) {
+    DBGF("Writing %" PRIu32 " blocks starting at block %" PRIu32, num_blocks, first_blk);
+    return ctx->write_blocks((const char*)buf, first_blk, num_blocks, ctx->custom) != -1;
+  }
 
-#if MFAT_NUM_CACHED_BLOCKS > 1
-  // By default, pick the last (least recently used) item in the pirority queue...
-  int item_id = cache->pri[MFAT_NUM_CACHED_BLOCKS - 1];
+  for (uint32_t i = 0U; i < num_blocks; ++i) {
+    if (ctx->write((const char*)&buf[i * MFAT_BLOCK_SIZE], first_blk + i, ctx->custom) == -1) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
 
-  // ...but override it if we have a cache hit.
-  for (int i = 0; i < MFAT_NUM_CACHED_BLOCKS; ++i) {
+// Lay out the memory of a block cache with num_blocks blocks, and initialize the cache (no blocks
+// are cached). The memory must be MFAT_CACHE_MEM_SIZE(num_blocks) bytes, suitably aligned for any
+// object type.
+static void _mfat_cache_init(mfat_cache_t* cache, void* mem, int num_blocks) {
+  uint8_t* p = (uint8_t*)mem;
+  cache->data = p;
+  p += (size_t)num_blocks * MFAT_BLOCK_SIZE;
+  cache->block = (mfat_cached_block_t*)(void*)p;
+  p += (size_t)num_blocks * sizeof(mfat_cached_block_t);
+  cache->owner = (int*)(void*)p;
+  p += (size_t)num_blocks * sizeof(int);
+  cache->slots = (int*)(void*)p;
+  p += (size_t)num_blocks * sizeof(int);
+  cache->hash = (int*)(void*)p;
+  uint32_t hash_size = MFAT_CACHE_HASH_SIZE(num_blocks);
+  cache->hash_mask = hash_size - 1U;
+  cache->num_blocks = num_blocks;
+  cache->num_pins = 0;
+
+  // Assign the block buffers to the cached blocks, and link the items in index order.
+  for (int i = 0; i < num_blocks; ++i) {
     mfat_cached_block_t* cb = &cache->block[i];
-    if (cb->state != MFAT_INVALID && cb->blk_no == blk_no) {
-      item_id = i;
-      break;
+    cb->state = MFAT_INVALID;
+    cb->blk_no = 0U;
+    cb->buf = &cache->data[(size_t)i * MFAT_BLOCK_SIZE];
+    cb->pins = 0;
+    cb->lru_prev = i - 1;
+    cb->lru_next = (i < num_blocks - 1) ? i + 1 : -1;
+    cache->owner[i] = i;
+  }
+  cache->lru_head = 0;
+  cache->lru_tail = num_blocks - 1;
+
+  // No blocks are cached yet.
+  for (uint32_t i = 0U; i < hash_size; ++i) {
+    cache->hash[i] = -1;
+  }
+}
+
+// Get the home slot of a block number in the block cache hash index.
+static inline uint32_t _mfat_cache_hash_slot(const mfat_cache_t* cache, uint32_t blk_no) {
+  // Fibonacci hashing (spreads runs of consecutive block numbers across the table).
+  uint32_t h = blk_no * 0x9e3779b1U;
+  return (h ^ (h >> 16)) & cache->hash_mask;
+}
+
+// Look up a block number in the hash index of a cache.
+// Returns the index of the cached block item, or -1 if the block is not in the cache.
+static int _mfat_cache_hash_find(const mfat_cache_t* cache, uint32_t blk_no) {
+  uint32_t slot = _mfat_cache_hash_slot(cache, blk_no);
+  while (true) {
+    int item_id = cache->hash[slot];
+    if (item_id < 0 || cache->block[item_id].blk_no == blk_no) {
+      return item_id;
     }
+    slot = (slot + 1U) & cache->hash_mask;
   }
+}
 
-  // Move the selected item to the front of the priority queue (i.e. it's the most recently used
-  // cache item).
-  {
-    int prev_id = item_id;
-    for (int i = 0; i < MFAT_NUM_CACHED_BLOCKS; ++i) {
-      int this_id = cache->pri[i];
-      cache->pri[i] = prev_id;
-      if (this_id == item_id) {
-        break;
-      }
-      prev_id = this_id;
+// Add a cached block item to the hash index of a cache (keyed by its current block number).
+static void _mfat_cache_hash_insert(mfat_cache_t* cache, int item_id) {
+  uint32_t slot = _mfat_cache_hash_slot(cache, cache->block[item_id].blk_no);
+  while (cache->hash[slot] >= 0) {
+    slot = (slot + 1U) & cache->hash_mask;
+  }
+  cache->hash[slot] = item_id;
+}
+
+// Remove a cached block item from the hash index of a cache (if it is in the index).
+static void _mfat_cache_hash_remove(mfat_cache_t* cache, int item_id) {
+  const uint32_t mask = cache->hash_mask;
+
+  // Find the slot of the item.
+  uint32_t slot = _mfat_cache_hash_slot(cache, cache->block[item_id].blk_no);
+  while (cache->hash[slot] != item_id) {
+    if (cache->hash[slot] < 0) {
+      return;
+    }
+    slot = (slot + 1U) & mask;
+  }
+
+  // Backward shift deletion: Move later items of the probe sequence into the hole, so that we don't
+  // need tombstones.
+  uint32_t hole = slot;
+  for (uint32_t i = (hole + 1U) & mask; cache->hash[i] >= 0; i = (i + 1U) & mask) {
+    uint32_t home = _mfat_cache_hash_slot(cache, cache->block[cache->hash[i]].blk_no);
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      cache->hash[hole] = cache->hash[i];
+      hole = i;
     }
   }
+  cache->hash[hole] = -1;
+}
+
+// Move a cached block item to the front of the LRU list (i.e. it's the most recently used cache
+// item).
+static void _mfat_cache_lru_touch(mfat_cache_t* cache, int item_id) {
+  if (cache->lru_head == item_id) {
+    return;
+  }
+
+  // Unlink the item (it is not the head, so it has a previous item).
+  mfat_cached_block_t* cb = &cache->block[item_id];
+  cache->block[cb->lru_prev].lru_next = cb->lru_next;
+  if (cb->lru_next >= 0) {
+    cache->block[cb->lru_next].lru_prev = cb->lru_prev;
+  } else {
+    cache->lru_tail = cb->lru_prev;
+  }
+
+  // Insert the item at the head of the list.
+  cb->lru_prev = -1;
+  cb->lru_next = cache->lru_head;
+  cache->block[cache->lru_head].lru_prev = item_id;
+  cache->lru_head = item_id;
+}
+
+static mfat_cached_block_t* _mfat_get_cached_block(mfat_ctx_t* ctx,
+                                                   uint32_t blk_no,
+                                                   int cache_type) {
+  // Pick the relevant cache.
+  mfat_cache_t* cache = &ctx->cache[cache_type];
+
+  // Look up the block in the hash index. On a cache miss, pick the least recently used item that is
+  // not pinned.
+  int item_id = _mfat_cache_hash_find(cache, blk_no);
+  mfat_bool_t is_hit = (item_id >= 0);
+  if (!is_hit) {
+    item_id = cache->lru_tail;
+    while (item_id >= 0 && cache->block[item_id].pins > 0) {
+      item_id = cache->block[item_id].lru_prev;
+    }
+    if (item_id < 0) {
+      DBGF("Cache %d: All cached blocks are pinned", cache_type);
+      return NULL;
+    }
+  }
+  _mfat_cache_lru_touch(cache, item_id);
 
   mfat_cached_block_t* cached_block = &cache->block[item_id];
-#else
-  mfat_cached_block_t* cached_block = &cache->block[0];
-#endif
 
   // Reassign the cached block to the requested block number (if necessary).
-  if (cached_block->blk_no != blk_no) {
+  if (!is_hit) {
 #if MFAT_ENABLE_DEBUG
     if (cached_block->state != MFAT_INVALID) {
       DBGF("Cache %d: Evicting block %" PRIu32 " in favor of block %" PRIu32,
@@ -377,7 +956,7 @@ static mfat_cached_block_t* _mfat_get_cached_block(uint32_t blk_no, int cache_ty
     // Flush the block?
     if (cached_block->state == MFAT_DIRTY) {
       DBGF("Cache %d: Flushing evicted block %" PRIu32, cache_type, cached_block->blk_no);
-      if (s_ctx.write((const char*)cached_block->buf, cached_block->blk_no, s_ctx.custom) == -1) {
+      if (!_mfat_write_blocks(ctx, cached_block->buf, cached_block->blk_no, 1U)) {
         // FATAL: We can't recover from here... :-(
         DBGF("Cache %d: Failed to flush the block", cache_type);
         return NULL;
@@ -386,7 +965,9 @@ static mfat_cached_block_t* _mfat_get_cached_block(uint32_t blk_no, int cache_ty
 #endif
 
     // Set the new block ID.
+    _mfat_cache_hash_remove(cache, item_id);
     cached_block->blk_no = blk_no;
+    _mfat_cache_hash_insert(cache, item_id);
 
     // The contents of the buffer is now invalid.
     cached_block->state = MFAT_INVALID;
@@ -395,16 +976,38 @@ static mfat_cached_block_t* _mfat_get_cached_block(uint32_t blk_no, int cache_ty
   return cached_block;
 }
 
-static mfat_cached_block_t* _mfat_read_block(uint32_t block_no, int cache_type) {
+#if MFAT_ENABLE_WRITE || MFAT_ENABLE_READAHEAD
+// Find a valid block in a cache, without touching the cache state (e.g. the LRU order).
+// Returns NULL if the block is not in the cache.
+static mfat_cached_block_t* _mfat_find_cached_block(mfat_ctx_t* ctx,
+                                                    uint32_t blk_no,
+                                                    int cache_type) {
+  mfat_cache_t* cache = &ctx->cache[cache_type];
+  int item_id = _mfat_cache_hash_find(cache, blk_no);
+  mfat_cached_block_t* cb = (item_id >= 0) ? &cache->block[item_id] : NULL;
+  return (cb != NULL && cb->state != MFAT_INVALID) ? cb : NULL;
+}
+#endif
+
+// Read a block through a cache (the cached block may be modified). Memory mapped images are read
+// only, so their blocks can only be accessed with _mfat_view_block().
+static mfat_cached_block_t* _mfat_read_block(mfat_ctx_t* ctx, uint32_t block_no, int cache_type) {
+#if MFAT_ENABLE_MMAP
+  if (ctx->image != NULL) {
+    DBGF("Block %" PRIu32 ": The memory mapped image is read only", block_no);
+    return NULL;
+  }
+#endif
+
   // First query the cache.
-  mfat_cached_block_t* block = _mfat_get_cached_block(block_no, cache_type);
+  mfat_cached_block_t* block = _mfat_get_cached_block(ctx, block_no, cache_type);
   if (block == NULL) {
     return NULL;
   }
 
   // If necessary, read the block from storage.
   if (block->state == MFAT_INVALID) {
-    if (s_ctx.read((char*)block->buf, block_no, s_ctx.custom) == -1) {
+    if (ctx->read((char*)block->buf, block_no, ctx->custom) == -1) {
       return NULL;
     }
     block->state = MFAT_VALID;
@@ -413,39 +1016,130 @@ static mfat_cached_block_t* _mfat_read_block(uint32_t block_no, int cache_type)
   return block;
 }
 
-// Helper function for finding the next cluster in a cluster chain.
-static mfat_bool_t _mfat_next_cluster(const mfat_partition_t* part, uint32_t* cluster) {
+// Get a read only view of a block. With a memory mapped image we bypass the cache (there is nothing
+// to gain from copying), otherwise the block is read through the cache. The view is valid until the
+// next access to the same cache.
+static const uint8_t* _mfat_view_block(mfat_ctx_t* ctx, uint32_t block_no, int cache_type) {
+#if MFAT_ENABLE_MMAP
+  if (ctx->image != NULL) {
+    if (block_no >= ctx->image_blocks) {
+      DBGF("Block %" PRIu32 " is outside of the image", block_no);
+      return NULL;
+    }
+    return &ctx->image[(size_t)block_no * MFAT_BLOCK_SIZE];
+  }
+#endif
+  mfat_cached_block_t* block = _mfat_read_block(ctx, block_no, cache_type);
+  return (block != NULL) ? block->buf : NULL;
+}
+
+#if MFAT_ENABLE_WRITE || MFAT_ENABLE_READAHEAD
+// Make the buffers of a run of cached blocks contiguous in memory, in the order given by the slots
+// array. The buffer contents are swapped with the buffers that currently occupy the target memory
+// locations (i.e. the cached blocks stay intact, they just move around in memory).
+// NOTE: This must not be called when there are pinned blocks in the cache.
+static void _mfat_make_contiguous(mfat_cache_t* cache, const int* slots, int count) {
+  for (int k = 0; k < count; ++k) {
+    mfat_cached_block_t* cb = &cache->block[slots[k]];
+    uint8_t* target = &cache->data[(size_t)k * MFAT_BLOCK_SIZE];
+    if (cb->buf == target) {
+      continue;
+    }
+
+    // Swap buffers with the cached block that currently occupies the target buffer.
+    int other_id = cache->owner[k];
+    mfat_cached_block_t* other = &cache->block[other_id];
+    uint8_t tmp[MFAT_BLOCK_SIZE];
+    memcpy(&tmp[0], target, MFAT_BLOCK_SIZE);
+    memcpy(target, cb->buf, MFAT_BLOCK_SIZE);
+    memcpy(cb->buf, &tmp[0], MFAT_BLOCK_SIZE);
+    cache->owner[(cb->buf - cache->data) / MFAT_BLOCK_SIZE] = other_id;
+    cache->owner[k] = slots[k];
+    other->buf = cb->buf;
+    cb->buf = target;
+  }
+}
+#endif
+
+// Read a run of consecutive blocks from storage directly into the target buffer (bypassing the
+// cache). If possible, the entire run is read with a single request.
+static mfat_bool_t _mfat_read_blocks(mfat_ctx_t* ctx,
+                                     uint8_t* buf,
+                                     uint32_t first_blk,
+                                     uint32_t num_blocks) {
+#if MFAT_ENABLE_MMAP
+  if (ctx->image != NULL) {
+    if (first_blk >= ctx->image_blocks || num_blocks > ctx->image_blocks - first_blk) {
+      DBGF("Blocks %" PRIu32 "+%" PRIu32 " are outside of the image", first_blk, num_blocks);
+      return false;
+    }
+    memcpy(buf,
+           &ctx->image[(size_t)first_blk * MFAT_BLOCK_SIZE],
+           (size_t)num_blocks * MFAT_BLOCK_SIZE);
+    return true;
+  }
+#endif
+
+  if (ctx->read_blocks != NULL) {
+    DBGF("Reading %" PRIu32 " blocks starting at block %" PRIu32, num_blocks, first_blk);
+    return ctx->read_blocks((char*)buf, first_blk, num_blocks, ctx->custom) != -1;
+  }
+
+  for (uint32_t i = 0U; i < num_blocks; ++i) {
+    if (ctx->read((char*)&buf[i * MFAT_BLOCK_SIZE], first_blk + i, ctx->custom) == -1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Helper function for reading the FAT entry of a cluster (from the first FAT copy). FAT16 special
+// codes (BAD & EOC) are converted to FAT32 codes.
+static mfat_bool_t _mfat_get_fat_entry(mfat_ctx_t* ctx,
+                                       const mfat_partition_t* part,
+                                       uint32_t cluster,
+                                       uint32_t* value) {
   const uint32_t fat_entry_size = (part->type == MFAT_PART_TYPE_FAT32) ? 4 : 2;
 
-  uint32_t fat_offset = fat_entry_size * (*cluster);
+  uint32_t fat_offset = fat_entry_size * cluster;
   uint32_t fat_block =
       part->first_block + part->num_reserved_blocks + (fat_offset / MFAT_BLOCK_SIZE);
   uint32_t fat_block_offset = fat_offset % MFAT_BLOCK_SIZE;
 
-  // For FAT copy no. N (0..num_fats-1):
-  // fat_block += N * part->blocks_per_fat
-
   // Read the FAT block into a cached buffer.
-  mfat_cached_block_t* block = _mfat_read_block(fat_block, MFAT_CACHE_FAT);
-  if (block == NULL) {
+  const uint8_t* buf = _mfat_view_block(ctx, fat_block, MFAT_CACHE_FAT);
+  if (buf == NULL) {
     DBGF("Failed to read the FAT block %" PRIu32, fat_block);
     return false;
   }
-  uint8_t* buf = &block->buf[0];
 
   // Get the value for this cluster from the FAT.
-  uint32_t next_cluster;
   if (part->type == MFAT_PART_TYPE_FAT32) {
     // For FAT32 we mask off upper 4 bits, as the cluster number is 28 bits.
-    next_cluster = _mfat_get_dword(&buf[fat_block_offset]) & 0x0fffffffU;
+    *value = _mfat_get_dword(&buf[fat_block_offset]) & 0x0fffffffU;
   } else {
-    next_cluster = _mfat_get_word(&buf[fat_block_offset]);
-    if (next_cluster >= 0xfff7U) {
+    *value = _mfat_get_word(&buf[fat_block_offset]);
+    if (*value >= 0xfff7U) {
       // Convert FAT16 special codes (BAD & EOC) to FAT32 codes.
-      next_cluster |= 0x0fff0000U;
+      *value |= 0x0fff0000U;
     }
   }
 
+  return true;
+}
+
+// Helper function for finding the next cluster in a cluster chain.
+static mfat_bool_t _mfat_next_cluster(mfat_ctx_t* ctx,
+                                      const mfat_partition_t* part,
+                                      uint32_t* cluster) {
+  uint32_t next_cluster;
+  _mfat_lock(ctx, MFAT_LOCK_FAT_CACHE);
+  mfat_bool_t ok = _mfat_get_fat_entry(ctx, part, *cluster, &next_cluster);
+  _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+  if (!ok) {
+    return false;
+  }
+
   // This is a sanity check (failure indicates a corrupt filesystem). We should really do this check
   // BEFORE accessing the cluster instead.
   // We do not expect to see:
@@ -464,38 +1158,400 @@ static mfat_bool_t _mfat_next_cluster(const mfat_partition_t* part, uint32_t* cl
   return true;
 }
 
-// Helper function for finding the first block of a cluster.
-static uint32_t _mfat_first_block_of_cluster(const mfat_partition_t* part, uint32_t cluster) {
-  return part->first_data_block + ((cluster - 2U) * part->blocks_per_cluster);
-}
+#if MFAT_ENABLE_WRITE
+// Add a block of the first FAT to the set of FAT blocks that need to be mirrored to the other FAT
+// copies.
+static void _mfat_fat_mark_dirty(mfat_partition_t* part, uint32_t fat_blk) {
+  if (part->num_fats < 2U) {
+    return;
+  }
 
-// Initialize a cluster pos object to the current cluster & offset (e.g. for a file).
-static mfat_cluster_pos_t _mfat_cluster_pos_init(const mfat_partition_t* part,
-                                                 const uint32_t cluster_no,
-                                                 const uint32_t offset) {
-  mfat_cluster_pos_t cpos;
-  cpos.cluster_no = cluster_no;
-  cpos.block_in_cluster = (offset % (part->blocks_per_cluster * MFAT_BLOCK_SIZE)) / MFAT_BLOCK_SIZE;
-  cpos.cluster_start_blk = _mfat_first_block_of_cluster(part, cluster_no);
-  return cpos;
-}
+  mfat_block_range_t* ranges = &part->fat_dirty[0];
+  for (;;) {
+    // Find the first range that ends at or after the block.
+    uint32_t n = part->num_fat_dirty;
+    uint32_t i = 0U;
+    while (i < n && (ranges[i].first + ranges[i].count) < fat_blk) {
+      ++i;
+    }
 
-// Initialize a cluster pos object to the current file offset of the specified file.
-static mfat_cluster_pos_t _mfat_cluster_pos_init_from_file(const mfat_partition_t* part,
-                                                           const mfat_file_t* f) {
-  return _mfat_cluster_pos_init(part, f->current_cluster, f->offset);
-}
+    if (i < n && fat_blk >= ranges[i].first) {
+      if (fat_blk < (ranges[i].first + ranges[i].count)) {
+        // The block is already in the range.
+        return;
+      }
 
-// Advance a cluster pos by one block.
-static mfat_bool_t _mfat_cluster_pos_advance(mfat_cluster_pos_t* cpos,
-                                             const mfat_partition_t* part) {
-  ++cpos->block_in_cluster;
-  if (cpos->block_in_cluster == part->blocks_per_cluster) {
-    if (!_mfat_next_cluster(part, &cpos->cluster_no)) {
-      return false;
+      // Grow the range upwards, and merge it with the next range if they are now adjacent.
+      ++ranges[i].count;
+      if ((i + 1U) < n && ranges[i + 1U].first == (fat_blk + 1U)) {
+        ranges[i].count += ranges[i + 1U].count;
+        for (uint32_t k = i + 1U; k < (n - 1U); ++k) {
+          ranges[k] = ranges[k + 1U];
+        }
+        --part->num_fat_dirty;
+      }
+      return;
     }
-    cpos->cluster_start_blk = _mfat_first_block_of_cluster(part, cpos->cluster_no);
+    if (i < n && (fat_blk + 1U) == ranges[i].first) {
+      // Grow the range downwards.
+      --ranges[i].first;
+      ++ranges[i].count;
+      return;
+    }
+
+    if (n < MFAT_NUM_FAT_DIRTY_RANGES) {
+      // Insert a new range.
+      for (uint32_t k = n; k > i; --k) {
+        ranges[k] = ranges[k - 1U];
+      }
+      ranges[i].first = fat_blk;
+      ranges[i].count = 1U;
+      ++part->num_fat_dirty;
+      return;
+    }
+
+    // The set is full: Merge the two ranges that are closest to each other (the blocks in the gap
+    // will be mirrored needlessly, which is harmless), and try again.
+    uint32_t best = 0U;
+    uint32_t best_gap = 0xffffffffU;
+    for (uint32_t k = 0U; k < (n - 1U); ++k) {
+      uint32_t gap = ranges[k + 1U].first - (ranges[k].first + ranges[k].count);
+      if (gap < best_gap) {
+        best = k;
+        best_gap = gap;
+      }
+    }
+    ranges[best].count = ranges[best + 1U].first + ranges[best + 1U].count - ranges[best].first;
+    for (uint32_t k = best + 1U; k < (n - 1U); ++k) {
+      ranges[k] = ranges[k + 1U];
+    }
+    --part->num_fat_dirty;
+  }
+}
+
+// Helper function for writing the FAT entry of a cluster. The value is given as a FAT32 value (e.g.
+// 0x0fffffff for EOC), and is truncated to 16 bits for FAT16. Only the first FAT copy is updated
+// immediately. The other FAT copies are updated by _mfat_mirror_fat() (e.g. during sync).
+static mfat_bool_t _mfat_set_fat_entry(mfat_ctx_t* ctx,
+                                       mfat_partition_t* part,
+                                       uint32_t cluster,
+                                       uint32_t value) {
+  const uint32_t fat_entry_size = (part->type == MFAT_PART_TYPE_FAT32) ? 4 : 2;
+
+  uint32_t fat_offset = fat_entry_size * cluster;
+  uint32_t fat_block =
+      part->first_block + part->num_reserved_blocks + (fat_offset / MFAT_BLOCK_SIZE);
+  uint32_t fat_block_offset = fat_offset % MFAT_BLOCK_SIZE;
+
+  mfat_cached_block_t* block = _mfat_read_block(ctx, fat_block, MFAT_CACHE_FAT);
+  if (block == NULL) {
+    DBGF("Failed to read the FAT block %" PRIu32, fat_block);
+    return false;
+  }
+  uint8_t* buf = &block->buf[0];
+
+  if (part->type == MFAT_PART_TYPE_FAT32) {
+    // The upper 4 bits of FAT32 entries are reserved, and must be preserved.
+    uint32_t old_value = _mfat_get_dword(&buf[fat_block_offset]);
+    _mfat_set_dword(&buf[fat_block_offset], (old_value & 0xf0000000U) | (value & 0x0fffffffU));
+  } else {
+    _mfat_set_word(&buf[fat_block_offset], value & 0xffffU);
+  }
+  block->state = MFAT_DIRTY;
+
+  _mfat_fat_mark_dirty(part, fat_offset / MFAT_BLOCK_SIZE);
+
+  return true;
+}
+
+// Number of 32-bit words in the free cluster bitmap of a partition (bits 0..num_clusters).
+static uint32_t _mfat_free_bitmap_words(const mfat_partition_t* part) {
+  return (part->num_clusters + 32U) / 32U;
+}
+
+// Build the free cluster bitmap of a partition, by scanning the entire FAT once. The number of
+// free clusters is counted too.
+static mfat_bool_t _mfat_build_free_bitmap(mfat_ctx_t* ctx,
+                                           mfat_partition_t* part,
+                                           uint32_t* bitmap) {
+  const uint32_t fat_entry_size = (part->type == MFAT_PART_TYPE_FAT32) ? 4 : 2;
+  const uint32_t entries_per_block = MFAT_BLOCK_SIZE / fat_entry_size;
+
+  memset(bitmap, 0, _mfat_free_bitmap_words(part) * sizeof(uint32_t));
+
+  uint32_t free_count = 0U;
+  uint32_t fat_block = part->first_block + part->num_reserved_blocks;
+  for (uint32_t cluster = 0U; cluster <= part->num_clusters; ++fat_block) {
+    const uint8_t* buf = _mfat_view_block(ctx, fat_block, MFAT_CACHE_FAT);
+    if (buf == NULL) {
+      DBGF("Failed to read the FAT block %" PRIu32, fat_block);
+      return false;
+    }
+
+    for (uint32_t i = 0U; i < entries_per_block && cluster <= part->num_clusters; ++i, ++cluster) {
+      uint32_t value = (fat_entry_size == 4U) ? (_mfat_get_dword(&buf[i * 4U]) & 0x0fffffffU)
+                                              : _mfat_get_word(&buf[i * 2U]);
+      if (value == 0U && cluster >= 2U) {
+        bitmap[cluster / 32U] |= 1U << (cluster % 32U);
+        ++free_count;
+      }
+    }
+  }
+
+  // Now we know the exact number of free clusters.
+  if (free_count != part->free_count) {
+    part->free_count = free_count;
+    part->fsinfo_dirty = true;
+  }
+  part->free_bitmap = bitmap;
+  DBGF("Built free cluster bitmap: %" PRIu32 " free clusters", free_count);
+
+  return true;
+}
+
+// Find the first free cluster at or after the start cluster (wrapping around to the start of the
+// partition), using the free cluster bitmap.
+static mfat_bool_t _mfat_bitmap_find_free(const mfat_partition_t* part,
+                                          uint32_t start,
+                                          uint32_t* cluster) {
+  const uint32_t num_words = _mfat_free_bitmap_words(part);
+  uint32_t word_idx = start / 32U;
+  uint32_t word = part->free_bitmap[word_idx] & (0xffffffffU << (start % 32U));
+  for (uint32_t i = 0U; i <= num_words; ++i) {
+    if (word != 0U) {
+      *cluster = word_idx * 32U + _mfat_ctz(word);
+      return true;
+    }
+    word_idx = (word_idx + 1U < num_words) ? word_idx + 1U : 0U;
+    word = part->free_bitmap[word_idx];
+  }
+  return false;
+}
+
+// Check if a cluster is free (using the free cluster bitmap if there is one).
+static mfat_bool_t _mfat_is_cluster_free(mfat_ctx_t* ctx,
+                                         const mfat_partition_t* part,
+                                         uint32_t cluster,
+                                         mfat_bool_t* is_free) {
+  if (cluster < 2U || cluster > part->num_clusters) {
+    *is_free = false;
+    return true;
+  }
+  if (part->free_bitmap != NULL) {
+    *is_free = (part->free_bitmap[cluster / 32U] & (1U << (cluster % 32U))) != 0U;
+    return true;
+  }
+  uint32_t value;
+  if (!_mfat_get_fat_entry(ctx, part, cluster, &value)) {
+    return false;
+  }
+  *is_free = (value == 0U);
+  return true;
+}
+
+// Find a run of contiguous free clusters. The best fitting run is selected, i.e. the shortest run
+// that has at least the wanted number of clusters. If there is no such run, the longest run is
+// selected. This scans the entire FAT (or the free cluster bitmap, which is much faster).
+// @param want The wanted number of clusters.
+// @param[out] start The first cluster of the run.
+// @param[out] len The number of clusters in the run (zero if there are no free clusters).
+static mfat_bool_t _mfat_find_free_run(mfat_ctx_t* ctx,
+                                       const mfat_partition_t* part,
+                                       uint32_t want,
+                                       uint32_t* start,
+                                       uint32_t* len) {
+  *start = 0U;
+  *len = 0U;
+  uint32_t run_start = 0U;
+  uint32_t run_len = 0U;
+  for (uint32_t cluster = 2U; cluster <= part->num_clusters + 1U;) {
+    // Skip entire bitmap words at a time when possible.
+    if (part->free_bitmap != NULL && (cluster % 32U) == 0U &&
+        (cluster + 31U) <= part->num_clusters) {
+      uint32_t word = part->free_bitmap[cluster / 32U];
+      if (word == 0U && run_len == 0U) {
+        cluster += 32U;
+        continue;
+      }
+      if (word == 0xffffffffU) {
+        if (run_len == 0U) {
+          run_start = cluster;
+        }
+        run_len += 32U;
+        cluster += 32U;
+        continue;
+      }
+    }
+
+    mfat_bool_t is_free;
+    if (!_mfat_is_cluster_free(ctx, part, cluster, &is_free)) {
+      return false;
+    }
+    if (is_free) {
+      if (run_len == 0U) {
+        run_start = cluster;
+      }
+      ++run_len;
+    } else if (run_len > 0U) {
+      // Is this run a better fit than the best run so far?
+      mfat_bool_t is_better =
+          (run_len >= want) ? (*len < want || run_len < *len) : (run_len > *len);
+      if (is_better) {
+        *start = run_start;
+        *len = run_len;
+        if (run_len == want) {
+          break;
+        }
+      }
+      run_len = 0U;
+    }
+    ++cluster;
+  }
+
+  DBGF("Best free run for %" PRIu32 " clusters: %" PRIu32 " clusters at cluster %" PRIu32,
+       want,
+       *len,
+       *start);
+  return true;
+}
+
+// Find the first free cluster at or after the given cluster (wrapping around at the end of the
+// partition). If the partition has a free cluster bitmap, the bitmap is searched instead of the
+// FAT.
+// @param[out] cluster The free cluster.
+// @param[out] found false if there are no free clusters.
+static mfat_bool_t _mfat_find_free_cluster(mfat_ctx_t* ctx,
+                                           const mfat_partition_t* part,
+                                           uint32_t start,
+                                           uint32_t* cluster,
+                                           mfat_bool_t* found) {
+  // Valid cluster numbers are 2..num_clusters.
+  uint32_t candidate = (start >= 2U && start <= part->num_clusters) ? start : 2U;
+  *found = false;
+  if (part->free_bitmap != NULL) {
+    // With a bitmap, we find the next free cluster directly.
+    *found = _mfat_bitmap_find_free(part, candidate, cluster);
+    return true;
+  }
+  for (uint32_t i = 0U; i < part->num_clusters - 1U; ++i, ++candidate) {
+    if (candidate > part->num_clusters) {
+      candidate = 2U;
+    }
+    uint32_t value;
+    if (!_mfat_get_fat_entry(ctx, part, candidate, &value)) {
+      return false;
+    }
+    if (value == 0U) {
+      *cluster = candidate;
+      *found = true;
+      break;
+    }
+  }
+  return true;
+}
+
+// Claim a free cluster: Mark the cluster as end of chain and link it to the previous cluster.
+static mfat_bool_t _mfat_claim_cluster(mfat_ctx_t* ctx,
+                                       mfat_partition_t* part,
+                                       uint32_t cluster,
+                                       uint32_t prev_cluster) {
+  if (!_mfat_set_fat_entry(ctx, part, cluster, 0x0fffffffU)) {
+    return false;
+  }
+  if (prev_cluster != 0U && !_mfat_set_fat_entry(ctx, part, prev_cluster, cluster)) {
+    return false;
+  }
+
+  // Update the free cluster information.
+  if (part->free_bitmap != NULL) {
+    part->free_bitmap[cluster / 32U] &= ~(1U << (cluster % 32U));
+  }
+  part->next_free = (cluster < part->num_clusters) ? cluster + 1U : 2U;
+  if (part->free_count != 0xffffffffU) {
+    --part->free_count;
+  }
+  part->fsinfo_dirty = true;
+
+  DBGF("Allocated cluster %" PRIu32 " (prev = %" PRIu32 ")", cluster, prev_cluster);
+  return true;
+}
+
+// Allocate a free cluster, and link it to the end of a cluster chain.
+//
+// In order to keep files unfragmented, the cluster that follows the previous cluster is preferred.
+// New cluster chains have an unknown final size, so they are not worth a full scan for the best
+// fitting free run (mfat_fallocate() does that when the size is known).
+//
+// Otherwise the search for a free cluster starts at the next free cluster hint of the partition
+// (from the FAT32 FSInfo sector), which is then moved past the allocated cluster. This way the FAT
+// is usually not rescanned for each allocation. If the partition has a free cluster bitmap, the
+// bitmap is searched instead of the FAT.
+// The caller must hold the FAT cache lock.
+// @param prev_cluster The last cluster of the cluster chain (zero for a new cluster chain).
+// @param[out] cluster The allocated cluster (marked as EOC in the FAT).
+static mfat_bool_t _mfat_alloc_cluster(mfat_ctx_t* ctx,
+                                       mfat_partition_t* part,
+                                       uint32_t prev_cluster,
+                                       uint32_t* cluster) {
+  // Try to extend the cluster chain with a physically adjacent cluster.
+  if (prev_cluster != 0U) {
+    mfat_bool_t is_free;
+    if (!_mfat_is_cluster_free(ctx, part, prev_cluster + 1U, &is_free)) {
+      return false;
+    }
+    if (is_free) {
+      *cluster = prev_cluster + 1U;
+      return _mfat_claim_cluster(ctx, part, *cluster, prev_cluster);
+    }
+  }
+
+  mfat_bool_t found;
+  if (!_mfat_find_free_cluster(ctx, part, part->next_free, cluster, &found)) {
+    return false;
+  }
+  if (!found) {
+    DBG("No free clusters left");
+    return false;
+  }
+  return _mfat_claim_cluster(ctx, part, *cluster, prev_cluster);
+}
+#endif  // MFAT_ENABLE_WRITE
+
+// Helper function for finding the first block of a cluster.
+static uint32_t _mfat_first_block_of_cluster(const mfat_partition_t* part, uint32_t cluster) {
+  return part->first_data_block + ((cluster - 2U) * part->blocks_per_cluster);
+}
+
+// Initialize a cluster pos object to the current cluster & offset (e.g. for a file).
+static mfat_cluster_pos_t _mfat_cluster_pos_init(const mfat_partition_t* part,
+                                                 const uint32_t cluster_no,
+                                                 const uint32_t offset) {
+  mfat_cluster_pos_t cpos;
+  cpos.cluster_no = cluster_no;
+  cpos.cluster_idx = offset / (part->blocks_per_cluster * MFAT_BLOCK_SIZE);
+  cpos.block_in_cluster = (offset % (part->blocks_per_cluster * MFAT_BLOCK_SIZE)) / MFAT_BLOCK_SIZE;
+  cpos.cluster_start_blk = _mfat_first_block_of_cluster(part, cluster_no);
+  return cpos;
+}
+
+// Initialize a cluster pos object to the current file offset of the specified file.
+static mfat_cluster_pos_t _mfat_cluster_pos_init_from_file(const mfat_partition_t* part,
+                                                           const mfat_file_t* f) {
+  return _mfat_cluster_pos_init(part, f->current_cluster, f->offset);
+}
+
+// Advance a cluster pos by one block.
+static mfat_bool_t _mfat_cluster_pos_advance(mfat_ctx_t* ctx,
+                                             mfat_cluster_pos_t* cpos,
+                                             const mfat_partition_t* part) {
+  ++cpos->block_in_cluster;
+  if (cpos->block_in_cluster == part->blocks_per_cluster) {
+    if (!_mfat_next_cluster(ctx, part, &cpos->cluster_no)) {
+      return false;
+    }
+    cpos->cluster_start_blk = _mfat_first_block_of_cluster(part, cpos->cluster_no);
     cpos->block_in_cluster = 0;
+    ++cpos->cluster_idx;
   }
   return true;
 }
@@ -510,15 +1566,293 @@ static mfat_bool_t _mfat_is_eoc(const uint32_t cluster) {
   return cluster >= 0x0ffffff8U;
 }
 
+#if MFAT_ENABLE_EXTENTS
+// Build the extent map of a file by walking its cluster chain once. If the extent map array is too
+// small, only the first part of the cluster chain is mapped.
+static mfat_bool_t _mfat_build_extent_map(mfat_ctx_t* ctx, mfat_file_t* f) {
+  const mfat_partition_t* part = &ctx->partition[f->info.part_no];
+
+  f->num_extents = 0U;
+  f->extents_complete = false;
+
+  uint32_t cluster = f->info.first_cluster;
+  uint32_t cluster_idx = 0U;
+  mfat_extent_t* extent = NULL;
+  while (cluster != 0U && !_mfat_is_eoc(cluster)) {
+    // Extend the current extent, or start a new one.
+    if (extent != NULL && cluster == extent->disk_cluster + extent->num_clusters) {
+      ++extent->num_clusters;
+    } else {
+      if (f->num_extents >= f->max_extents) {
+        DBGF("Extent map full (%" PRIu32 " extents)", f->num_extents);
+        return true;
+      }
+      extent = &f->extents[f->num_extents++];
+      extent->file_cluster = cluster_idx;
+      extent->disk_cluster = cluster;
+      extent->num_clusters = 1U;
+    }
+
+    if (!_mfat_next_cluster(ctx, part, &cluster)) {
+      return false;
+    }
+    ++cluster_idx;
+  }
+
+  DBGF("Built extent map: %" PRIu32 " extents, %" PRIu32 " clusters", f->num_extents, cluster_idx);
+  f->extents_complete = true;
+  return true;
+}
+
+// Look up the cluster number for a cluster index of a file, using the extent map of the file (a
+// binary search). If the cluster index is one past the end of a completely mapped cluster chain,
+// an EOC cluster number is returned.
+// Returns false if the cluster index is not covered by the extent map.
+static mfat_bool_t _mfat_extent_lookup(const mfat_file_t* f,
+                                       uint32_t cluster_idx,
+                                       uint32_t* cluster) {
+  if (f->extents == NULL || f->num_extents == 0U) {
+    return false;
+  }
+
+  // Find the last extent that starts at or before the cluster index.
+  uint32_t lo = 0U;
+  uint32_t hi = f->num_extents;
+  while ((hi - lo) > 1U) {
+    uint32_t mid = (lo + hi) / 2U;
+    if (f->extents[mid].file_cluster <= cluster_idx) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+  const mfat_extent_t* extent = &f->extents[lo];
+  if (cluster_idx < extent->file_cluster) {
+    return false;
+  }
+  uint32_t offset_in_extent = cluster_idx - extent->file_cluster;
+  if (offset_in_extent < extent->num_clusters) {
+    *cluster = extent->disk_cluster + offset_in_extent;
+    return true;
+  }
+  mfat_bool_t is_last_extent = (lo == (f->num_extents - 1U));
+  if (f->extents_complete && is_last_extent && offset_in_extent == extent->num_clusters) {
+    *cluster = 0x0fffffffU;
+    return true;
+  }
+  return false;
+}
+
+#if MFAT_ENABLE_WRITE
+// Add a cluster that was appended to the cluster chain of a file to the extent map of the file.
+static void _mfat_extent_append(mfat_file_t* f, uint32_t cluster) {
+  // An incomplete extent map still correctly maps the first part of the file, so leave it as is.
+  if (f->extents == NULL || !f->extents_complete) {
+    return;
+  }
+
+  // Extend the last extent, or start a new one.
+  uint32_t file_cluster = 0U;
+  if (f->num_extents > 0U) {
+    mfat_extent_t* last = &f->extents[f->num_extents - 1U];
+    if (cluster == last->disk_cluster + last->num_clusters) {
+      ++last->num_clusters;
+      return;
+    }
+    file_cluster = last->file_cluster + last->num_clusters;
+  }
+  if (f->num_extents >= f->max_extents) {
+    DBGF("Extent map full (%" PRIu32 " extents)", f->num_extents);
+    f->extents_complete = false;
+    return;
+  }
+  mfat_extent_t* extent = &f->extents[f->num_extents++];
+  extent->file_cluster = file_cluster;
+  extent->disk_cluster = cluster;
+  extent->num_clusters = 1U;
+}
+#endif
+#endif  // MFAT_ENABLE_EXTENTS
+
+// Advance a cluster pos of a file by one block. The extent map of the file (if any) is used for
+// finding the next cluster, so that we don't have to walk the cluster chain in the FAT.
+static mfat_bool_t _mfat_file_pos_advance(mfat_ctx_t* ctx,
+                                          mfat_cluster_pos_t* cpos,
+                                          const mfat_partition_t* part,
+                                          const mfat_file_t* f) {
+#if MFAT_ENABLE_EXTENTS
+  uint32_t next_cluster;
+  if ((cpos->block_in_cluster + 1U) == part->blocks_per_cluster &&
+      _mfat_extent_lookup(f, cpos->cluster_idx + 1U, &next_cluster)) {
+    cpos->cluster_no = next_cluster;
+    cpos->cluster_start_blk = _mfat_first_block_of_cluster(part, next_cluster);
+    cpos->block_in_cluster = 0U;
+    ++cpos->cluster_idx;
+    return true;
+  }
+#else
+  (void)f;
+#endif
+  return _mfat_cluster_pos_advance(ctx, cpos, part);
+}
+
+#if MFAT_ENABLE_READAHEAD
+// Check if a block is present in a cache (without touching the cache state).
+static mfat_bool_t _mfat_is_block_cached(mfat_ctx_t* ctx, uint32_t blk_no, int cache_type) {
+  return _mfat_find_cached_block(ctx, blk_no, cache_type) != NULL;
+}
+
+// Read a run of consecutive blocks from storage into the data cache. The cached block buffers are
+// made contiguous in memory, so that the entire run can be read with a single request.
+static mfat_bool_t _mfat_prefetch_blocks(mfat_ctx_t* ctx, uint32_t first_blk, uint32_t num_blocks) {
+  mfat_cache_t* cache = &ctx->cache[MFAT_CACHE_DATA];
+
+  // Assign cached block items to the blocks of the run (stop at the first block that is already in
+  // the cache, since we must not overwrite it - it may be dirty).
+  int* slots = cache->slots;
+  int count = 0;
+  for (; count < (int)num_blocks; ++count) {
+    uint32_t blk_no = first_blk + (uint32_t)count;
+    if (_mfat_is_block_cached(ctx, blk_no, MFAT_CACHE_DATA)) {
+      break;
+    }
+    mfat_cached_block_t* cb = _mfat_get_cached_block(ctx, blk_no, MFAT_CACHE_DATA);
+    if (cb == NULL) {
+      return false;
+    }
+    slots[count] = (int)(cb - &cache->block[0]);
+  }
+  if (count == 0) {
+    return true;
+  }
+
+  // Read the run into the cache.
+  _mfat_make_contiguous(cache, &slots[0], count);
+  DBGF("Read-ahead of %d block(s) starting at block %" PRIu32, count, first_blk);
+  if (!_mfat_read_blocks(ctx, cache->block[slots[0]].buf, first_blk, (uint32_t)count)) {
+    return false;
+  }
+  for (int k = 0; k < count; ++k) {
+    cache->block[slots[k]].state = MFAT_VALID;
+  }
+
+  return true;
+}
+
+// Prefetch the blocks that follow the current position of a sequentially read file into the data
+// cache: The rest of the current cluster plus the next ra_clusters clusters (limited by the end of
+// the file and the cache size). Physically contiguous blocks are read with a single request.
+static void _mfat_file_readahead(mfat_ctx_t* ctx,
+                                 const mfat_cluster_pos_t* cpos,
+                                 const mfat_partition_t* part,
+                                 const mfat_file_t* f) {
+  // We use at most half of a large data cache for read-ahead, so that other cached blocks (e.g.
+  // directory blocks) are not flushed out. Small caches can not spare that, so all but one block
+  // (but at least two blocks) are used.
+  uint32_t num_cached = (uint32_t)ctx->cache[MFAT_CACHE_DATA].num_blocks;
+  uint32_t max_blocks = (num_cached >= 8U) ? num_cached / 2U : num_cached - 1U;
+  if (max_blocks < 2U) {
+    max_blocks = num_cached;
+  }
+#if MFAT_ENABLE_MMAP
+  // There is no point in prefetching blocks from a memory mapped image.
+  if (ctx->image != NULL) {
+    return;
+  }
+#endif
+  if (f->ra_clusters == 0U || f->offset != f->ra_offset || max_blocks < 2U ||
+      _mfat_is_block_cached(ctx, _mfat_cluster_pos_blk_no(cpos), MFAT_CACHE_DATA)) {
+    return;
+  }
+
+  // The cached block buffers can not be rearranged while there are pinned blocks.
+  if (ctx->cache[MFAT_CACHE_DATA].num_pins > 0) {
+    return;
+  }
+
+  // Determine the size of the read-ahead window.
+  uint32_t blocks_left_in_file =
+      (f->info.size - (f->offset - (f->offset % MFAT_BLOCK_SIZE)) + (MFAT_BLOCK_SIZE - 1U)) /
+      MFAT_BLOCK_SIZE;
+  uint32_t window = (part->blocks_per_cluster - cpos->block_in_cluster) +
+                    f->ra_clusters * part->blocks_per_cluster;
+  window = _mfat_min(_mfat_min(window, blocks_left_in_file), max_blocks);
+
+  // Prefetch the window, one physically contiguous run at a time.
+  mfat_cluster_pos_t pos = *cpos;
+  while (window > 0U && !_mfat_is_eoc(pos.cluster_no)) {
+    uint32_t first_blk = _mfat_cluster_pos_blk_no(&pos);
+    uint32_t num_blocks = 0U;
+    do {
+      ++num_blocks;
+      if (num_blocks < window && !_mfat_file_pos_advance(ctx, &pos, part, f)) {
+        return;
+      }
+    } while (num_blocks < window && !_mfat_is_eoc(pos.cluster_no) &&
+             _mfat_cluster_pos_blk_no(&pos) == first_blk + num_blocks);
+
+    // Read-ahead is only a hint, so errors are not fatal (the blocks are read on demand instead).
+    if (!_mfat_prefetch_blocks(ctx, first_blk, num_blocks)) {
+      DBG("Read-ahead failed");
+      return;
+    }
+    window -= num_blocks;
+  }
+}
+#endif  // MFAT_ENABLE_READAHEAD
+
+// Read a block of a file through the data cache. For sequential reads, the following blocks of the
+// file are prefetched into the cache.
+static mfat_cached_block_t* _mfat_read_file_block(mfat_ctx_t* ctx,
+                                                  const mfat_cluster_pos_t* cpos,
+                                                  const mfat_partition_t* part,
+                                                  const mfat_file_t* f) {
+#if MFAT_ENABLE_READAHEAD
+  _mfat_file_readahead(ctx, cpos, part, f);
+#else
+  (void)part;
+  (void)f;
+#endif
+  return _mfat_read_block(ctx, _mfat_cluster_pos_blk_no(cpos), MFAT_CACHE_DATA);
+}
+
+// Copy a part of a block of a file (read through the data cache) to a buffer. Read-ahead is only
+// done for reads at the current file offset (i.e. not for positional reads).
+static mfat_bool_t _mfat_read_partial_block(mfat_ctx_t* ctx,
+                                            const mfat_cluster_pos_t* cpos,
+                                            const mfat_partition_t* part,
+                                            const mfat_file_t* f,
+                                            mfat_bool_t at_file_offset,
+                                            uint8_t* buf,
+                                            uint32_t block_offset,
+                                            uint32_t nbyte) {
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+#if MFAT_ENABLE_READAHEAD
+  if (at_file_offset) {
+    _mfat_file_readahead(ctx, cpos, part, f);
+  }
+#else
+  (void)part;
+  (void)f;
+  (void)at_file_offset;
+#endif
+  const uint8_t* src = _mfat_view_block(ctx, _mfat_cluster_pos_blk_no(cpos), MFAT_CACHE_DATA);
+  if (src != NULL) {
+    memcpy(buf, &src[block_offset], nbyte);
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+  return src != NULL;
+}
+
 #if MFAT_ENABLE_GPT
-static mfat_bool_t _mfat_decode_gpt(void) {
+static mfat_bool_t _mfat_decode_gpt(mfat_ctx_t* ctx) {
   // Read the primary GUID Partition Table (GPT) header, located at block 1.
-  mfat_cached_block_t* block = _mfat_read_block(1U, MFAT_CACHE_DATA);
-  if (block == NULL) {
+  const uint8_t* buf = _mfat_view_block(ctx, 1U, MFAT_CACHE_DATA);
+  if (buf == NULL) {
     DBG("Failed to read the GPT");
     return false;
   }
-  uint8_t* buf = &block->buf[0];
 
   // Is this in fact an GPT header?
   // TODO(m): We could do more validation (CRC etc).
@@ -550,20 +1884,19 @@ static mfat_bool_t _mfat_decode_gpt(void) {
   for (uint32_t i = 0; i < num_entries && i < MFAT_NUM_PARTITIONS; ++i) {
     // Read the next block of the partition entry array if necessary.
     if ((entry_offs % MFAT_BLOCK_SIZE) == 0) {
-      block = _mfat_read_block(entries_block, MFAT_CACHE_DATA);
-      if (block == NULL) {
+      buf = _mfat_view_block(ctx, entries_block, MFAT_CACHE_DATA);
+      if (buf == NULL) {
         DBGF("Failed to read the GPT partition entry array at block %" PRIu32, entries_block);
         return false;
       }
-      buf = &block->buf[0];
 
       ++entries_block;
       entry_offs = 0;
     }
 
     // Decode the partition entry.
-    uint8_t* entry = &buf[entry_offs];
-    mfat_partition_t* part = &s_ctx.partition[i];
+    const uint8_t* entry = &buf[entry_offs];
+    mfat_partition_t* part = &ctx->partition[i];
 
     // Get the starting block of the partition (again, 64-bit value that we read as a 32-bit
     // value).
@@ -598,21 +1931,20 @@ static mfat_bool_t _mfat_decode_gpt(void) {
 #endif  // MFAT_ENABLE_GPT
 
 #if MFAT_ENABLE_MBR
-static mfat_bool_t _mfat_decode_mbr(void) {
-  mfat_cached_block_t* block = _mfat_read_block(0U, MFAT_CACHE_DATA);
-  if (block == NULL) {
+static mfat_bool_t _mfat_decode_mbr(mfat_ctx_t* ctx) {
+  const uint8_t* buf = _mfat_view_block(ctx, 0U, MFAT_CACHE_DATA);
+  if (buf == NULL) {
     DBG("Failed to read the MBR");
     return false;
   }
-  uint8_t* buf = &block->buf[0];
 
   // Is this an MBR block (can also be a partition boot record)?
   mfat_bool_t found_valid_mbr = false;
   if (buf[510] == 0x55U && buf[511] == 0xaaU) {
     // Parse each partition entry.
     for (int i = 0; i < 4 && i < MFAT_NUM_PARTITIONS; ++i) {
-      uint8_t* entry = &buf[446U + 16U * (uint32_t)i];
-      mfat_partition_t* part = &s_ctx.partition[i];
+      const uint8_t* entry = &buf[446U + 16U * (uint32_t)i];
+      mfat_partition_t* part = &ctx->partition[i];
 
       // Current state of partition (00h=Inactive, 80h=Active).
       part->boot = ((entry[0] & 0x80U) != 0);
@@ -635,49 +1967,108 @@ static mfat_bool_t _mfat_decode_mbr(void) {
 }
 #endif  // MFAT_ENABLE_MBR
 
-static void _mfat_decode_tableless(void) {
-  // Some storage media are formatted without an MBR or GPT. If so, there is only a single volume
-  // and the first block is the BPB (BIOS Parameter Block) of that "partition". We initially guess
-  // that this is the case, and let the partition decoding logic assert if this was a good guess.
-  DBG("Assuming that the storage medium does not have a partition table");
+#if MFAT_ENABLE_WRITE
+static mfat_bool_t _mfat_decode_fsinfo(mfat_ctx_t* ctx, mfat_partition_t* part) {
+  // Default values: The number of free clusters is unknown, and we start looking for free clusters
+  // at the start of the FAT.
+  part->free_count = 0xffffffffU;
+  part->next_free = 2U;
+  part->fsinfo_dirty = false;
+  if (part->fsinfo_block == 0U) {
+    return true;
+  }
 
-  // Clear all partitions (their values are potentially garbage).
-  for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
-    memset(&s_ctx.partition[i], 0, sizeof(mfat_partition_t));
+  const uint8_t* buf = _mfat_view_block(ctx, part->fsinfo_block, MFAT_CACHE_DATA);
+  if (buf == NULL) {
+    DBG("\t\tFailed to read the FSInfo sector");
+    return false;
   }
 
-  // Guess that the first partition is FAT (we'll detect the actual type later).
-  // Note: The "first_block" field is cleared to zero in the previous memset, so the first
-  // partition starts at the first block, which is what we intend.
-  s_ctx.partition[0].type = MFAT_PART_TYPE_FAT_UNDECIDED;
-}
+  // Check the FSInfo signatures.
+  if (_mfat_get_dword(&buf[0]) != 0x41615252U || _mfat_get_dword(&buf[484]) != 0x61417272U ||
+      _mfat_get_dword(&buf[508]) != 0xaa550000U) {
+    DBG("\t\tInvalid FSInfo signature");
+    part->fsinfo_block = 0U;
+    return true;
+  }
 
-static mfat_bool_t _mfat_decode_partition_tables(void) {
-  mfat_bool_t found_partition_table = false;
+  // The values are only hints, so we ignore them if they are out of range.
+  uint32_t free_count = _mfat_get_dword(&buf[488]);
+  uint32_t next_free = _mfat_get_dword(&buf[492]);
+  if (free_count <= part->num_clusters) {
+    part->free_count = free_count;
+  }
+  if (next_free >= 2U && next_free <= part->num_clusters) {
+    part->next_free = next_free;
+  }
+  DBGF("\t\tfree_count = %" PRIu32 ", next_free = %" PRIu32, part->free_count, part->next_free);
+
+  return true;
+}
+
+// Write the free cluster information back to the FSInfo sector (if it has changed).
+static mfat_bool_t _mfat_update_fsinfo(mfat_ctx_t* ctx, mfat_partition_t* part) {
+  if (part->fsinfo_block == 0U || !part->fsinfo_dirty) {
+    return true;
+  }
+
+  mfat_cached_block_t* block = _mfat_read_block(ctx, part->fsinfo_block, MFAT_CACHE_DATA);
+  if (block == NULL) {
+    DBG("Failed to read the FSInfo sector");
+    return false;
+  }
+  _mfat_set_dword(&block->buf[488], part->free_count);
+  _mfat_set_dword(&block->buf[492], part->next_free);
+  block->state = MFAT_DIRTY;
+  part->fsinfo_dirty = false;
+
+  return true;
+}
+#endif  // MFAT_ENABLE_WRITE
+
+static void _mfat_decode_tableless(mfat_ctx_t* ctx) {
+  // Some storage media are formatted without an MBR or GPT. If so, there is only a single volume
+  // and the first block is the BPB (BIOS Parameter Block) of that "partition". We initially guess
+  // that this is the case, and let the partition decoding logic assert if this was a good guess.
+  DBG("Assuming that the storage medium does not have a partition table");
+
+  // Clear all partitions (their values are potentially garbage).
+  for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
+    memset(&ctx->partition[i], 0, sizeof(mfat_partition_t));
+  }
+
+  // Guess that the first partition is FAT (we'll detect the actual type later).
+  // Note: The "first_block" field is cleared to zero in the previous memset, so the first
+  // partition starts at the first block, which is what we intend.
+  ctx->partition[0].type = MFAT_PART_TYPE_FAT_UNDECIDED;
+}
+
+static mfat_bool_t _mfat_decode_partition_tables(mfat_ctx_t* ctx) {
+  mfat_bool_t found_partition_table = false;
 
 #if MFAT_ENABLE_GPT
   // 1: Try to read the GUID Partition Table (GPT).
   if (!found_partition_table) {
-    found_partition_table = _mfat_decode_gpt();
+    found_partition_table = _mfat_decode_gpt(ctx);
   }
 #endif
 
 #if MFAT_ENABLE_MBR
   // 2: Try to read the Master Boot Record (MBR).
   if (!found_partition_table) {
-    found_partition_table = _mfat_decode_mbr();
+    found_partition_table = _mfat_decode_mbr(ctx);
   }
 #endif
 
   // 3: Assume that the storage medium does not have a partition table at all.
   if (!found_partition_table) {
-    _mfat_decode_tableless();
+    _mfat_decode_tableless(ctx);
   }
 
   // Read and parse the BPB for each FAT partition.
   for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
     DBGF("Partition %d:", i);
-    mfat_partition_t* part = &s_ctx.partition[i];
+    mfat_partition_t* part = &ctx->partition[i];
 
     // Skip unsupported partition types.
     if (part->type == MFAT_PART_TYPE_UNKNOWN) {
@@ -686,12 +2077,11 @@ static mfat_bool_t _mfat_decode_partition_tables(void) {
     }
 
     // Load the BPB (the first block of the partition).
-    mfat_cached_block_t* block = _mfat_read_block(part->first_block, MFAT_CACHE_DATA);
-    if (block == NULL) {
+    const uint8_t* buf = _mfat_view_block(ctx, part->first_block, MFAT_CACHE_DATA);
+    if (buf == NULL) {
       DBG("\t\tFailed to read the BPB");
       return false;
     }
-    uint8_t* buf = &block->buf[0];
 
     if (!_mfat_is_valid_bpb(buf)) {
       DBG("\t\tPartition does not appear to have a valid BPB");
@@ -774,6 +2164,18 @@ static mfat_bool_t _mfat_decode_partition_tables(void) {
       part->root_dir_cluster = _mfat_get_dword(&buf[44]);
     }
 
+#if MFAT_ENABLE_WRITE
+    // Get the location of the FSInfo sector (FAT32 only). It is decoded later, since reading it
+    // may evict the BPB block from the cache.
+    part->fsinfo_block = 0U;
+    if (part->type == MFAT_PART_TYPE_FAT32) {
+      uint32_t fsinfo_sector = _mfat_get_word(&buf[48]);
+      if (fsinfo_sector != 0U && fsinfo_sector != 0xffffU) {
+        part->fsinfo_block = part->first_block + fsinfo_sector;
+      }
+    }
+#endif
+
 #if MFAT_ENABLE_DEBUG
     // Print the partition information.
     DBGF("\t\ttype = %s", part->type == MFAT_PART_TYPE_FAT16 ? "FAT16" : "FAT32");
@@ -813,17 +2215,24 @@ static mfat_bool_t _mfat_decode_partition_tables(void) {
       DBGF("\t\t(Boot signature N/A - bpb[%d]=0x%02x)", (int)(ex_boot_sig - buf), ex_boot_sig[0]);
     }
 #endif  // MFAT_ENABLE_DEBUG
+
+#if MFAT_ENABLE_WRITE
+    // Get the free cluster information.
+    if (!_mfat_decode_fsinfo(ctx, part)) {
+      return false;
+    }
+#endif
   }
 
   return true;
 }
 
-static mfat_file_t* _mfat_fd_to_file(int fd) {
+static mfat_file_t* _mfat_fd_to_file(mfat_ctx_t* ctx, int fd) {
   if (fd < 0 || fd >= MFAT_NUM_FDS) {
     DBGF("FD out of range: %d", fd);
     return NULL;
   }
-  mfat_file_t* f = &s_ctx.file[fd];
+  mfat_file_t* f = &ctx->file[fd];
   if (!f->open) {
     DBGF("File is not open: %d", fd);
     return NULL;
@@ -831,7 +2240,12 @@ static mfat_file_t* _mfat_fd_to_file(int fd) {
   return f;
 }
 
-static void _mfat_dir_entry_to_stat(uint8_t* dir_entry, mfat_stat_t* stat) {
+// Get the first cluster of a file from its directory entry.
+static uint32_t _mfat_dir_entry_cluster(const uint8_t* dir_entry) {
+  return (_mfat_get_word(&dir_entry[20]) << 16) | _mfat_get_word(&dir_entry[26]);
+}
+
+static void _mfat_dir_entry_to_stat(const uint8_t* dir_entry, mfat_stat_t* stat) {
   // Decode file attributes.
   uint32_t attr = dir_entry[11];
   uint32_t st_mode =
@@ -990,885 +2404,3730 @@ static void _mfat_make_printable_fname(const uint8_t* canonical_name, char print
 }
 #endif
 
-/// @brief Find a file on the given partition.
-///
-/// If the directory (if part of the path) exists, but the file does not exist in the directory,
-/// this function will find the first free directory entry slot and set @c exists to false. This is
-/// useful for creating new files.
-/// @param part_no The partition number.
-/// @param path The absolute path to the file.
-/// @param[out] info Information about the file.
-/// @param[out] file_type The file type (e.g. dir or regular file).
-/// @param[out] exists true if the file exists, false if it needs to be created.
-/// @returns true if the file (or its potential slot) was found.
-static mfat_bool_t _mfat_find_file(int part_no,
-                                   const char* path,
-                                   mfat_file_info_t* info,
-                                   int* file_type,
-                                   mfat_bool_t* exists) {
-  mfat_partition_t* part = &s_ctx.partition[part_no];
-
-  // Start with the root directory cluster/block.
-  mfat_cluster_pos_t cpos;
-  uint32_t blocks_left;
-  if (part->type == MFAT_PART_TYPE_FAT32) {
-    cpos = _mfat_cluster_pos_init(part, part->root_dir_cluster, 0);
-    blocks_left = 0xffffffffU;
-  } else {
-    // We use a fake/tweaked cluster pos for FAT16 root directories.
-    cpos.cluster_no = 0U;
-    cpos.cluster_start_blk = part->root_dir_block;
-    cpos.block_in_cluster = 0U;
-    blocks_left = part->blocks_in_root_dir;
-  }
+#if MFAT_ENABLE_LFN
+// Maximum length of a long file name (in UTF-16 code units).
+#define MFAT_LFN_MAX_CHARS 255U
 
-  // Special case: Is the caller trying to open the root directory?
-  mfat_bool_t is_root_dir = false;
-  if (path[1] == 0 && (path[0] == '/' || path[0] == '\\')) {
-    DBG("Request to open root directory");
-    is_root_dir = true;
-  }
+// Number of UTF-16 characters per LFN entry.
+#define MFAT_LFN_CHARS_PER_ENTRY 13U
 
-  // Try to find the given path.
-  mfat_cached_block_t* block = NULL;
-  uint8_t* file_entry = NULL;
-  if (!is_root_dir) {
-    // Skip leading slashes.
-    while (*path == '/' || *path == '\\') {
-      ++path;
-    }
+// Byte offsets of the UTF-16 characters in an LFN entry.
+static const uint8_t s_lfn_char_offs[MFAT_LFN_CHARS_PER_ENTRY] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
 
-    int path_pos = 0;
-    while (path_pos >= 0) {
-      // Extract a directory entry compatible file name.
-      char fname[12];
-      int name_pos = _mfat_canonicalize_fname(&path[path_pos], fname);
-      mfat_bool_t is_parent_dir = (name_pos >= 0);
+// State of a long file name match. The name is matched fragment by fragment, one LFN entry at a
+// time, without assembling the long file name of the directory entry.
+typedef struct {
+  uint8_t seq;       // Sequence number of the last matched LFN entry (0 = no match in progress).
+  uint8_t checksum;  // Checksum of the short name that the LFN entries belong to.
+} mfat_lfn_match_t;
+
+// Calculate the LFN checksum of a short (8.3) name.
+static uint8_t _mfat_lfn_checksum(const uint8_t* short_name) {
+  uint8_t sum = 0U;
+  for (int i = 0; i < 11; ++i) {
+    sum = (uint8_t)(((sum & 1U) << 7) + (sum >> 1) + short_name[i]);
+  }
+  return sum;
+}
 
-      path_pos = is_parent_dir ? path_pos + name_pos : -1;
-      DBGF("Looking for %s: \"%s\"", is_parent_dir ? "parent dir" : "file", fname);
+// Fold a UTF-16 character to upper case (long file names are matched case insensitively - only
+// ASCII letters are folded).
+static uint32_t _mfat_lfn_fold(uint32_t c) {
+  return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+}
 
-      // Use an "unlimited" block counter if we're doing a clusterchain lookup.
-      if (cpos.cluster_no != 0U) {
-        blocks_left = 0xffffffffU;
+// Check if the next path part (up until a directory separator or the end of the string) is a valid
+// short (8.3) file name, i.e. if _mfat_canonicalize_fname() represents it without loss.
+static mfat_bool_t _mfat_is_short_name(const char* path) {
+  if (path[0] == '.') {
+    // "." and ".." are short names, but other names may not start with a dot.
+    int n = (path[1] == '.') ? 2 : 1;
+    return path[n] == 0 || path[n] == '/' || path[n] == '\\';
+  }
+  int name_len = 0;
+  int ext_len = -1;
+  for (int pos = 0;; ++pos) {
+    int c = (int)(uint8_t)path[pos];
+    if (c == 0 || c == '/' || c == '\\') {
+      break;
+    }
+    if (c == '.') {
+      if (ext_len >= 0) {
+        return false;
       }
+      ext_len = 0;
+    } else if (c != '!' && _mfat_canonicalize_char(c) == '!') {
+      return false;
+    } else if (ext_len < 0 ? (++name_len > 8) : (++ext_len > 3)) {
+      return false;
+    }
+  }
+  return name_len > 0;
+}
 
-      // Look up the file name in the directory.
-      mfat_bool_t no_more_entries = false;
-      for (; file_entry == NULL && !no_more_entries && blocks_left > 0U; --blocks_left) {
-        // Load the directory table block.
-        block = _mfat_read_block(_mfat_cluster_pos_blk_no(&cpos), MFAT_CACHE_DATA);
-        if (block == NULL) {
-          DBGF("Unable to load directory block %" PRIu32, _mfat_cluster_pos_blk_no(&cpos));
-          return false;
-        }
-        uint8_t* buf = &block->buf[0];
-
-        // Loop over all the files in this directory block.
-        uint8_t* found_entry = NULL;
-        for (uint32_t offs = 0U; offs < 512U; offs += 32U) {
-          uint8_t* entry = &buf[offs];
-
-          // TODO(m): Look for the first 0xe5-entry too in case we want to create a new file.
-
-          // Last entry in the directory structure?
-          if (entry[0] == 0x00) {
-            no_more_entries = true;
-            break;
-          }
-
-          // Not a file/dir entry?
-          if (!_mfat_is_valid_shortname_file(entry)) {
-            continue;
-          }
-
-          // Is this the file/dir that we are looking for?
-          if (_mfat_cmpbuf(&entry[0], (const uint8_t*)&fname[0], 11)) {
-            found_entry = entry;
-            break;
-          }
-        }
-
-        // Did we have a match.
-        if (found_entry != NULL) {
-          uint32_t attr = found_entry[11];
-
-          // Descend into directory?
-          if (is_parent_dir) {
-            if ((attr & MFAT_ATTR_DIRECTORY) == 0U) {
-              DBGF("Not a directory: %s", fname);
-              return false;
-            }
-
-            // Decode the starting cluster of the child directory entry table.
-            uint32_t chile_dir_cluster_no =
-                (_mfat_get_word(&found_entry[20]) << 16) | _mfat_get_word(&found_entry[26]);
-            cpos = _mfat_cluster_pos_init(part, chile_dir_cluster_no, 0);
-            blocks_left = 0xffffffffU;
-          } else {
-            file_entry = found_entry;
-          }
-
-          break;
-        }
-
-        // Go to the next block in the directory.
-        if (cpos.cluster_no != 0U) {
-          if (!_mfat_cluster_pos_advance(&cpos, part)) {
-            return false;
-          }
-        } else {
-          cpos.block_in_cluster += 1;  // FAT16 style linear block access.
-        }
+// Decode the next path part (UTF-8) into a UTF-16 long file name.
+static mfat_bool_t _mfat_decode_lfn(const char* path, uint16_t* name, uint32_t* len) {
+  uint32_t n = 0U;
+  int pos = 0;
+  while (path[pos] != 0 && path[pos] != '/' && path[pos] != '\\') {
+    uint32_t c = (uint8_t)path[pos++];
+    int extra = 0;
+    if (c >= 0xf0U) {
+      c &= 0x07U;
+      extra = 3;
+    } else if (c >= 0xe0U) {
+      c &= 0x0fU;
+      extra = 2;
+    } else if (c >= 0xc0U) {
+      c &= 0x1fU;
+      extra = 1;
+    } else if (c >= 0x80U) {
+      return false;
+    }
+    for (; extra > 0; --extra) {
+      uint32_t cc = (uint8_t)path[pos];
+      if ((cc & 0xc0U) != 0x80U) {
+        return false;
       }
-
-      // Break loop if we didn't find the file.
-      if (no_more_entries) {
-        break;
+      ++pos;
+      c = (c << 6) | (cc & 0x3fU);
+    }
+    if (c >= 0x10000U) {
+      // Encode as a surrogate pair.
+      if (c > 0x10ffffU || n + 2U > MFAT_LFN_MAX_CHARS) {
+        return false;
+      }
+      name[n++] = (uint16_t)(0xd800U + ((c - 0x10000U) >> 10));
+      name[n++] = (uint16_t)(0xdc00U + ((c - 0x10000U) & 0x3ffU));
+    } else {
+      if (n + 1U > MFAT_LFN_MAX_CHARS) {
+        return false;
       }
+      name[n++] = (uint16_t)c;
     }
   }
+  *len = n;
+  return n > 0U;
+}
 
-  // Could we neither find the file nor a new directory slot for the file?
-  if (file_entry == NULL && !is_root_dir) {
-    return false;
+// Match the name fragment of an LFN entry against a long file name.
+static void _mfat_lfn_match_entry(mfat_lfn_match_t* m,
+                                  const uint8_t* entry,
+                                  const uint16_t* name,
+                                  uint32_t len) {
+  uint32_t seq = entry[0] & 0x1fU;
+  if ((entry[0] & 0x40U) != 0U) {
+    // The first LFN entry holds the last fragment of the name, which tells the name length.
+    if (seq == 0U || (seq - 1U) * MFAT_LFN_CHARS_PER_ENTRY >= len ||
+        seq * MFAT_LFN_CHARS_PER_ENTRY < len) {
+      m->seq = 0U;
+      return;
+    }
+    m->checksum = entry[13];
+  } else if (m->seq == 0U || seq + 1U != m->seq || entry[13] != m->checksum) {
+    m->seq = 0U;
+    return;
   }
 
-  // Define the file properties.
-  info->part_no = part_no;
-  if (is_root_dir) {
-    // Special handling of the root directory (it does not have an entry in any directory block).
-    info->size = 0U;
-    info->first_cluster = cpos.cluster_no;
-    info->dir_entry_block = 0U;
-    info->dir_entry_offset = 0U;
-    *file_type = (cpos.cluster_no == 0U) ? MFAT_FILE_TYPE_FAT16ROOTDIR : MFAT_FILE_TYPE_DIR;
-    *exists = true;
-  } else {
-    // For files and non root dirs, we extract file information from the directory block.
-    info->size = _mfat_get_dword(&file_entry[28]);
-    info->first_cluster = (_mfat_get_word(&file_entry[20]) << 16) | _mfat_get_word(&file_entry[26]);
-    info->dir_entry_block = block->blk_no;
-    info->dir_entry_offset = file_entry - block->buf;
-
-    // Does the file exist?
-    if ((file_entry[0] != 0x00) && (file_entry[0] != 0xe5)) {
-      *file_type = (file_entry[11] & MFAT_ATTR_DIRECTORY) != 0U ? MFAT_FILE_TYPE_DIR
-                                                                : MFAT_FILE_TYPE_REGULAR;
-      *exists = true;
-    } else {
-      // Non-existent files must be regular files, since we can't create directories with
-      // MFAT_O_CREAT.
-      *file_type = MFAT_FILE_TYPE_REGULAR;
-      *exists = false;
+  // Compare the fragment (the name is zero terminated, unless it fills the last fragment).
+  uint32_t pos = (seq - 1U) * MFAT_LFN_CHARS_PER_ENTRY;
+  for (uint32_t i = 0U; i < MFAT_LFN_CHARS_PER_ENTRY && pos + i <= len; ++i) {
+    uint32_t c = _mfat_get_word(&entry[s_lfn_char_offs[i]]);
+    uint32_t expected = (pos + i < len) ? name[pos + i] : 0U;
+    if (_mfat_lfn_fold(c) != _mfat_lfn_fold(expected)) {
+      m->seq = 0U;
+      return;
     }
   }
-
-  return true;
+  m->seq = (uint8_t)seq;
 }
 
-#if MFAT_ENABLE_WRITE
-static void _mfat_sync_impl() {
-  for (int j = 0; j < MFAT_NUM_CACHES; ++j) {
-    mfat_cache_t* cache = &s_ctx.cache[j];
-    for (int i = 0; i < MFAT_NUM_CACHED_BLOCKS; ++i) {
-      mfat_cached_block_t* cb = &cache->block[i];
-      if (cb->state == MFAT_DIRTY) {
-        DBGF("Cache: Flushing block %" PRIu32, cb->blk_no);
-        s_ctx.write((const char*)cb->buf, cb->blk_no, s_ctx.custom);
-        cb->state = MFAT_VALID;
-      }
+// Match the long file names of the entries of a directory block against a long file name. The
+// match state is carried over between blocks (LFN entries may span block boundaries). The returned
+// mask has the bit of the matching short name entry set (zero = no match).
+static uint32_t _mfat_lfn_match_block(const uint8_t* buf,
+                                      const mfat_dir_scan_t* scan,
+                                      const uint16_t* name,
+                                      uint32_t len,
+                                      mfat_lfn_match_t* m) {
+  if (scan->lfn == 0U && m->seq == 0U) {
+    return 0U;
+  }
+  for (uint32_t i = 0U; i < scan->end; ++i) {
+    const uint8_t* entry = &buf[i * 32U];
+    uint32_t bit = 1U << i;
+    if ((scan->lfn & bit) != 0U) {
+      _mfat_lfn_match_entry(m, entry, name, len);
+      continue;
     }
+    if ((scan->files & bit) != 0U && m->seq == 1U && _mfat_lfn_checksum(entry) == m->checksum) {
+      return bit;
+    }
+    m->seq = 0U;
   }
+  return 0U;
 }
-#endif
 
-static int _mfat_fstat_impl(mfat_file_info_t* info, mfat_stat_t* stat) {
-  // We can't stat root directories.
-  if (info->dir_entry_block == 0U) {
-    return -1;
+#if MFAT_ENABLE_OPENDIR
+// Prepend a character (UTF-8 encoded) to the long file name that is being collected.
+static void _mfat_lfn_prepend(mfat_dir_t* dirp, uint32_t c) {
+  uint8_t utf8[4];
+  uint32_t n;
+  if (c < 0x80U) {
+    utf8[0] = (uint8_t)c;
+    n = 1U;
+  } else if (c < 0x800U) {
+    utf8[0] = (uint8_t)(0xc0U | (c >> 6));
+    utf8[1] = (uint8_t)(0x80U | (c & 0x3fU));
+    n = 2U;
+  } else if (c < 0x10000U) {
+    utf8[0] = (uint8_t)(0xe0U | (c >> 12));
+    utf8[1] = (uint8_t)(0x80U | ((c >> 6) & 0x3fU));
+    utf8[2] = (uint8_t)(0x80U | (c & 0x3fU));
+    n = 3U;
+  } else {
+    utf8[0] = (uint8_t)(0xf0U | (c >> 18));
+    utf8[1] = (uint8_t)(0x80U | ((c >> 12) & 0x3fU));
+    utf8[2] = (uint8_t)(0x80U | ((c >> 6) & 0x3fU));
+    utf8[3] = (uint8_t)(0x80U | (c & 0x3fU));
+    n = 4U;
+  }
+  if (dirp->lfn_pos < n) {
+    // The name does not fit in the dirent (fall back to the short name).
+    dirp->lfn_seq = 0U;
+    return;
   }
+  dirp->lfn_pos -= (uint16_t)n;
+  memcpy(&dirp->dirent.d_name[dirp->lfn_pos], &utf8[0], n);
+}
 
-  // Read the directory entry block (should already be in the cache).
-  mfat_cached_block_t* block = _mfat_read_block(info->dir_entry_block, MFAT_CACHE_DATA);
-  if (block == NULL) {
-    return -1;
+// Collect the name fragment of an LFN entry (for readdir).
+static void _mfat_lfn_collect_entry(mfat_dir_t* dirp, const uint8_t* entry) {
+  uint32_t seq = entry[0] & 0x1fU;
+  if ((entry[0] & 0x40U) != 0U) {
+    // The first LFN entry holds the last fragment of the name.
+    dirp->lfn_checksum = entry[13];
+    dirp->lfn_pos = MFAT_NAME_MAX;
+    dirp->lfn_low = 0U;
+  } else if (dirp->lfn_seq == 0U || seq + 1U != dirp->lfn_seq ||
+             entry[13] != dirp->lfn_checksum) {
+    dirp->lfn_seq = 0U;
+    return;
   }
+  dirp->lfn_seq = (uint8_t)seq;
 
-  // Extract the relevant information for this directory entry.
-  uint8_t* dir_entry = &block->buf[info->dir_entry_offset];
-  _mfat_dir_entry_to_stat(dir_entry, stat);
+  // Find the end of the name in this fragment.
+  uint32_t num_chars = 0U;
+  while (num_chars < MFAT_LFN_CHARS_PER_ENTRY &&
+         _mfat_get_word(&entry[s_lfn_char_offs[num_chars]]) != 0U) {
+    ++num_chars;
+  }
 
-  return 0;
+  // Prepend the characters in reverse order (surrogate pairs may span two fragments).
+  for (uint32_t i = num_chars; i-- > 0U && dirp->lfn_seq != 0U;) {
+    uint32_t c = _mfat_get_word(&entry[s_lfn_char_offs[i]]);
+    if (c >= 0xdc00U && c <= 0xdfffU) {
+      if (dirp->lfn_low != 0U) {
+        _mfat_lfn_prepend(dirp, 0xfffdU);
+      }
+      dirp->lfn_low = (uint16_t)c;
+      continue;
+    }
+    if (c >= 0xd800U && c <= 0xdbffU) {
+      c = (dirp->lfn_low != 0U)
+              ? 0x10000U + ((c - 0xd800U) << 10) + ((uint32_t)dirp->lfn_low - 0xdc00U)
+              : 0xfffdU;
+    } else if (dirp->lfn_low != 0U) {
+      _mfat_lfn_prepend(dirp, 0xfffdU);
+    }
+    dirp->lfn_low = 0U;
+    _mfat_lfn_prepend(dirp, c);
+  }
 }
 
-static int _mfat_stat_impl(const char* path, mfat_stat_t* stat) {
-  // Find the file in the file system structure.
-  mfat_bool_t is_dir;
-  mfat_bool_t exists;
-  mfat_file_info_t info;
-  mfat_bool_t ok = _mfat_find_file(s_ctx.active_partition, path, &info, &is_dir, &exists);
-  if (!ok || !exists) {
-    DBGF("File not found: %s", path);
-    return -1;
+// Finish the collected long file name of a short name entry, and copy it to d_name. If there is no
+// valid long file name for the entry, false is returned.
+static mfat_bool_t _mfat_lfn_finish(mfat_dir_t* dirp, const uint8_t* entry, char* d_name) {
+  mfat_bool_t ok = (dirp->lfn_seq == 1U && _mfat_lfn_checksum(entry) == dirp->lfn_checksum);
+  if (ok && dirp->lfn_low != 0U) {
+    _mfat_lfn_prepend(dirp, 0xfffdU);
+    ok = (dirp->lfn_seq != 0U);
   }
-
-  return _mfat_fstat_impl(&info, stat);
+  dirp->lfn_seq = 0U;
+  if (ok) {
+    uint32_t len = MFAT_NAME_MAX - (uint32_t)dirp->lfn_pos;
+    memmove(&d_name[0], &dirp->dirent.d_name[dirp->lfn_pos], len);
+    d_name[len] = 0;
+  }
+  return ok;
 }
+#endif
+#endif  // MFAT_ENABLE_LFN
 
-static int _mfat_open_impl(const char* path, int oflag) {
-  // Find the next free fd.
-  int fd;
-  for (fd = 0; fd < MFAT_NUM_FDS; ++fd) {
-    if (!s_ctx.file[fd].open) {
-      break;
+#if MFAT_ENABLE_WRITE
+// Fill all the blocks of a cluster with zeros (e.g. for a new directory cluster).
+static mfat_bool_t _mfat_zero_cluster(mfat_ctx_t* ctx,
+                                      const mfat_partition_t* part,
+                                      uint32_t cluster) {
+  uint32_t first_blk = _mfat_first_block_of_cluster(part, cluster);
+  for (uint32_t i = 0U; i < part->blocks_per_cluster; ++i) {
+    mfat_cached_block_t* block = _mfat_get_cached_block(ctx, first_blk + i, MFAT_CACHE_DATA);
+    if (block == NULL) {
+      return false;
     }
+    memset(block->buf, 0, MFAT_BLOCK_SIZE);
+    block->state = MFAT_DIRTY;
   }
-  if (fd >= MFAT_NUM_FDS) {
-    DBG("No free FD:s left");
-    return -1;
+  return true;
+}
+#endif
+
+#if MFAT_ENABLE_DENTRY_CACHE || MFAT_ENABLE_DIR_INDEX
+// Hash a canonical (8.3) file name (FNV-1a).
+static uint32_t _mfat_name_hash(const char* fname) {
+  uint32_t h = 2166136261U;
+  for (int i = 0; i < 11; ++i) {
+    h = (h ^ (uint32_t)(uint8_t)fname[i]) * 16777619U;
   }
-  mfat_file_t* f = &s_ctx.file[fd];
+  return h;
+}
+#endif
 
-  // Find the file in the file system structure.
-  int file_type;
-  mfat_bool_t exists;
-  if (!_mfat_find_file(s_ctx.active_partition, path, &f->info, &file_type, &exists)) {
-    DBGF("File not found: %s", path);
-    return -1;
+#if MFAT_ENABLE_DENTRY_CACHE
+// Get the dentry cache slot for a file name in a directory.
+static mfat_dentry_t* _mfat_dentry_slot(mfat_ctx_t* ctx,
+                                        int part_no,
+                                        uint32_t dir_cluster,
+                                        const char* fname) {
+  uint32_t h = _mfat_name_hash(fname);
+  h = (h ^ (uint32_t)part_no) * 16777619U;
+  h = (h ^ dir_cluster) * 16777619U;
+  return &ctx->dentries[h % ctx->num_dentries];
+}
+
+// Look up a file name in the dentry cache. Returns NULL if the name is not in the cache.
+static const mfat_dentry_t* _mfat_dentry_find(mfat_ctx_t* ctx,
+                                              int part_no,
+                                              uint32_t dir_cluster,
+                                              const char* fname) {
+  if (ctx->num_dentries == 0U) {
+    return NULL;
+  }
+  const mfat_dentry_t* d = _mfat_dentry_slot(ctx, part_no, dir_cluster, fname);
+  if (d->dir_entry_block != 0U && d->part_no == (uint16_t)part_no &&
+      d->dir_cluster == dir_cluster && _mfat_cmpbuf(&d->entry[0], (const uint8_t*)fname, 11)) {
+    return d;
   }
-  mfat_bool_t is_dir =
-      (file_type == MFAT_FILE_TYPE_DIR) || (file_type == MFAT_FILE_TYPE_FAT16ROOTDIR);
+  return NULL;
+}
 
-  // Check that we found the correct type.
-  if (((oflag & MFAT_O_DIRECTORY) != 0) && !is_dir) {
-    DBGF("Can not open the file as a directory: %s", path);
-    return -1;
+// Add a directory entry to the dentry cache (replacing any entry that occupies the slot).
+static void _mfat_dentry_insert(mfat_ctx_t* ctx,
+                                int part_no,
+                                uint32_t dir_cluster,
+                                uint32_t dir_entry_block,
+                                uint32_t dir_entry_offset,
+                                const uint8_t* dir_entry) {
+  if (ctx->num_dentries == 0U) {
+    return;
   }
+  mfat_dentry_t* d = _mfat_dentry_slot(ctx, part_no, dir_cluster, (const char*)dir_entry);
+  d->dir_cluster = dir_cluster;
+  d->dir_entry_block = dir_entry_block;
+  d->dir_entry_offset = (uint16_t)dir_entry_offset;
+  d->part_no = (uint16_t)part_no;
+  memcpy(&d->entry[0], dir_entry, 32);
+}
 
-  // Handle non-existing files (can only happen for regular files).
-  if (!exists) {
 #if MFAT_ENABLE_WRITE
-    // Should we create the file?
-    if ((oflag & MFAT_O_CREAT) != 0U) {
-      DBG("Creating files is not yet implemented");
-      return -1;
-    }
+// Refresh the cached copy of a directory entry that has been modified (if it is in the cache).
+static void _mfat_dentry_update(mfat_ctx_t* ctx,
+                                const mfat_file_info_t* info,
+                                const uint8_t* dir_entry) {
+  if (ctx->num_dentries == 0U) {
+    return;
+  }
+  mfat_dentry_t* d =
+      _mfat_dentry_slot(ctx, info->part_no, info->dir_cluster, (const char*)dir_entry);
+  if (d->dir_entry_block == info->dir_entry_block &&
+      d->dir_entry_offset == info->dir_entry_offset && d->part_no == (uint16_t)info->part_no) {
+    memcpy(&d->entry[0], dir_entry, 32);
+  }
+}
 #endif
+#endif  // MFAT_ENABLE_DENTRY_CACHE
 
-    DBGF("File does not exist: %s", path);
-    return -1;
+#if MFAT_ENABLE_DIR_INDEX
+// Results of _mfat_dir_index_find().
+#define MFAT_DIR_INDEX_UNAVAILABLE -1  // There is no index (use a linear scan instead).
+#define MFAT_DIR_INDEX_NOT_FOUND 0     // The name is not in the directory.
+#define MFAT_DIR_INDEX_FOUND 1         // The name was found.
+
+// The largest possible directory (FAT directories can hold at most 65536 entries).
+#define MFAT_DIR_INDEX_MAX_ENTRIES 65536U
+
+// Get the size of a directory index, in words.
+static uint32_t _mfat_dir_index_words(const mfat_dir_index_t* idx) {
+  return idx->num_slots + idx->num_clusters;
+}
+
+// Drop a directory index, and move the index data that follows it down (so that the used index
+// memory stays packed).
+static void _mfat_dir_index_drop(mfat_ctx_t* ctx, mfat_dir_index_t* idx) {
+  uint32_t* mem = idx->mem;
+  uint32_t size = _mfat_dir_index_words(idx);
+  uint32_t* end = mem + size;
+  for (int i = 0; i < MFAT_NUM_DIR_INDEXES; ++i) {
+    mfat_dir_index_t* other = &ctx->dir_index[i];
+    if (other->mem != NULL && other->mem > mem) {
+      uint32_t* other_end = other->mem + _mfat_dir_index_words(other);
+      if (other_end > end) {
+        end = other_end;
+      }
+    }
+  }
+  memmove(mem, mem + size, (size_t)(end - (mem + size)) * sizeof(uint32_t));
+  for (int i = 0; i < MFAT_NUM_DIR_INDEXES; ++i) {
+    mfat_dir_index_t* other = &ctx->dir_index[i];
+    if (other->mem != NULL && other->mem > mem) {
+      other->mem -= size;
+    }
   }
+  idx->mem = NULL;
+}
 
-  // Initialize the file state.
-  f->open = true;
-  f->type = file_type;
-  f->oflag = oflag;
-  f->current_cluster = f->info.first_cluster;
-  f->offset = 0U;
+// Allocate an index item with num_words words of index data. Least recently used indexes are
+// evicted until there is room for the new index.
+static mfat_dir_index_t* _mfat_dir_index_alloc(mfat_ctx_t* ctx, uint32_t num_words) {
+  if (num_words > ctx->dir_index_words) {
+    return NULL;
+  }
+  while (true) {
+    uint32_t used_words = 0U;
+    mfat_dir_index_t* free_idx = NULL;
+    mfat_dir_index_t* lru_idx = NULL;
+    for (int i = 0; i < MFAT_NUM_DIR_INDEXES; ++i) {
+      mfat_dir_index_t* idx = &ctx->dir_index[i];
+      if (idx->mem == NULL) {
+        free_idx = idx;
+      } else {
+        used_words += _mfat_dir_index_words(idx);
+        if (lru_idx == NULL || idx->last_use < lru_idx->last_use) {
+          lru_idx = idx;
+        }
+      }
+    }
+    if (free_idx != NULL && num_words <= ctx->dir_index_words - used_words) {
+      free_idx->mem = ctx->dir_index_mem + used_words;
+      return free_idx;
+    }
+    DBGF("Evicting the index of directory %" PRIu32, lru_idx->dir_cluster);
+    _mfat_dir_index_drop(ctx, lru_idx);
+  }
+}
 
-  DBGF("Opening file: first_cluster = %" PRIu32 " (block = %" PRIu32 "), size = %" PRIu32
-       " bytes, dir_blk = %" PRIu32
-       ", dir_offs "
-       "= %" PRIu32,
-       f->info.first_cluster,
-       _mfat_first_block_of_cluster(&s_ctx.partition[f->info.part_no], f->info.first_cluster),
-       f->info.size,
-       f->info.dir_entry_block,
-       f->info.dir_entry_offset);
+// Get the absolute block number of a block of an indexed directory.
+static uint32_t _mfat_dir_index_blk_no(const mfat_partition_t* part,
+                                       const mfat_dir_index_t* idx,
+                                       uint32_t block_idx) {
+  if (idx->num_clusters == 0U) {
+    return part->root_dir_block + block_idx;
+  }
+  uint32_t cluster = idx->mem[idx->num_slots + block_idx / part->blocks_per_cluster];
+  return _mfat_first_block_of_cluster(part, cluster) + block_idx % part->blocks_per_cluster;
+}
 
-  return fd;
+#if MFAT_ENABLE_LFN
+// State of the hashing of a long file name while a directory is indexed. The LFN entries are stored
+// in reverse order, so long file names are hashed from the last character to the first.
+typedef struct {
+  uint32_t hash;     // Hash of the name fragments so far.
+  uint8_t seq;       // Sequence number of the last hashed LFN entry (0 = no name in progress).
+  uint8_t checksum;  // Checksum of the short name that the LFN entries belong to.
+} mfat_lfn_hash_t;
+
+// Add a character of a long file name to a hash (FNV-1a, case insensitive).
+static uint32_t _mfat_lfn_hash_char(uint32_t h, uint32_t c) {
+  return (h ^ _mfat_lfn_fold(c)) * 16777619U;
+}
+
+// Hash a long file name.
+static uint32_t _mfat_lfn_hash(const uint16_t* name, uint32_t len) {
+  uint32_t h = 2166136261U;
+  for (uint32_t i = len; i > 0U; --i) {
+    h = _mfat_lfn_hash_char(h, name[i - 1U]);
+  }
+  return h;
+}
+
+// Add the name fragment of an LFN entry to the hash of a long file name.
+static void _mfat_lfn_hash_entry(mfat_lfn_hash_t* lh, const uint8_t* entry) {
+  uint32_t seq = entry[0] & 0x1fU;
+  uint32_t num_chars = MFAT_LFN_CHARS_PER_ENTRY;
+  if ((entry[0] & 0x40U) != 0U) {
+    // The first LFN entry holds the last fragment of the name (zero terminated, unless it fills
+    // the fragment).
+    num_chars = 0U;
+    while (num_chars < MFAT_LFN_CHARS_PER_ENTRY &&
+           _mfat_get_word(&entry[s_lfn_char_offs[num_chars]]) != 0U) {
+      ++num_chars;
+    }
+    if (seq == 0U || num_chars == 0U) {
+      lh->seq = 0U;
+      return;
+    }
+    lh->hash = 2166136261U;
+    lh->checksum = entry[13];
+  } else if (lh->seq == 0U || seq + 1U != lh->seq || entry[13] != lh->checksum) {
+    lh->seq = 0U;
+    return;
+  }
+
+  for (uint32_t i = num_chars; i > 0U; --i) {
+    lh->hash = _mfat_lfn_hash_char(lh->hash, _mfat_get_word(&entry[s_lfn_char_offs[i - 1U]]));
+  }
+  lh->seq = (uint8_t)seq;
+}
+
+// Check if the LFN entries that precede a short name entry of an indexed directory hold a given
+// long file name (they may be located in the previous directory block).
+static mfat_bool_t _mfat_dir_index_lfn_match(mfat_ctx_t* ctx,
+                                             const mfat_partition_t* part,
+                                             const mfat_dir_index_t* idx,
+                                             uint32_t entry_no,
+                                             uint8_t checksum,
+                                             const uint16_t* name,
+                                             uint32_t len) {
+  uint32_t num_lfn_entries = (len + MFAT_LFN_CHARS_PER_ENTRY - 1U) / MFAT_LFN_CHARS_PER_ENTRY;
+  if (num_lfn_entries > entry_no) {
+    return false;
+  }
+  mfat_lfn_match_t m = {0U, 0U};
+  for (uint32_t e = entry_no - num_lfn_entries; e < entry_no; ++e) {
+    const uint8_t* buf = _mfat_view_block(
+        ctx, _mfat_dir_index_blk_no(part, idx, e / MFAT_DIR_ENTRIES_PER_BLOCK), MFAT_CACHE_DATA);
+    if (buf == NULL) {
+      return false;
+    }
+    const uint8_t* entry = &buf[(e % MFAT_DIR_ENTRIES_PER_BLOCK) * 32U];
+    if (entry[0] == 0x00 || entry[0] == 0xe5 || (entry[11] & 0x3fU) != MFAT_ATTR_LONG_NAME) {
+      return false;
+    }
+    _mfat_lfn_match_entry(&m, entry, name, len);
+  }
+  return m.seq == 1U && m.checksum == checksum;
+}
+#endif
+
+// Add a directory entry to the hash table of an index (h is the hash of its name).
+static void _mfat_dir_index_insert(mfat_dir_index_t* idx, uint32_t h, uint32_t entry_no) {
+  uint32_t mask = idx->num_slots - 1U;
+  uint32_t i = h & mask;
+  while (idx->mem[i] != 0U) {
+    i = (i + 1U) & mask;
+  }
+  idx->mem[i] = 0x80000000U | ((h >> 17) << 16) | entry_no;
+  ++idx->num_entries;
+}
+
+// Build the name index of a directory, by scanning all of its blocks.
+static mfat_dir_index_t* _mfat_dir_index_build(mfat_ctx_t* ctx,
+                                               int part_no,
+                                               const mfat_partition_t* part,
+                                               uint32_t dir_cluster) {
+  // Determine the size of the directory (FAT16 root directories have a fixed size).
+  uint32_t num_clusters = 0U;
+  uint32_t num_blocks = part->blocks_in_root_dir;
+  if (dir_cluster != 0U) {
+    uint32_t max_clusters =
+        MFAT_DIR_INDEX_MAX_ENTRIES / (MFAT_DIR_ENTRIES_PER_BLOCK * part->blocks_per_cluster);
+    for (uint32_t c = dir_cluster; !_mfat_is_eoc(c);) {
+      if (++num_clusters > max_clusters || !_mfat_next_cluster(ctx, part, &c)) {
+        return NULL;
+      }
+    }
+    num_blocks = num_clusters * part->blocks_per_cluster;
+  }
+
+  // Allocate the index (we keep the load factor of the hash table below 2/3).
+  uint32_t max_entries = num_blocks * MFAT_DIR_ENTRIES_PER_BLOCK;
+  uint32_t num_slots = 16U;
+  while (num_slots < max_entries + max_entries / 2U) {
+    num_slots *= 2U;
+  }
+  mfat_dir_index_t* idx = _mfat_dir_index_alloc(ctx, num_slots + num_clusters);
+  if (idx == NULL) {
+    DBGF("Not enough memory for the index of directory %" PRIu32, dir_cluster);
+    return NULL;
+  }
+  idx->num_slots = num_slots;
+  idx->num_clusters = num_clusters;
+  idx->num_entries = 0U;
+  idx->dir_cluster = dir_cluster;
+  idx->part_no = part_no;
+  idx->last_use = ctx->dir_index_clock++;
+  memset(idx->mem, 0, num_slots * sizeof(uint32_t));
+  uint32_t c = dir_cluster;
+  for (uint32_t i = 0U; i < num_clusters; ++i) {
+    idx->mem[num_slots + i] = c;
+    if (!_mfat_next_cluster(ctx, part, &c)) {
+      _mfat_dir_index_drop(ctx, idx);
+      return NULL;
+    }
+  }
+
+  // Scan the directory blocks, and add all the file/dir entries to the hash table (the hash table
+  // is large enough for two slots per file/dir entry, since every long file name occupies at least
+  // one extra directory entry).
+#if MFAT_ENABLE_LFN
+  mfat_lfn_hash_t lfn_hash = {0U, 0U, 0U};
+#endif
+  for (uint32_t b = 0U; b < num_blocks; ++b) {
+    const uint8_t* buf =
+        _mfat_view_block(ctx, _mfat_dir_index_blk_no(part, idx, b), MFAT_CACHE_DATA);
+    if (buf == NULL) {
+      _mfat_dir_index_drop(ctx, idx);
+      return NULL;
+    }
+    mfat_dir_scan_t scan;
+    _mfat_scan_dir_block(buf, NULL, &scan);
+    for (uint32_t files = scan.files; files != 0U; files &= files - 1U) {
+      uint32_t k = _mfat_ctz(files);
+      const char* name = (const char*)&buf[k * 32U];
+      _mfat_dir_index_insert(idx, _mfat_name_hash(name), b * MFAT_DIR_ENTRIES_PER_BLOCK + k);
+    }
+#if MFAT_ENABLE_LFN
+    // Add the long file names too (they refer to their short name entries).
+    if (scan.lfn != 0U || lfn_hash.seq != 0U) {
+      for (uint32_t k = 0U; k < scan.end; ++k) {
+        const uint8_t* entry = &buf[k * 32U];
+        uint32_t bit = 1U << k;
+        if ((scan.lfn & bit) != 0U) {
+          _mfat_lfn_hash_entry(&lfn_hash, entry);
+          continue;
+        }
+        if ((scan.files & bit) != 0U && lfn_hash.seq == 1U &&
+            _mfat_lfn_checksum(entry) == lfn_hash.checksum) {
+          _mfat_dir_index_insert(idx, lfn_hash.hash, b * MFAT_DIR_ENTRIES_PER_BLOCK + k);
+        }
+        lfn_hash.seq = 0U;
+      }
+    }
+#endif
+
+    // Last block of the directory structure?
+    if (scan.end < MFAT_DIR_ENTRIES_PER_BLOCK) {
+      break;
+    }
+  }
+
+  DBGF("Indexed %" PRIu32 " entries of directory %" PRIu32, idx->num_entries, dir_cluster);
+  return idx;
+}
+
+// Get the name index of a directory (it is built if necessary).
+static mfat_dir_index_t* _mfat_dir_index_get(mfat_ctx_t* ctx,
+                                             int part_no,
+                                             const mfat_partition_t* part,
+                                             uint32_t dir_cluster) {
+  if (ctx->dir_index_mem == NULL) {
+    return NULL;
+  }
+  for (int i = 0; i < MFAT_NUM_DIR_INDEXES; ++i) {
+    mfat_dir_index_t* idx = &ctx->dir_index[i];
+    if (idx->mem != NULL && idx->part_no == part_no && idx->dir_cluster == dir_cluster) {
+      idx->last_use = ctx->dir_index_clock++;
+      return idx;
+    }
+  }
+  return _mfat_dir_index_build(ctx, part_no, part, dir_cluster);
+}
+
+// Look up a file name in a directory via the name index of the directory. The name is either a
+// canonical (8.3) file name (fname), or a long file name (lfn != NULL). On success, the directory
+// entry is returned as a view into the directory block that holds it.
+static int _mfat_dir_index_find(mfat_ctx_t* ctx,
+                                int part_no,
+                                const mfat_partition_t* part,
+                                uint32_t dir_cluster,
+                                const char* fname,
+                                const uint16_t* lfn,
+                                uint32_t lfn_len,
+                                const uint8_t** entry,
+                                uint32_t* blk_no,
+                                uint32_t* offset) {
+  // Only FAT16 root directories are identified by cluster 0.
+  if (dir_cluster == 0U && part->type == MFAT_PART_TYPE_FAT32) {
+    return MFAT_DIR_INDEX_UNAVAILABLE;
+  }
+  mfat_dir_index_t* idx = _mfat_dir_index_get(ctx, part_no, part, dir_cluster);
+  if (idx == NULL) {
+    return MFAT_DIR_INDEX_UNAVAILABLE;
+  }
+
+  // Probe the hash table. Slots with a matching hash are verified against the directory entry.
+#if MFAT_ENABLE_LFN
+  uint32_t h = (lfn != NULL) ? _mfat_lfn_hash(lfn, lfn_len) : _mfat_name_hash(fname);
+#else
+  (void)lfn;
+  (void)lfn_len;
+  uint32_t h = _mfat_name_hash(fname);
+#endif
+  uint32_t tag = 0x80000000U | ((h >> 17) << 16);
+  uint32_t mask = idx->num_slots - 1U;
+  for (uint32_t i = h & mask; idx->mem[i] != 0U; i = (i + 1U) & mask) {
+    if ((idx->mem[i] & 0xffff0000U) != tag) {
+      continue;
+    }
+    uint32_t entry_no = idx->mem[i] & 0xffffU;
+    *blk_no = _mfat_dir_index_blk_no(part, idx, entry_no / MFAT_DIR_ENTRIES_PER_BLOCK);
+    const uint8_t* buf = _mfat_view_block(ctx, *blk_no, MFAT_CACHE_DATA);
+    if (buf == NULL) {
+      return MFAT_DIR_INDEX_UNAVAILABLE;
+    }
+    *offset = (entry_no % MFAT_DIR_ENTRIES_PER_BLOCK) * 32U;
+#if MFAT_ENABLE_LFN
+    if (lfn != NULL) {
+      // Note: The LFN entries may be in another block, so the short name entry is loaded last.
+      uint8_t checksum = _mfat_lfn_checksum(&buf[*offset]);
+      if (!_mfat_dir_index_lfn_match(ctx, part, idx, entry_no, checksum, lfn, lfn_len)) {
+        continue;
+      }
+      buf = _mfat_view_block(ctx, *blk_no, MFAT_CACHE_DATA);
+      if (buf == NULL) {
+        return MFAT_DIR_INDEX_UNAVAILABLE;
+      }
+      *entry = &buf[*offset];
+      return MFAT_DIR_INDEX_FOUND;
+    }
+#endif
+    *entry = &buf[*offset];
+    if (_mfat_cmpbuf(*entry, (const uint8_t*)fname, 11)) {
+      return MFAT_DIR_INDEX_FOUND;
+    }
+  }
+  return MFAT_DIR_INDEX_NOT_FOUND;
 }
 
-static int _mfat_close_impl(mfat_file_t* f) {
 #if MFAT_ENABLE_WRITE
-  // For good measure, we flush pending writes when a file is closed (only do this when closing
-  // files that are open with write permissions).
-  if ((f->oflag & MFAT_O_WRONLY) != 0) {
-    _mfat_sync_impl();
+// Find the name index of the directory that a given directory block belongs to.
+static mfat_dir_index_t* _mfat_dir_index_of_block(mfat_ctx_t* ctx,
+                                                  int part_no,
+                                                  uint32_t blk_no,
+                                                  uint32_t* block_idx) {
+  const mfat_partition_t* part = &ctx->partition[part_no];
+  uint32_t cluster = 0U;
+  if (blk_no >= part->first_data_block) {
+    cluster = (blk_no - part->first_data_block) / part->blocks_per_cluster + 2U;
+  }
+  for (int i = 0; i < MFAT_NUM_DIR_INDEXES; ++i) {
+    mfat_dir_index_t* idx = &ctx->dir_index[i];
+    if (idx->mem == NULL || idx->part_no != part_no) {
+      continue;
+    }
+    if (idx->num_clusters == 0U) {
+      if (cluster == 0U) {
+        *block_idx = blk_no - part->root_dir_block;
+        return idx;
+      }
+      continue;
+    }
+    for (uint32_t k = 0U; k < idx->num_clusters; ++k) {
+      if (idx->mem[idx->num_slots + k] == cluster) {
+        *block_idx =
+            k * part->blocks_per_cluster + (blk_no - _mfat_first_block_of_cluster(part, cluster));
+        return idx;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Add a new directory entry to the name index of its directory (if the directory has an index).
+static void _mfat_dir_index_add(mfat_ctx_t* ctx,
+                                int part_no,
+                                uint32_t blk_no,
+                                uint32_t offset,
+                                const char* fname) {
+  uint32_t block_idx;
+  mfat_dir_index_t* idx = _mfat_dir_index_of_block(ctx, part_no, blk_no, &block_idx);
+  if (idx == NULL) {
+    return;
+  }
+
+  // Drop the index if the hash table is getting full (it is rebuilt on the next lookup).
+  if (3U * (idx->num_entries + 1U) > 2U * idx->num_slots) {
+    _mfat_dir_index_drop(ctx, idx);
+  } else {
+    uint32_t entry_no = block_idx * MFAT_DIR_ENTRIES_PER_BLOCK + offset / 32U;
+    _mfat_dir_index_insert(idx, _mfat_name_hash(fname), entry_no);
+  }
+}
+
+// Drop the name index of a directory that is being extended with a new cluster.
+static void _mfat_dir_index_invalidate(mfat_ctx_t* ctx, int part_no, uint32_t last_cluster) {
+  uint32_t blk_no = _mfat_first_block_of_cluster(&ctx->partition[part_no], last_cluster);
+  uint32_t block_idx;
+  mfat_dir_index_t* idx = _mfat_dir_index_of_block(ctx, part_no, blk_no, &block_idx);
+  if (idx != NULL) {
+    _mfat_dir_index_drop(ctx, idx);
+  }
+}
+#endif
+#endif  // MFAT_ENABLE_DIR_INDEX
+
+/// @brief Find a file on the given partition.
+///
+/// If the directory (if part of the path) exists, but the file does not exist in the directory,
+/// this function will find the first free directory entry slot and set @c exists to false. This is
+/// useful for creating new files.
+/// @param part_no The partition number.
+/// @param path The absolute path to the file.
+/// @param create true if the directory should be extended with a new cluster if it does not have a
+/// free directory entry slot (not possible for FAT16 root directories).
+/// @param[out] info Information about the file.
+/// @param[out] file_type The file type (e.g. dir or regular file).
+/// @param[out] exists true if the file exists, false if it needs to be created.
+/// @param[out] dir_entry A copy of the directory entry of the file (may be NULL).
+/// @returns true if the file (or its potential slot) was found.
+static mfat_bool_t _mfat_find_file(mfat_ctx_t* ctx,
+                                   int part_no,
+                                   const char* path,
+                                   mfat_bool_t create,
+                                   mfat_file_info_t* info,
+                                   int* file_type,
+                                   mfat_bool_t* exists,
+                                   uint8_t* dir_entry) {
+  mfat_partition_t* part = &ctx->partition[part_no];
+
+  // Start with the root directory cluster/block.
+  mfat_cluster_pos_t cpos;
+  uint32_t blocks_left;
+  if (part->type == MFAT_PART_TYPE_FAT32) {
+    cpos = _mfat_cluster_pos_init(part, part->root_dir_cluster, 0);
+    blocks_left = 0xffffffffU;
+  } else {
+    // We use a fake/tweaked cluster pos for FAT16 root directories.
+    cpos.cluster_no = 0U;
+    cpos.cluster_idx = 0U;
+    cpos.cluster_start_blk = part->root_dir_block;
+    cpos.block_in_cluster = 0U;
+    blocks_left = part->blocks_in_root_dir;
+  }
+
+  // Special case: Is the caller trying to open the root directory?
+  mfat_bool_t is_root_dir = false;
+  if (path[1] == 0 && (path[0] == '/' || path[0] == '\\')) {
+    DBG("Request to open root directory");
+    is_root_dir = true;
   }
+
+  // Try to find the given path.
+  const uint8_t* file_entry = NULL;
+  uint32_t file_entry_blk = 0U;
+  uint32_t file_entry_offset = 0U;
+  mfat_bool_t is_parent_dir = false;
+  mfat_bool_t is_long_name = false;
+  uint32_t free_slot_blk = 0U;     // Block of the first free directory entry slot (0 = none).
+  uint32_t free_slot_offset = 0U;  // Offset of the first free slot in its block.
+  uint32_t last_dir_cluster = 0U;  // The last visited cluster of the directory.
+#if MFAT_ENABLE_DENTRY_CACHE
+  uint32_t parent_dir_cluster = 0U;  // The first cluster of the parent directory.
+#endif
+  if (!is_root_dir) {
+    // Skip leading slashes.
+    while (*path == '/' || *path == '\\') {
+      ++path;
+    }
+
+    int path_pos = 0;
+    while (path_pos >= 0) {
+      // Extract a directory entry compatible file name.
+      const char* name = &path[path_pos];
+      char fname[12];
+      int name_pos = _mfat_canonicalize_fname(name, fname);
+      is_parent_dir = (name_pos >= 0);
+
+      path_pos = is_parent_dir ? path_pos + name_pos : -1;
+      DBGF("Looking for %s: \"%s\"", is_parent_dir ? "parent dir" : "file", fname);
+
+#if MFAT_ENABLE_LFN
+      // Names that are not valid 8.3 names can only match long file names.
+      uint16_t lfn[MFAT_LFN_MAX_CHARS];
+      uint32_t lfn_len = 0U;
+      mfat_lfn_match_t lfn_match = {0U, 0U};
+      is_long_name = !_mfat_is_short_name(name);
+      if (is_long_name && !_mfat_decode_lfn(name, &lfn[0], &lfn_len)) {
+        DBG("Invalid long file name");
+        return false;
+      }
+#endif
+
+      const uint8_t* found_entry = NULL;
+      uint32_t found_blk = 0U;
+      uint32_t found_offset = 0U;
+#if MFAT_ENABLE_DENTRY_CACHE || MFAT_ENABLE_DIR_INDEX
+      uint32_t dir_cluster = cpos.cluster_no;
+#endif
+#if MFAT_ENABLE_DENTRY_CACHE
+      parent_dir_cluster = dir_cluster;
+#endif
+
+#if MFAT_ENABLE_DENTRY_CACHE
+      // Try the dentry cache first (a hit saves a scan of the directory blocks).
+      const mfat_dentry_t* dentry =
+          !is_long_name ? _mfat_dentry_find(ctx, part_no, dir_cluster, fname) : NULL;
+      if (dentry != NULL) {
+        DBGF("Dentry cache hit: \"%s\"", fname);
+        found_entry = &dentry->entry[0];
+        found_blk = dentry->dir_entry_block;
+        found_offset = dentry->dir_entry_offset;
+      }
+#endif
+
+#if MFAT_ENABLE_DIR_INDEX
+      // Next, try the name index of the directory (it holds both short and long file names).
+      if (found_entry == NULL) {
+        const uint16_t* idx_lfn = NULL;
+        uint32_t idx_lfn_len = 0U;
+#if MFAT_ENABLE_LFN
+        if (is_long_name) {
+          idx_lfn = &lfn[0];
+          idx_lfn_len = lfn_len;
+        }
+#endif
+        const uint8_t* idx_entry;
+        uint32_t idx_blk;
+        uint32_t idx_offset;
+        int res = _mfat_dir_index_find(ctx,
+                                       part_no,
+                                       part,
+                                       dir_cluster,
+                                       fname,
+                                       idx_lfn,
+                                       idx_lfn_len,
+                                       &idx_entry,
+                                       &idx_blk,
+                                       &idx_offset);
+        if (res == MFAT_DIR_INDEX_FOUND) {
+          found_entry = idx_entry;
+          found_blk = idx_blk;
+          found_offset = idx_offset;
+#if MFAT_ENABLE_DENTRY_CACHE
+          if (!is_long_name) {
+            _mfat_dentry_insert(ctx, part_no, dir_cluster, found_blk, found_offset, found_entry);
+          }
+#endif
+        } else if (res == MFAT_DIR_INDEX_NOT_FOUND && (is_parent_dir || !create || is_long_name)) {
+          // We only need to scan the directory if we are looking for a free slot.
+          DBGF("Not found in the directory index: \"%s\"", fname);
+          return false;
+        }
+      }
+#endif
+
+      // Use an "unlimited" block counter if we're doing a clusterchain lookup.
+      if (cpos.cluster_no != 0U) {
+        blocks_left = 0xffffffffU;
+      }
+
+      // Look up the file name in the directory.
+      mfat_bool_t no_more_entries = false;
+      for (; found_entry == NULL && !no_more_entries && blocks_left > 0U; --blocks_left) {
+        // End of the directory cluster chain?
+        if (_mfat_is_eoc(cpos.cluster_no)) {
+          break;
+        }
+
+        // Load the directory table block.
+        uint32_t blk_no = _mfat_cluster_pos_blk_no(&cpos);
+        const uint8_t* buf = _mfat_view_block(ctx, blk_no, MFAT_CACHE_DATA);
+        if (buf == NULL) {
+          DBGF("Unable to load directory block %" PRIu32, blk_no);
+          return false;
+        }
+
+        // Scan all the entries in this directory block.
+        mfat_dir_scan_t scan;
+        _mfat_scan_dir_block(buf, fname, &scan);
+#if MFAT_ENABLE_LFN
+        if (is_long_name) {
+          scan.match = _mfat_lfn_match_block(buf, &scan, &lfn[0], lfn_len, &lfn_match);
+        }
+#endif
+
+        // Remember the first free entry slot, in case we want to create a new file.
+        if (scan.free != 0U && free_slot_blk == 0U) {
+          free_slot_blk = blk_no;
+          free_slot_offset = _mfat_ctz(scan.free) * 32U;
+        }
+
+        // Is the file/dir that we are looking for in this block?
+        if (scan.match != 0U) {
+          found_offset = _mfat_ctz(scan.match) * 32U;
+          found_entry = &buf[found_offset];
+          found_blk = blk_no;
+#if MFAT_ENABLE_DENTRY_CACHE
+          _mfat_dentry_insert(ctx, part_no, dir_cluster, found_blk, found_offset, found_entry);
+#endif
+        }
+
+        // Last block of the directory structure?
+        no_more_entries = (scan.end < MFAT_DIR_ENTRIES_PER_BLOCK);
+
+        // Go to the next block in the directory.
+        if (found_entry == NULL) {
+          if (cpos.cluster_no != 0U) {
+            last_dir_cluster = cpos.cluster_no;
+            if (!_mfat_cluster_pos_advance(ctx, &cpos, part)) {
+              return false;
+            }
+          } else {
+            cpos.block_in_cluster += 1;  // FAT16 style linear block access.
+          }
+        }
+      }
+
+      // Break loop if we didn't find the file.
+      if (found_entry == NULL) {
+        break;
+      }
+
+      // Descend into directory?
+      if (is_parent_dir) {
+        if ((found_entry[11] & MFAT_ATTR_DIRECTORY) == 0U) {
+          DBGF("Not a directory: %s", fname);
+          return false;
+        }
+
+        // Decode the starting cluster of the child directory entry table.
+        cpos = _mfat_cluster_pos_init(part, _mfat_dir_entry_cluster(found_entry), 0);
+        blocks_left = 0xffffffffU;
+        free_slot_blk = 0U;
+      } else {
+        file_entry = found_entry;
+        file_entry_blk = found_blk;
+        file_entry_offset = found_offset;
+      }
+    }
+
+    // If the file was not found (but its parent directory was), use the first free directory entry
+    // slot for the file (files with long names can not be created).
+    if (file_entry == NULL && !is_parent_dir && !is_long_name) {
+#if MFAT_ENABLE_WRITE
+      // Extend the directory with a new cluster if there are no free slots.
+      if (free_slot_blk == 0U && create && last_dir_cluster != 0U) {
+        uint32_t new_cluster;
+        _mfat_lock(ctx, MFAT_LOCK_FAT_CACHE);
+        mfat_bool_t ok = _mfat_alloc_cluster(ctx, part, last_dir_cluster, &new_cluster);
+        _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+        if (!ok || !_mfat_zero_cluster(ctx, part, new_cluster)) {
+          return false;
+        }
+#if MFAT_ENABLE_DIR_INDEX
+        // The cluster list of the directory index (if any) is no longer complete.
+        _mfat_dir_index_invalidate(ctx, part_no, last_dir_cluster);
+#endif
+        free_slot_blk = _mfat_first_block_of_cluster(part, new_cluster);
+        free_slot_offset = 0U;
+      }
+#else
+      (void)create;
+      (void)last_dir_cluster;
 #endif
+      if (free_slot_blk != 0U) {
+        const uint8_t* buf = _mfat_view_block(ctx, free_slot_blk, MFAT_CACHE_DATA);
+        if (buf == NULL) {
+          DBGF("Unable to load directory block %" PRIu32, free_slot_blk);
+          return false;
+        }
+        file_entry = &buf[free_slot_offset];
+        file_entry_blk = free_slot_blk;
+        file_entry_offset = free_slot_offset;
+      }
+    }
+  }
+
+  // Could we neither find the file nor a new directory slot for the file?
+  if (file_entry == NULL && !is_root_dir) {
+    return false;
+  }
+
+  // Define the file properties.
+  info->part_no = part_no;
+#if MFAT_ENABLE_DENTRY_CACHE
+  info->dir_cluster = parent_dir_cluster;
+#endif
+  if (is_root_dir) {
+    // Special handling of the root directory (it does not have an entry in any directory block).
+    info->size = 0U;
+    info->first_cluster = cpos.cluster_no;
+    info->dir_entry_block = 0U;
+    info->dir_entry_offset = 0U;
+    *file_type = (cpos.cluster_no == 0U) ? MFAT_FILE_TYPE_FAT16ROOTDIR : MFAT_FILE_TYPE_DIR;
+    *exists = true;
+  } else {
+    // For files and non root dirs, we extract file information from the directory entry.
+    info->size = _mfat_get_dword(&file_entry[28]);
+    info->first_cluster = _mfat_dir_entry_cluster(file_entry);
+    info->dir_entry_block = file_entry_blk;
+    info->dir_entry_offset = file_entry_offset;
+    if (dir_entry != NULL) {
+      memcpy(dir_entry, file_entry, 32);
+    }
+
+    // Does the file exist?
+    if ((file_entry[0] != 0x00) && (file_entry[0] != 0xe5)) {
+      *file_type = (file_entry[11] & MFAT_ATTR_DIRECTORY) != 0U ? MFAT_FILE_TYPE_DIR
+                                                                : MFAT_FILE_TYPE_REGULAR;
+      *exists = true;
+    } else {
+      // Non-existent files must be regular files, since we can't create directories with
+      // MFAT_O_CREAT.
+      info->size = 0U;
+      info->first_cluster = 0U;
+      *file_type = MFAT_FILE_TYPE_REGULAR;
+      *exists = false;
+    }
+  }
+
+  return true;
+}
+
+#if MFAT_ENABLE_WRITE
+// Write all dirty blocks of a cache to storage. The dirty blocks are written in ascending block
+// order, and runs of adjacent blocks are written with a single request (if supported).
+static mfat_bool_t _mfat_flush_cache(mfat_ctx_t* ctx, int cache_type) {
+  mfat_cache_t* cache = &ctx->cache[cache_type];
+
+  // Collect the dirty blocks, sorted by block number (insertion sort - the number of dirty blocks
+  // is usually small).
+  int* slots = cache->slots;
+  int num_dirty = 0;
+  for (int i = 0; i < cache->num_blocks; ++i) {
+    mfat_cached_block_t* cb = &cache->block[i];
+    if (cb->state == MFAT_DIRTY) {
+      int j = num_dirty++;
+      for (; j > 0 && cache->block[slots[j - 1]].blk_no > cb->blk_no; --j) {
+        slots[j] = slots[j - 1];
+      }
+      slots[j] = i;
+    }
+  }
+
+  mfat_bool_t success = true;
+  for (int i = 0; i < num_dirty;) {
+    // Find the length of the run of adjacent blocks.
+    uint32_t first_blk = cache->block[slots[i]].blk_no;
+    int count = 1;
+    while ((i + count) < num_dirty &&
+           cache->block[slots[i + count]].blk_no == first_blk + (uint32_t)count) {
+      ++count;
+    }
+
+    // Write the run (with a single request if possible).
+    DBGF("Cache %d: Flushing %d block(s) starting at block %" PRIu32, cache_type, count, first_blk);
+    mfat_bool_t ok;
+    if (ctx->write_blocks != NULL && count > 1 && cache->num_pins == 0) {
+      _mfat_make_contiguous(cache, &slots[i], count);
+      ok = _mfat_write_blocks(ctx, cache->block[slots[i]].buf, first_blk, (uint32_t)count);
+    } else {
+      ok = true;
+      for (int k = 0; k < count && ok; ++k) {
+        mfat_cached_block_t* cb = &cache->block[slots[i + k]];
+        ok = _mfat_write_blocks(ctx, cb->buf, cb->blk_no, 1U);
+      }
+    }
+
+    // Mark the blocks as clean (or leave them dirty if the write failed, so that we try again).
+    if (ok) {
+      for (int k = 0; k < count; ++k) {
+        cache->block[slots[i + k]].state = MFAT_VALID;
+      }
+    } else {
+      DBGF("Cache %d: Failed to flush the block(s)", cache_type);
+      success = false;
+    }
+
+    i += count;
+  }
+
+  return success;
+}
+
+// Copy the modified blocks of the first FAT to the other FAT copies (FAT copy no. N starts at
+// block N * blocks_per_fat of the FAT area). The blocks are transferred via the FAT cache, in runs
+// of up to the size of the FAT cache, and each run is written to each FAT copy with a single
+// request (if supported).
+static mfat_bool_t _mfat_mirror_fat(mfat_ctx_t* ctx, mfat_partition_t* part) {
+  mfat_cache_t* cache = &ctx->cache[MFAT_CACHE_FAT];
+  const uint32_t fat_start = part->first_block + part->num_reserved_blocks;
+
+  for (uint32_t i = 0U; i < part->num_fat_dirty; ++i) {
+    const mfat_block_range_t* range = &part->fat_dirty[i];
+    for (uint32_t offset = 0U; offset < range->count;) {
+      uint32_t first_blk = fat_start + range->first + offset;
+      int count = (int)_mfat_min(range->count - offset, (uint32_t)cache->num_blocks);
+
+      // Get the blocks of the run into the cache, in contiguous buffers.
+      int* slots = cache->slots;
+      for (int k = 0; k < count; ++k) {
+        mfat_cached_block_t* cb =
+            _mfat_get_cached_block(ctx, first_blk + (uint32_t)k, MFAT_CACHE_FAT);
+        if (cb == NULL) {
+          return false;
+        }
+        slots[k] = (int)(cb - &cache->block[0]);
+      }
+      _mfat_make_contiguous(cache, &slots[0], count);
+      uint8_t* buf = cache->block[slots[0]].buf;
+
+      // Read the blocks that were not already cached.
+      for (int k = 0; k < count;) {
+        if (cache->block[slots[k]].state != MFAT_INVALID) {
+          ++k;
+          continue;
+        }
+        int end = k + 1;
+        while (end < count && cache->block[slots[end]].state == MFAT_INVALID) {
+          ++end;
+        }
+        if (!_mfat_read_blocks(ctx,
+                               &buf[k * MFAT_BLOCK_SIZE],
+                               first_blk + (uint32_t)k,
+                               (uint32_t)(end - k))) {
+          return false;
+        }
+        for (; k < end; ++k) {
+          cache->block[slots[k]].state = MFAT_VALID;
+        }
+      }
+
+      // Write the run to the other FAT copies.
+      DBGF("Mirroring %d FAT block(s) starting at block %" PRIu32, count, first_blk);
+      for (uint32_t n = 1U; n < part->num_fats; ++n) {
+        if (!_mfat_write_blocks(ctx, buf, first_blk + n * part->blocks_per_fat, (uint32_t)count)) {
+          DBG("Failed to mirror the FAT");
+          return false;
+        }
+      }
+
+      offset += (uint32_t)count;
+    }
+  }
+
+  part->num_fat_dirty = 0U;
+  return true;
+}
+
+// Write all pending changes to storage. The FAT copies are only updated if the FAT mirroring mode
+// says so, or if we are unmounting.
+static void _mfat_sync_impl(mfat_ctx_t* ctx, mfat_bool_t unmount) {
+#if MFAT_ENABLE_MMAP
+  // Memory mapped images are read only, so there is nothing to write.
+  if (ctx->image != NULL) {
+    return;
+  }
+#endif
+
+  // Update the FSInfo sectors (they live in the data cache), and flush the data cache.
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  _mfat_lock(ctx, MFAT_LOCK_FAT_CACHE);
+  for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
+    if (ctx->partition[i].type != MFAT_PART_TYPE_UNKNOWN) {
+      (void)_mfat_update_fsinfo(ctx, &ctx->partition[i]);
+    }
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+  (void)_mfat_flush_cache(ctx, MFAT_CACHE_DATA);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+
+  // Flush the FAT cache, and update the FAT copies.
+  _mfat_lock(ctx, MFAT_LOCK_FAT_CACHE);
+  (void)_mfat_flush_cache(ctx, MFAT_CACHE_FAT);
+  if (unmount || ctx->fat_mirroring == MFAT_FAT_MIRROR_SYNC) {
+    for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
+      if (ctx->partition[i].type != MFAT_PART_TYPE_UNKNOWN) {
+        (void)_mfat_mirror_fat(ctx, &ctx->partition[i]);
+      }
+    }
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+}
+#endif
+
+static int _mfat_fstat_impl(mfat_ctx_t* ctx, mfat_file_info_t* info, mfat_stat_t* stat) {
+  // We can't stat root directories.
+  if (info->dir_entry_block == 0U) {
+    return -1;
+  }
+
+  // Read the directory entry block (should already be in the cache).
+  const uint8_t* buf = _mfat_view_block(ctx, info->dir_entry_block, MFAT_CACHE_DATA);
+  if (buf == NULL) {
+    return -1;
+  }
+
+  // Extract the relevant information for this directory entry.
+  const uint8_t* dir_entry = &buf[info->dir_entry_offset];
+  _mfat_dir_entry_to_stat(dir_entry, stat);
+
+  return 0;
+}
+
+static int _mfat_stat_impl(mfat_ctx_t* ctx, const char* path, mfat_stat_t* stat) {
+  // Find the file in the file system structure.
+  mfat_bool_t is_dir;
+  mfat_bool_t exists;
+  mfat_file_info_t info;
+  uint8_t dir_entry[32];
+  mfat_bool_t ok = _mfat_find_file(
+      ctx, ctx->active_partition, path, false, &info, &is_dir, &exists, &dir_entry[0]);
+  if (!ok || !exists) {
+    DBGF("File not found: %s", path);
+    return -1;
+  }
+
+  // We can't stat root directories.
+  if (info.dir_entry_block == 0U) {
+    return -1;
+  }
+
+  // Use the copy of the directory entry (so that we don't have to read the directory block again).
+  _mfat_dir_entry_to_stat(&dir_entry[0], stat);
+  return 0;
+}
+
+#if MFAT_ENABLE_WRITE
+// Create a new (empty) regular file, in the free directory entry slot that was found by
+// _mfat_find_file().
+static mfat_bool_t _mfat_create_file(mfat_ctx_t* ctx,
+                                     const mfat_file_info_t* info,
+                                     const char* path) {
+  // Extract the file name (the last part of the path).
+  char fname[12];
+  while (*path == '/' || *path == '\\') {
+    ++path;
+  }
+  int path_pos = 0;
+  while (path_pos >= 0) {
+    int name_pos = _mfat_canonicalize_fname(&path[path_pos], fname);
+    path_pos = (name_pos >= 0) ? path_pos + name_pos : -1;
+  }
+
+  mfat_cached_block_t* block = _mfat_read_block(ctx, info->dir_entry_block, MFAT_CACHE_DATA);
+  if (block == NULL) {
+    return false;
+  }
+
+  // Fill out the directory entry. Since we have no clock, the file times are set to the FAT epoch
+  // (1980-01-01 00:00:00).
+  uint8_t* dir_entry = &block->buf[info->dir_entry_offset];
+  memset(dir_entry, 0, 32);
+  memcpy(&dir_entry[0], &fname[0], 11);
+  dir_entry[11] = MFAT_ATTR_ARCHIVE;
+  _mfat_set_word(&dir_entry[16], 0x0021U);  // Creation date.
+  _mfat_set_word(&dir_entry[18], 0x0021U);  // Last access date.
+  _mfat_set_word(&dir_entry[24], 0x0021U);  // Modification date.
+  block->state = MFAT_DIRTY;
+#if MFAT_ENABLE_DENTRY_CACHE
+  _mfat_dentry_update(ctx, info, dir_entry);
+#endif
+#if MFAT_ENABLE_DIR_INDEX
+  _mfat_dir_index_add(ctx, info->part_no, info->dir_entry_block, info->dir_entry_offset, fname);
+#endif
+
+  DBGF("Created file \"%s\"", fname);
+
+  return true;
+}
+
+// Update the size and the first cluster of a file in its directory entry.
+static mfat_bool_t _mfat_update_dir_entry(mfat_ctx_t* ctx, const mfat_file_t* f) {
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  mfat_cached_block_t* block = _mfat_read_block(ctx, f->info.dir_entry_block, MFAT_CACHE_DATA);
+  if (block != NULL) {
+    uint8_t* dir_entry = &block->buf[f->info.dir_entry_offset];
+    _mfat_set_word(&dir_entry[20], f->info.first_cluster >> 16);
+    _mfat_set_word(&dir_entry[26], f->info.first_cluster & 0xffffU);
+    _mfat_set_dword(&dir_entry[28], f->info.size);
+    dir_entry[11] |= MFAT_ATTR_ARCHIVE;
+    block->state = MFAT_DIRTY;
+#if MFAT_ENABLE_DENTRY_CACHE
+    _mfat_dentry_update(ctx, &f->info, dir_entry);
+#endif
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+
+  return block != NULL;
+}
+#endif  // MFAT_ENABLE_WRITE
+
+static int _mfat_open_impl(mfat_ctx_t* ctx, const char* path, int oflag) {
+#if MFAT_ENABLE_MMAP
+  // Memory mapped images are read only.
+  if (ctx->image != NULL && (oflag & (MFAT_O_WRONLY | MFAT_O_CREAT)) != 0) {
+    DBG("Can not write to a memory mapped image");
+    return -1;
+  }
+#endif
+
+  // Find the next free fd, and reserve it. The open flags are set when the file has been found
+  // (see below).
+  _mfat_lock(ctx, MFAT_LOCK_FD_TABLE);
+  int fd;
+  for (fd = 0; fd < MFAT_NUM_FDS; ++fd) {
+    if (!ctx->file[fd].open) {
+      ctx->file[fd].open = true;
+      ctx->file[fd].oflag = 0;
+      break;
+    }
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_FD_TABLE);
+  if (fd >= MFAT_NUM_FDS) {
+    DBG("No free FD:s left");
+    return -1;
+  }
+  mfat_file_t* f = &ctx->file[fd];
+
+  // Find the file in the file system structure. The data cache lock is held during the entire
+  // lookup (and creation), so that concurrent file creations can not pick the same directory slot.
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  int file_type;
+  mfat_bool_t exists;
+  mfat_bool_t create = (oflag & MFAT_O_CREAT) != 0;
+  mfat_bool_t ok = _mfat_find_file(
+      ctx, ctx->active_partition, path, create, &f->info, &file_type, &exists, NULL);
+  if (!ok) {
+    DBGF("File not found: %s", path);
+  }
+
+  // Check that we found the correct type.
+  if (ok && ((oflag & MFAT_O_DIRECTORY) != 0) && file_type != MFAT_FILE_TYPE_DIR &&
+      file_type != MFAT_FILE_TYPE_FAT16ROOTDIR) {
+    DBGF("Can not open the file as a directory: %s", path);
+    ok = false;
+  }
+
+  // Handle non-existing files (can only happen for regular files).
+  if (ok && !exists) {
+    mfat_bool_t created = false;
+#if MFAT_ENABLE_WRITE
+    // Should we create the file?
+    if (create) {
+      created = _mfat_create_file(ctx, &f->info, path);
+    }
+#endif
+    if (!created) {
+      DBGF("File does not exist: %s", path);
+      ok = false;
+    }
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+
+  _mfat_lock(ctx, MFAT_LOCK_FD_TABLE);
+  if (ok && f->info.dir_entry_block != 0U) {
+    // Each fd has its own copy of the file size and the cluster chain state, so a file must not be
+    // open by several fds if any of them can write to it.
+    for (int i = 0; i < MFAT_NUM_FDS; ++i) {
+      const mfat_file_t* other = &ctx->file[i];
+      if (other != f && other->open && other->oflag != 0 &&
+          other->info.part_no == f->info.part_no &&
+          other->info.dir_entry_block == f->info.dir_entry_block &&
+          other->info.dir_entry_offset == f->info.dir_entry_offset &&
+          ((other->oflag | oflag) & MFAT_O_WRONLY) != 0) {
+        DBGF("The file is already open by fd %d: %s", i, path);
+        ok = false;
+        break;
+      }
+    }
+  }
+
+  // Release the fd on failure.
+  if (!ok) {
+    f->open = false;
+    _mfat_unlock(ctx, MFAT_LOCK_FD_TABLE);
+    return -1;
+  }
+  f->oflag = oflag;
+  _mfat_unlock(ctx, MFAT_LOCK_FD_TABLE);
+
+  // Initialize the file state.
+  f->type = file_type;
+  f->current_cluster = f->info.first_cluster;
+  f->offset = 0U;
+#if MFAT_ENABLE_WRITE
+  f->last_cluster = 0U;
+#endif
+#if MFAT_ENABLE_EXTENTS
+  f->extents = NULL;
+  f->num_extents = 0U;
+  f->max_extents = 0U;
+  f->extents_complete = false;
+#endif
+#if MFAT_ENABLE_READAHEAD
+  f->ra_clusters = MFAT_READAHEAD_CLUSTERS;
+  f->ra_offset = 0U;
+#endif
+
+  DBGF("Opening file: first_cluster = %" PRIu32 " (block = %" PRIu32 "), size = %" PRIu32
+       " bytes, dir_blk = %" PRIu32
+       ", dir_offs "
+       "= %" PRIu32,
+       f->info.first_cluster,
+       _mfat_first_block_of_cluster(&ctx->partition[f->info.part_no], f->info.first_cluster),
+       f->info.size,
+       f->info.dir_entry_block,
+       f->info.dir_entry_offset);
+
+  return fd;
+}
+
+static int _mfat_close_impl(mfat_ctx_t* ctx, mfat_file_t* f) {
+#if MFAT_ENABLE_WRITE
+  // For good measure, we flush pending writes when a file is closed (only do this when closing
+  // files that are open with write permissions).
+  if ((f->oflag & MFAT_O_WRONLY) != 0) {
+    _mfat_sync_impl(ctx, false);
+  }
+#else
+  (void)ctx;
+#endif
+
+  // The file is no longer open. This makes the fd available for future open() requests.
+  _mfat_lock(ctx, MFAT_LOCK_FD_TABLE);
+  f->open = false;
+  _mfat_unlock(ctx, MFAT_LOCK_FD_TABLE);
+
+  return 0;
+}
+
+#if MFAT_ENABLE_WRITE
+// Update cached copies of blocks that were written directly to storage.
+static void _mfat_update_cached_blocks(mfat_ctx_t* ctx,
+                                       const uint8_t* buf,
+                                       uint32_t first_blk,
+                                       uint32_t num_blocks) {
+  for (uint32_t i = 0U; i < num_blocks; ++i) {
+    mfat_cached_block_t* block = _mfat_find_cached_block(ctx, first_blk + i, MFAT_CACHE_DATA);
+    if (block != NULL) {
+      memcpy(block->buf, &buf[i * MFAT_BLOCK_SIZE], MFAT_BLOCK_SIZE);
+      block->state = MFAT_VALID;
+    }
+  }
+}
+
+// Write the dirty cached blocks of a run of blocks to storage, so that a read of the run that
+// bypasses the data cache gets the latest data.
+static mfat_bool_t _mfat_write_back_dirty_blocks(mfat_ctx_t* ctx,
+                                                 uint32_t first_blk,
+                                                 uint32_t num_blocks) {
+  for (uint32_t i = 0U; i < num_blocks; ++i) {
+    mfat_cached_block_t* block = _mfat_find_cached_block(ctx, first_blk + i, MFAT_CACHE_DATA);
+    if (block != NULL && block->state == MFAT_DIRTY) {
+      if (!_mfat_write_blocks(ctx, block->buf, block->blk_no, 1U)) {
+        DBGF("Unable to write back block %" PRIu32, block->blk_no);
+        return false;
+      }
+      block->state = MFAT_VALID;
+    }
+  }
+  return true;
+}
+#endif  // MFAT_ENABLE_WRITE
+
+// Read a run of blocks directly from storage into a buffer (bypassing the data cache).
+static mfat_bool_t _mfat_read_blocks_direct(mfat_ctx_t* ctx,
+                                            uint8_t* buf,
+                                            uint32_t first_blk,
+                                            uint32_t num_blocks) {
+#if MFAT_ENABLE_WRITE
+  // The storage medium must be up to date before the read. Overlaying dirty cached blocks after the
+  // read is not enough, since another thread may flush and evict them in the meantime.
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  mfat_bool_t written = _mfat_write_back_dirty_blocks(ctx, first_blk, num_blocks);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+  if (!written) {
+    return false;
+  }
+#endif
+  return _mfat_read_blocks(ctx, buf, first_blk, num_blocks);
+}
+
+#if MFAT_ENABLE_AIO
+// Reap one completed asynchronous block read request. If wait is false, the function returns false
+// if no request has completed yet.
+static mfat_bool_t _mfat_aio_reap(mfat_ctx_t* ctx, mfat_bool_t wait) {
+  unsigned tag;
+  int status;
+  int result = ctx->poll(wait ? 1 : 0, &tag, &status, ctx->custom);
+  if (result <= 0) {
+    if (result < 0) {
+      DBG("Unable to poll for completed requests");
+    }
+    return false;
+  }
+  if (tag >= MFAT_AIO_QUEUE_DEPTH) {
+    DBGF("Invalid request tag: %u", tag);
+    return false;
+  }
+
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  mfat_aio_req_t* req = &ctx->aio_req[tag];
+  mfat_aio_t* aio = req->aio;
+  if (aio != NULL) {
+    if (status != 0) {
+      DBGF("Asynchronous read of block %" PRIu32 " failed", req->first_blk);
+      aio->result = -1;
+    }
+    --aio->pending;
+    req->aio = NULL;
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+
+  return true;
+}
+
+// Submit an asynchronous read of a run of blocks, as a part of an asynchronous operation. If all
+// the request slots are in use, we wait for a request to complete first.
+static mfat_bool_t _mfat_aio_submit(mfat_ctx_t* ctx,
+                                    mfat_aio_t* aio,
+                                    uint8_t* buf,
+                                    uint32_t first_blk,
+                                    uint32_t num_blocks) {
+#if MFAT_ENABLE_WRITE
+  // The storage medium must be up to date when the read is submitted. Overlaying dirty cached
+  // blocks at completion is not enough, since they may be evicted while the read is in flight.
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  mfat_bool_t written = _mfat_write_back_dirty_blocks(ctx, first_blk, num_blocks);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+  if (!written) {
+    return false;
+  }
+#endif
+
+  // Allocate a request slot.
+  mfat_aio_req_t* req = NULL;
+  unsigned tag = 0U;
+  while (req == NULL) {
+    _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+    for (tag = 0U; tag < MFAT_AIO_QUEUE_DEPTH; ++tag) {
+      if (ctx->aio_req[tag].aio == NULL) {
+        req = &ctx->aio_req[tag];
+        req->aio = aio;
+        req->buf = buf;
+        req->first_blk = first_blk;
+        req->num_blocks = num_blocks;
+        ++aio->pending;
+        break;
+      }
+    }
+    _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+    if (req == NULL && !_mfat_aio_reap(ctx, true)) {
+      return false;
+    }
+  }
+
+  DBGF("Submitting read of %" PRIu32 " block(s) starting at block %" PRIu32 " (tag %u)",
+       num_blocks,
+       first_blk,
+       tag);
+  if (ctx->submit_read((char*)buf, first_blk, num_blocks, tag, ctx->custom) != 0) {
+    DBG("Unable to submit read request");
+    _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+    req->aio = NULL;
+    --aio->pending;
+    _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+    return false;
+  }
+  return true;
+}
+
+// Abandon the pending requests of an asynchronous operation (e.g. after a polling error). The
+// request slots stay in use until the requests are reaped, but they no longer refer to the
+// operation state object, so the caller may reuse it.
+static void _mfat_aio_detach(mfat_ctx_t* ctx, mfat_aio_t* aio) {
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  for (unsigned tag = 0U; tag < MFAT_AIO_QUEUE_DEPTH; ++tag) {
+    mfat_aio_req_t* req = &ctx->aio_req[tag];
+    if (req->aio == aio) {
+      req->aio = &ctx->aio_detached;
+      ++ctx->aio_detached.pending;
+    }
+  }
+  aio->pending = 0U;
+  aio->result = -1;
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+}
+
+// Get the number of pending requests of an asynchronous operation.
+static uint32_t _mfat_aio_pending(mfat_ctx_t* ctx, const mfat_aio_t* aio) {
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  uint32_t pending = aio->pending;
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+  return pending;
+}
+#endif  // MFAT_ENABLE_AIO
+
+// Read file data, starting at the position of a cluster pos (offset is the corresponding byte
+// offset into the file, and at_file_offset tells if it is the current file offset). The request
+// must already be clamped to the size of the file. The cluster pos is advanced past the data that
+// was read, but the file state is not modified.
+//
+// If an asynchronous operation is given, the block aligned part of the request is submitted as
+// asynchronous reads (directly into the target buffer), and the function returns without waiting
+// for them to complete.
+static int64_t _mfat_read_at(mfat_ctx_t* ctx,
+                             const mfat_file_t* f,
+                             mfat_cluster_pos_t* cpos,
+                             uint32_t offset,
+                             mfat_bool_t at_file_offset,
+                             uint8_t* buf,
+                             uint32_t nbyte,
+                             mfat_aio_t* aio) {
+  const mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  uint32_t bytes_read = 0U;
+
+  // Align the head of the operation to a block boundary.
+  uint32_t block_offset = offset % MFAT_BLOCK_SIZE;
+  if (block_offset != 0U) {
+    // Use the block cache to get a partial block, and copy the data to the target buffer.
+    uint32_t tail_bytes_in_block = MFAT_BLOCK_SIZE - block_offset;
+    uint32_t bytes_to_copy = _mfat_min(tail_bytes_in_block, nbyte);
+    if (!_mfat_read_partial_block(
+            ctx, cpos, part, f, at_file_offset, buf, block_offset, bytes_to_copy)) {
+      DBG("Unable to read block");
+      return -1;
+    }
+    DBGF("read: Head read of %" PRIu32 " bytes", bytes_to_copy);
+
+    buf += bytes_to_copy;
+    bytes_read += bytes_to_copy;
+
+    // Move to the next block if we have read all the bytes of the block.
+    if (bytes_to_copy == tail_bytes_in_block) {
+      if (!_mfat_file_pos_advance(ctx, cpos, part, f)) {
+        return -1;
+      }
+    }
+  }
+
+  // Read aligned blocks directly into the target buffer. Physically contiguous runs of blocks (also
+  // across cluster boundaries) are read with a single request.
+  uint32_t blocks_left = (nbyte - bytes_read) / MFAT_BLOCK_SIZE;
+  while (blocks_left > 0U) {
+    if (_mfat_is_eoc(cpos->cluster_no)) {
+      DBG("Unexpected cluster access after EOC");
+      return -1;
+    }
+
+    // Find the length of the contiguous run, advancing the cluster pos past the run.
+    uint32_t first_blk = _mfat_cluster_pos_blk_no(cpos);
+    uint32_t num_blocks = 0U;
+    do {
+      ++num_blocks;
+      if (!_mfat_file_pos_advance(ctx, cpos, part, f)) {
+        return -1;
+      }
+    } while (num_blocks < blocks_left && !_mfat_is_eoc(cpos->cluster_no) &&
+             _mfat_cluster_pos_blk_no(cpos) == first_blk + num_blocks);
+
+    DBGF("read: Direct read of %" PRIu32 " bytes", num_blocks * MFAT_BLOCK_SIZE);
+#if MFAT_ENABLE_AIO
+    mfat_bool_t ok = (aio != NULL) ? _mfat_aio_submit(ctx, aio, buf, first_blk, num_blocks)
+                                   : _mfat_read_blocks_direct(ctx, buf, first_blk, num_blocks);
+#else
+    (void)aio;
+    mfat_bool_t ok = _mfat_read_blocks_direct(ctx, buf, first_blk, num_blocks);
+#endif
+    if (!ok) {
+      DBG("Unable to read blocks");
+      return -1;
+    }
+    buf += num_blocks * MFAT_BLOCK_SIZE;
+    bytes_read += num_blocks * MFAT_BLOCK_SIZE;
+    blocks_left -= num_blocks;
+  }
+
+  // Handle the tail of the operation (unaligned tail).
+  if (bytes_read < nbyte) {
+    if (_mfat_is_eoc(cpos->cluster_no)) {
+      DBG("Unexpected cluster access after EOC");
+      return -1;
+    }
+
+    // Use the block cache to get a partial block, and copy the data to the target buffer.
+    uint32_t bytes_to_copy = nbyte - bytes_read;
+    if (!_mfat_read_partial_block(ctx, cpos, part, f, at_file_offset, buf, 0U, bytes_to_copy)) {
+      DBG("Unable to read block");
+      return -1;
+    }
+    DBGF("read: Tail read of %" PRIu32 " bytes", bytes_to_copy);
+
+    bytes_read += bytes_to_copy;
+  }
+
+  return bytes_read;
+}
+
+static int64_t _mfat_readv_impl(mfat_ctx_t* ctx,
+                                mfat_file_t* f,
+                                const mfat_iovec_t* iov,
+                                int iovcnt) {
+  // Is the file open with read permissions?
+  if ((f->oflag & MFAT_O_RDONLY) == 0) {
+    return -1;
+  }
+  if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+    return -1;
+  }
+
+  // Start out at the current file offset. The same cluster pos is used for all the segments, so
+  // the cluster chain is only walked once.
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  mfat_cluster_pos_t cpos = _mfat_cluster_pos_init_from_file(part, f);
+  int64_t total_bytes_read = 0;
+  for (int i = 0; i < iovcnt; ++i) {
+    // Determine actual size of the operation (clamp to the size of the file).
+    uint32_t nbyte = iov[i].iov_len;
+    if (nbyte > (f->info.size - f->offset)) {
+      nbyte = f->info.size - f->offset;
+      DBGF("read: Clamped read request to %" PRIu32 " bytes", nbyte);
+    }
+
+    // Skip zero-sized requests (e.g. if we are at the EOF).
+    if (nbyte == 0U) {
+      continue;
+    }
+
+    int64_t bytes_read =
+        _mfat_read_at(ctx, f, &cpos, f->offset, true, (uint8_t*)iov[i].iov_base, nbyte, NULL);
+    if (bytes_read < 0) {
+      return (total_bytes_read > 0) ? total_bytes_read : -1;
+    }
+
+    // Update file state.
+    f->current_cluster = cpos.cluster_no;
+    f->offset += (uint32_t)bytes_read;
+#if MFAT_ENABLE_READAHEAD
+    f->ra_offset = f->offset;
+#endif
+    total_bytes_read += bytes_read;
+  }
+
+  return total_bytes_read;
+}
+
+static int64_t _mfat_read_impl(mfat_ctx_t* ctx, mfat_file_t* f, uint8_t* buf, uint32_t nbyte) {
+  mfat_iovec_t iov;
+  iov.iov_base = buf;
+  iov.iov_len = nbyte;
+  return _mfat_readv_impl(ctx, f, &iov, 1);
+}
+
+// Wait for all the pending requests of an asynchronous operation to complete.
+static int64_t _mfat_aio_wait_impl(mfat_ctx_t* ctx, mfat_aio_t* aio) {
+#if MFAT_ENABLE_AIO
+  while (_mfat_aio_pending(ctx, aio) > 0U) {
+    if (!_mfat_aio_reap(ctx, true)) {
+      _mfat_aio_detach(ctx, aio);
+      return -1;
+    }
+  }
+#else
+  (void)ctx;
+#endif
+  return aio->result;
+}
+
+static int _mfat_aio_poll_impl(mfat_ctx_t* ctx, mfat_aio_t* aio) {
+#if MFAT_ENABLE_AIO
+  // Reap all the requests that have completed so far (of any operation).
+  while (_mfat_aio_pending(ctx, aio) > 0U) {
+    if (!_mfat_aio_reap(ctx, false)) {
+      break;
+    }
+  }
+  return (_mfat_aio_pending(ctx, aio) > 0U) ? 1 : 0;
+#else
+  (void)ctx;
+  (void)aio;
+  return 0;
+#endif
+}
+
+static int _mfat_read_async_impl(mfat_ctx_t* ctx,
+                                 mfat_file_t* f,
+                                 uint8_t* buf,
+                                 uint32_t nbyte,
+                                 mfat_aio_t* aio) {
+  aio->pending = 0U;
+  aio->result = -1;
+
+  // Is the file open with read permissions?
+  if ((f->oflag & MFAT_O_RDONLY) == 0) {
+    return -1;
+  }
+
+  // Determine actual size of the operation (clamp to the size of the file).
+  if (nbyte > (f->info.size - f->offset)) {
+    nbyte = f->info.size - f->offset;
+    DBGF("read_async: Clamped read request to %" PRIu32 " bytes", nbyte);
+  }
+  aio->result = (int64_t)nbyte;
+  if (nbyte == 0U) {
+    return 0;
+  }
+
+  // Submit all the reads up front. Without asynchronous I/O functions, the data is read
+  // synchronously instead (and the operation is complete when we return).
+  mfat_aio_t* async_aio = NULL;
+#if MFAT_ENABLE_AIO
+  if (ctx->submit_read != NULL) {
+    async_aio = aio;
+  }
+#endif
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  mfat_cluster_pos_t cpos = _mfat_cluster_pos_init_from_file(part, f);
+  if (_mfat_read_at(ctx, f, &cpos, f->offset, true, buf, nbyte, async_aio) < 0) {
+    // Requests that were already submitted refer to the target buffer, so let them finish.
+    (void)_mfat_aio_wait_impl(ctx, aio);
+    aio->result = -1;
+    return -1;
+  }
+
+  // Update file state.
+  f->current_cluster = cpos.cluster_no;
+  f->offset += nbyte;
+#if MFAT_ENABLE_READAHEAD
+  f->ra_offset = f->offset;
+#endif
+
+  return 0;
+}
+
+static int _mfat_read_view_impl(mfat_ctx_t* ctx,
+                                mfat_file_t* f,
+                                uint32_t max_bytes,
+                                const void** ptr,
+                                uint32_t* len) {
+  // Is the file open with read permissions?
+  if ((f->oflag & MFAT_O_RDONLY) == 0) {
+    return -1;
+  }
+
+  // Determine the size of the view: We can lend out at most the rest of the current block (clamped
+  // to the size of the file).
+  uint32_t block_offset = f->offset % MFAT_BLOCK_SIZE;
+  uint32_t nbyte = _mfat_min(max_bytes, f->info.size - f->offset);
+  nbyte = _mfat_min(nbyte, MFAT_BLOCK_SIZE - block_offset);
+  *ptr = NULL;
+  *len = 0U;
+
+  // Early out if zero bytes were requested (e.g. if we are at the EOF).
+  if (nbyte == 0U) {
+    return 0;
+  }
+
+  // Get the current block via the block cache.
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  mfat_cluster_pos_t cpos = _mfat_cluster_pos_init_from_file(part, f);
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  mfat_cached_block_t* block = NULL;
+  const uint8_t* buf;
+#if MFAT_ENABLE_MMAP
+  if (ctx->image != NULL) {
+    buf = _mfat_view_block(ctx, _mfat_cluster_pos_blk_no(&cpos), MFAT_CACHE_DATA);
+  } else
+#endif
+  {
+    block = _mfat_read_file_block(ctx, &cpos, part, f);
+    buf = (block != NULL) ? block->buf : NULL;
+  }
+  if (buf == NULL) {
+    _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+    DBG("Unable to read block");
+    return -1;
+  }
+
+  // Move to the next block if the view covers the rest of the block.
+  if (nbyte == (MFAT_BLOCK_SIZE - block_offset)) {
+    if (!_mfat_file_pos_advance(ctx, &cpos, part, f)) {
+      _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+      return -1;
+    }
+  }
+
+  // Pin the block (it must not be evicted or moved until the view is released). Views into a
+  // memory mapped image stay valid anyway.
+  if (block != NULL) {
+    ++block->pins;
+    ++ctx->cache[MFAT_CACHE_DATA].num_pins;
+  }
+  *ptr = &buf[block_offset];
+  *len = nbyte;
+  DBGF("read_view: Lending %" PRIu32 " bytes at offset %" PRIu32, nbyte, f->offset);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+
+  // Update file state.
+  f->current_cluster = cpos.cluster_no;
+  f->offset += nbyte;
+#if MFAT_ENABLE_READAHEAD
+  f->ra_offset = f->offset;
+#endif
+
+  return 0;
+}
+
+static int _mfat_release_view_impl(mfat_ctx_t* ctx, const void* ptr) {
+  const uint8_t* p = (const uint8_t*)ptr;
+#if MFAT_ENABLE_MMAP
+  // Views into a memory mapped image are not pinned.
+  if (ctx->image != NULL) {
+    if (p < ctx->image || p >= ctx->image + (size_t)ctx->image_blocks * MFAT_BLOCK_SIZE) {
+      DBG("release_view: Not a read view pointer");
+      return -1;
+    }
+    return 0;
+  }
+#endif
+
+  // Find the cached block that owns the buffer that the pointer points into.
+  mfat_cache_t* cache = &ctx->cache[MFAT_CACHE_DATA];
+  const uint8_t* data_start = cache->data;
+  if (p < data_start || p >= data_start + (size_t)cache->num_blocks * MFAT_BLOCK_SIZE) {
+    DBG("release_view: Not a read view pointer");
+    return -1;
+  }
+  mfat_cached_block_t* block = &cache->block[cache->owner[(p - data_start) / MFAT_BLOCK_SIZE]];
+  if (block->pins <= 0) {
+    DBG("release_view: The block is not pinned");
+    return -1;
+  }
+
+  // Unpin the block.
+  --block->pins;
+  --cache->num_pins;
+
+  return 0;
+}
+
+// Find the cluster that holds the cluster index target_idx of a file. The search starts at a known
+// cluster of the file (*cluster, with the cluster index cluster_idx <= target_idx), and the extent
+// map of the file (if any) is used for skipping ahead. The file state is not modified.
+static mfat_bool_t _mfat_file_find_cluster(mfat_ctx_t* ctx,
+                                           const mfat_file_t* f,
+                                           const mfat_partition_t* part,
+                                           uint32_t cluster_idx,
+                                           uint32_t target_idx,
+                                           uint32_t* cluster) {
+  uint32_t current_cluster = *cluster;
+
+#if MFAT_ENABLE_EXTENTS
+  // Use the extent map (if any) to find the target cluster directly, or at least to get closer to
+  // it.
+  if (f->extents != NULL && f->num_extents > 0U) {
+    uint32_t extent_cluster;
+    if (_mfat_extent_lookup(f, target_idx, &extent_cluster)) {
+      current_cluster = extent_cluster;
+      cluster_idx = target_idx;
+    } else {
+      const mfat_extent_t* last = &f->extents[f->num_extents - 1U];
+      uint32_t last_cluster_idx = last->file_cluster + last->num_clusters - 1U;
+      if (last_cluster_idx > cluster_idx && last_cluster_idx <= target_idx) {
+        current_cluster = last->disk_cluster + last->num_clusters - 1U;
+        cluster_idx = last_cluster_idx;
+      }
+    }
+  }
+#else
+  (void)f;
+#endif
+
+  // Skip along clusters until we find the cluster with the requested index.
+  while (cluster_idx < target_idx) {
+    if (current_cluster == 0U || _mfat_is_eoc(current_cluster)) {
+      DBG("Unexpected cluster access after EOC");
+      return false;
+    }
+
+    // Look up the next cluster.
+    if (!_mfat_next_cluster(ctx, part, &current_cluster)) {
+      return false;
+    }
+    ++cluster_idx;
+  }
+
+  *cluster = current_cluster;
+  return true;
+}
+
+static int64_t _mfat_lseek_impl(mfat_ctx_t* ctx, mfat_file_t* f, int64_t offset, int whence) {
+  // Calculate the new requested file offset (the arithmetic is done in 64-bit precision in order to
+  // properly handle overflow).
+  int64_t target_offset_64;
+  switch (whence) {
+    case MFAT_SEEK_SET:
+      target_offset_64 = offset;
+      break;
+    case MFAT_SEEK_END:
+      target_offset_64 = ((int64_t)f->info.size) + offset;
+      break;
+    case MFAT_SEEK_CUR:
+      target_offset_64 = ((int64_t)f->offset) + offset;
+      break;
+    default:
+      DBGF("Invalid whence: %d", whence);
+      return -1;
+  }
+
+  // Sanity check the new offset.
+  if (target_offset_64 < 0) {
+    DBG("Seeking to a negative offset is not allowed");
+    return -1;
+  }
+  if (target_offset_64 > (int64_t)f->info.size) {
+    // TODO(m): POSIX lseek() allows seeking beyond the end of the file. We currently don't.
+    DBG("Seeking beyond the end of the file is not allowed");
+    return -1;
+  }
+
+  // This type conversion is safe, since we have verified that the value fits in a 32 bit unsigned
+  // value.
+  uint32_t target_offset = (uint32_t)target_offset_64;
+
+  // Get partition info.
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  uint32_t bytes_per_cluster = part->blocks_per_cluster * MFAT_BLOCK_SIZE;
+
+  // Define the starting point for the cluster search.
+  uint32_t current_cluster = f->current_cluster;
+  uint32_t cluster_idx = f->offset / bytes_per_cluster;
+  uint32_t target_cluster_idx = target_offset / bytes_per_cluster;
+  if (target_cluster_idx < cluster_idx) {
+    // For reverse seeking we need to start from the beginning of the file since FAT uses singly
+    // linked lists.
+    current_cluster = f->info.first_cluster;
+    cluster_idx = 0U;
+  }
+
+  // Find the cluster that contains the requested offset.
+  if (!_mfat_file_find_cluster(ctx, f, part, cluster_idx, target_cluster_idx, &current_cluster)) {
+    return -1;
+  }
+
+  // Update the current offset in the file descriptor.
+  f->offset = target_offset;
+  f->current_cluster = current_cluster;
+
+  return (int64_t)target_offset;
+}
+
+static int64_t _mfat_pread_impl(mfat_ctx_t* ctx,
+                                const mfat_file_t* f,
+                                uint8_t* buf,
+                                uint32_t nbyte,
+                                int64_t offset) {
+  // Is the file open with read permissions?
+  if ((f->oflag & MFAT_O_RDONLY) == 0) {
+    return -1;
+  }
+  if (offset < 0) {
+    DBG("pread: Negative offset");
+    return -1;
+  }
+
+  // Determine actual size of the operation (clamp to the size of the file).
+  if (offset >= (int64_t)f->info.size) {
+    return 0;
+  }
+  uint32_t pos = (uint32_t)offset;
+  if (nbyte > (f->info.size - pos)) {
+    nbyte = f->info.size - pos;
+    DBGF("pread: Clamped read request to %" PRIu32 " bytes", nbyte);
+  }
+  if (nbyte == 0U) {
+    return 0;
+  }
+
+  // Find the cluster that contains the requested offset (without touching the file offset).
+  const mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  uint32_t bytes_per_cluster = part->blocks_per_cluster * MFAT_BLOCK_SIZE;
+  uint32_t cluster = f->info.first_cluster;
+  if (!_mfat_file_find_cluster(ctx, f, part, 0U, pos / bytes_per_cluster, &cluster)) {
+    return -1;
+  }
+
+  mfat_cluster_pos_t cpos = _mfat_cluster_pos_init(part, cluster, pos);
+  return _mfat_read_at(ctx, f, &cpos, pos, false, buf, nbyte, NULL);
+}
+
+#if MFAT_ENABLE_WRITE
+// Get the last cluster of the cluster chain of a file.
+static mfat_bool_t _mfat_file_last_cluster(mfat_ctx_t* ctx,
+                                           mfat_file_t* f,
+                                           const mfat_partition_t* part,
+                                           uint32_t* cluster) {
+  if (f->last_cluster == 0U) {
+#if MFAT_ENABLE_EXTENTS
+    if (f->extents != NULL && f->extents_complete && f->num_extents > 0U) {
+      const mfat_extent_t* last = &f->extents[f->num_extents - 1U];
+      f->last_cluster = last->disk_cluster + last->num_clusters - 1U;
+    }
+#endif
+  }
+  if (f->last_cluster == 0U) {
+    // Walk the cluster chain (this is only done once per open file).
+    uint32_t this_cluster = f->info.first_cluster;
+    uint32_t next_cluster = this_cluster;
+    while (!_mfat_is_eoc(next_cluster)) {
+      this_cluster = next_cluster;
+      if (!_mfat_next_cluster(ctx, part, &next_cluster)) {
+        return false;
+      }
+    }
+    f->last_cluster = this_cluster;
+  }
+  *cluster = f->last_cluster;
+  return true;
+}
+
+// Update the file state after a cluster has been appended to its cluster chain.
+static void _mfat_file_add_cluster(mfat_file_t* f, uint32_t cluster) {
+  if (f->info.first_cluster == 0U) {
+    f->info.first_cluster = cluster;
+  }
+  f->last_cluster = cluster;
+#if MFAT_ENABLE_EXTENTS
+  _mfat_extent_append(f, cluster);
+#endif
+}
+
+// Append a new cluster to the cluster chain of a file.
+static mfat_bool_t _mfat_file_extend(mfat_ctx_t* ctx,
+                                     mfat_file_t* f,
+                                     mfat_partition_t* part,
+                                     uint32_t* cluster) {
+  uint32_t prev_cluster = 0U;
+  if (f->info.first_cluster != 0U && !_mfat_file_last_cluster(ctx, f, part, &prev_cluster)) {
+    return false;
+  }
+  _mfat_lock(ctx, MFAT_LOCK_FAT_CACHE);
+  mfat_bool_t ok = _mfat_alloc_cluster(ctx, part, prev_cluster, cluster);
+  _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+  if (!ok) {
+    return false;
+  }
+  _mfat_file_add_cluster(f, *cluster);
+  return true;
+}
+
+// Write file data, starting at the position of a cluster pos (offset is the corresponding byte
+// offset into the file, which must not be past the end of the file). The cluster chain of the file
+// is extended as needed, and the file size and the directory entry are updated. The file offset is
+// not modified. Returns the number of bytes that were written. On failure, *ok is set to false, and
+// the cluster pos can not be trusted.
+static uint32_t _mfat_write_at(mfat_ctx_t* ctx,
+                               mfat_file_t* f,
+                               mfat_cluster_pos_t* cpos,
+                               uint32_t offset,
+                               const uint8_t* buf,
+                               uint32_t nbyte,
+                               mfat_bool_t* ok_out) {
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  uint32_t first_cluster = f->info.first_cluster;
+  uint32_t bytes_written = 0U;
+  mfat_bool_t ok = true;
+  while (ok && bytes_written < nbyte) {
+    // Append a new cluster to the file if we are past the end of the cluster chain.
+    if (cpos->cluster_no == 0U || _mfat_is_eoc(cpos->cluster_no)) {
+      if (!_mfat_file_extend(ctx, f, part, &cpos->cluster_no)) {
+        ok = false;
+        break;
+      }
+      cpos->cluster_start_blk = _mfat_first_block_of_cluster(part, cpos->cluster_no);
+    }
+
+    uint32_t pos = offset + bytes_written;
+    uint32_t block_offset = pos % MFAT_BLOCK_SIZE;
+    uint32_t bytes_left = nbyte - bytes_written;
+    if (block_offset == 0U && bytes_left >= MFAT_BLOCK_SIZE) {
+      // Write aligned blocks directly from the source buffer. Physically contiguous runs of blocks
+      // are written with a single request.
+      uint32_t max_blocks = bytes_left / MFAT_BLOCK_SIZE;
+      uint32_t first_blk = _mfat_cluster_pos_blk_no(cpos);
+      uint32_t num_blocks = 0U;
+      do {
+        ++num_blocks;
+        if (!_mfat_file_pos_advance(ctx, cpos, part, f)) {
+          ok = false;
+          break;
+        }
+      } while (num_blocks < max_blocks && !_mfat_is_eoc(cpos->cluster_no) &&
+               _mfat_cluster_pos_blk_no(cpos) == first_blk + num_blocks);
+      if (!ok) {
+        break;
+      }
+
+      DBGF("write: Direct write of %" PRIu32 " bytes", num_blocks * MFAT_BLOCK_SIZE);
+      if (!_mfat_write_blocks(ctx, &buf[bytes_written], first_blk, num_blocks)) {
+        DBG("Unable to write blocks");
+        ok = false;
+        break;
+      }
+      _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+      _mfat_update_cached_blocks(ctx, &buf[bytes_written], first_blk, num_blocks);
+      _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+      bytes_written += num_blocks * MFAT_BLOCK_SIZE;
+    } else {
+      // Use the block cache for partial blocks (read-modify-write). Blocks that start at or after
+      // the end of the file do not need to be read from storage.
+      uint32_t blk_no = _mfat_cluster_pos_blk_no(cpos);
+      mfat_cached_block_t* block;
+      _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+      if (block_offset == 0U && pos >= f->info.size) {
+        block = _mfat_get_cached_block(ctx, blk_no, MFAT_CACHE_DATA);
+        if (block != NULL && block->state == MFAT_INVALID) {
+          memset(block->buf, 0, MFAT_BLOCK_SIZE);
+        }
+      } else {
+        block = _mfat_read_block(ctx, blk_no, MFAT_CACHE_DATA);
+      }
+      if (block == NULL) {
+        _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+        DBG("Unable to read block");
+        ok = false;
+        break;
+      }
+
+      uint32_t bytes_to_copy = _mfat_min(MFAT_BLOCK_SIZE - block_offset, bytes_left);
+      memcpy(&block->buf[block_offset], &buf[bytes_written], bytes_to_copy);
+      block->state = MFAT_DIRTY;
+      _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+      DBGF("write: Partial write of %" PRIu32 " bytes", bytes_to_copy);
+      bytes_written += bytes_to_copy;
+
+      // Move to the next block if we have written all the bytes of the block.
+      if ((block_offset + bytes_to_copy) == MFAT_BLOCK_SIZE) {
+        if (!_mfat_file_pos_advance(ctx, cpos, part, f)) {
+          ok = false;
+          break;
+        }
+      }
+    }
+  }
+
+  // Update the file size and the directory entry.
+  uint32_t end_offset = offset + bytes_written;
+  if (end_offset > f->info.size || f->info.first_cluster != first_cluster) {
+    f->info.size = _mfat_max(end_offset, f->info.size);
+    if (!_mfat_update_dir_entry(ctx, f)) {
+      ok = false;
+    }
+  }
+
+  *ok_out = ok;
+  return bytes_written;
+}
+
+static int64_t _mfat_writev_impl(mfat_ctx_t* ctx,
+                                 mfat_file_t* f,
+                                 const mfat_iovec_t* iov,
+                                 int iovcnt) {
+  // Is the file open with write permissions?
+  if ((f->oflag & MFAT_O_WRONLY) == 0) {
+    return -1;
+  }
+  if (iovcnt < 0 || (iovcnt > 0 && iov == NULL)) {
+    return -1;
+  }
+
+  // In append mode, the file offset is set to the end of the file before each write.
+  if ((f->oflag & MFAT_O_APPEND) != 0 && f->offset != f->info.size) {
+    if (_mfat_lseek_impl(ctx, f, 0, MFAT_SEEK_END) == -1) {
+      return -1;
+    }
+  }
+
+  // Start out at the current file offset. The same cluster pos is used for all the segments, so
+  // the cluster chain is only walked once.
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  mfat_cluster_pos_t cpos = _mfat_cluster_pos_init_from_file(part, f);
+  uint32_t bytes_written = 0U;
+  mfat_bool_t ok = true;
+  for (int i = 0; ok && i < iovcnt; ++i) {
+    // Clamp the write request to the maximum file size (4 GiB - 1).
+    uint32_t offset = f->offset + bytes_written;
+    uint32_t nbyte = iov[i].iov_len;
+    if (nbyte > (0xffffffffU - offset)) {
+      nbyte = 0xffffffffU - offset;
+      DBGF("write: Clamped write request to %" PRIu32 " bytes", nbyte);
+    }
+    if (nbyte == 0U) {
+      continue;
+    }
+
+    bytes_written +=
+        _mfat_write_at(ctx, f, &cpos, offset, (const uint8_t*)iov[i].iov_base, nbyte, &ok);
+  }
+  if (ok && bytes_written == 0U) {
+    return 0;
+  }
+  uint32_t end_offset = f->offset + bytes_written;
+
+  // Update the file offset. On failure, the cluster pos can not be trusted, so we seek from the
+  // start of the file instead.
+  if (ok) {
+    f->current_cluster = cpos.cluster_no;
+    f->offset = end_offset;
+  } else {
+    f->current_cluster = f->info.first_cluster;
+    f->offset = 0U;
+    if (_mfat_lseek_impl(ctx, f, (int64_t)end_offset, MFAT_SEEK_SET) == -1 || bytes_written == 0U) {
+      return -1;
+    }
+  }
+
+  return bytes_written;
+}
+
+static int64_t _mfat_write_impl(mfat_ctx_t* ctx,
+                                mfat_file_t* f,
+                                const uint8_t* buf,
+                                uint32_t nbyte) {
+  mfat_iovec_t iov;
+  iov.iov_base = (void*)buf;
+  iov.iov_len = nbyte;
+  return _mfat_writev_impl(ctx, f, &iov, 1);
+}
+
+static int64_t _mfat_pwrite_impl(mfat_ctx_t* ctx,
+                                 mfat_file_t* f,
+                                 const uint8_t* buf,
+                                 uint32_t nbyte,
+                                 int64_t offset) {
+  // Is the file open with write permissions?
+  if ((f->oflag & MFAT_O_WRONLY) == 0) {
+    return -1;
+  }
+
+  if (offset < 0 || offset > (int64_t)f->info.size) {
+    DBG("pwrite: The offset must be within the file");
+    return -1;
+  }
+  uint32_t pos = (uint32_t)offset;
+
+  // Clamp the write request to the maximum file size (4 GiB - 1).
+  if (nbyte > (0xffffffffU - pos)) {
+    nbyte = 0xffffffffU - pos;
+    DBGF("pwrite: Clamped write request to %" PRIu32 " bytes", nbyte);
+  }
+  if (nbyte == 0U) {
+    return 0;
+  }
+
+  // Find the cluster that contains the requested offset (without touching the file offset).
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  uint32_t bytes_per_cluster = part->blocks_per_cluster * MFAT_BLOCK_SIZE;
+  uint32_t cluster = f->info.first_cluster;
+  if (!_mfat_file_find_cluster(ctx, f, part, 0U, pos / bytes_per_cluster, &cluster)) {
+    return -1;
+  }
+
+  mfat_cluster_pos_t cpos = _mfat_cluster_pos_init(part, cluster, pos);
+  mfat_bool_t ok;
+  uint32_t bytes_written = _mfat_write_at(ctx, f, &cpos, pos, buf, nbyte, &ok);
+
+  // If the file offset was past the end of the old cluster chain, it may now refer to one of the
+  // appended clusters.
+  if (f->current_cluster == 0U || _mfat_is_eoc(f->current_cluster)) {
+    cluster = f->info.first_cluster;
+    if (_mfat_file_find_cluster(ctx, f, part, 0U, f->offset / bytes_per_cluster, &cluster)) {
+      f->current_cluster = cluster;
+    }
+  }
+
+  if (!ok && bytes_written == 0U) {
+    return -1;
+  }
+  return bytes_written;
+}
+
+static int _mfat_fallocate_impl(mfat_ctx_t* ctx, mfat_file_t* f, uint32_t length) {
+  // Is the file open with write permissions?
+  if ((f->oflag & MFAT_O_WRONLY) == 0) {
+    return -1;
+  }
+
+  // How many clusters are needed, and how many clusters does the file already have?
+  mfat_partition_t* part = &ctx->partition[f->info.part_no];
+  uint32_t bytes_per_cluster = part->blocks_per_cluster * MFAT_BLOCK_SIZE;
+  uint32_t num_wanted = length / bytes_per_cluster + ((length % bytes_per_cluster) != 0U ? 1U : 0U);
+  uint32_t num_clusters = 0U;
+  uint32_t last_cluster = 0U;
+  uint32_t cluster = f->info.first_cluster;
+  while (cluster != 0U && !_mfat_is_eoc(cluster) && num_clusters < num_wanted) {
+    last_cluster = cluster;
+    ++num_clusters;
+    if (!_mfat_next_cluster(ctx, part, &cluster)) {
+      return -1;
+    }
+  }
+  if (num_clusters >= num_wanted) {
+    return 0;
+  }
+  f->last_cluster = last_cluster;
+
+  // Fail early if we know that there is not enough free space.
+  _mfat_lock(ctx, MFAT_LOCK_FAT_CACHE);
+  uint32_t num_missing = num_wanted - num_clusters;
+  if (part->free_count != 0xffffffffU && part->free_count < num_missing) {
+    _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+    DBGF("Not enough free clusters (need %" PRIu32 ")", num_missing);
+    return -1;
+  }
+
+  // Allocate the missing clusters, as few runs of contiguous clusters as possible: First extend the
+  // last cluster of the file with physically adjacent free clusters, then use the best fitting free
+  // run. If that run is too short, the free space is fragmented, and the rest of the clusters are
+  // taken in cluster order after that run. This way the FAT is scanned at most twice.
+  uint32_t first_new_cluster = 0U;
+  mfat_bool_t found_best_run = false;
+  mfat_bool_t ok = true;
+  while (ok && num_clusters < num_wanted) {
+    uint32_t run_start = last_cluster + 1U;
+    uint32_t run_len = 0U;
+    mfat_bool_t is_free;
+    mfat_bool_t found = true;
+    if (last_cluster != 0U && _mfat_is_cluster_free(ctx, part, run_start, &is_free) && is_free) {
+      run_len = num_wanted - num_clusters;
+    } else if (!found_best_run) {
+      ok = _mfat_find_free_run(ctx, part, num_wanted - num_clusters, &run_start, &run_len);
+      found = run_len > 0U;
+      found_best_run = true;
+    } else {
+      ok = _mfat_find_free_cluster(ctx, part, run_start, &run_start, &found);
+      run_len = num_wanted - num_clusters;
+    }
+    if (!ok || !found) {
+      DBG("No free clusters left");
+      ok = false;
+      break;
+    }
+
+    // Claim the clusters of the run (an "adjacent" run ends at the first non-free cluster).
+    for (uint32_t i = 0U; i < run_len && num_clusters < num_wanted; ++i) {
+      cluster = run_start + i;
+      if (i > 0U && (!_mfat_is_cluster_free(ctx, part, cluster, &is_free) || !is_free)) {
+        break;
+      }
+      if (!_mfat_claim_cluster(ctx, part, cluster, last_cluster)) {
+        ok = false;
+        break;
+      }
+      _mfat_file_add_cluster(f, cluster);
+      if (first_new_cluster == 0U) {
+        first_new_cluster = cluster;
+      }
+      last_cluster = cluster;
+      ++num_clusters;
+    }
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+
+  // If the file offset was past the end of the old cluster chain, it now refers to the first
+  // allocated cluster.
+  if (first_new_cluster != 0U &&
+      (f->current_cluster == 0U || _mfat_is_eoc(f->current_cluster))) {
+    f->current_cluster = first_new_cluster;
+  }
+
+  // The file may have got its first cluster.
+  if (!_mfat_update_dir_entry(ctx, f)) {
+    ok = false;
+  }
+
+  return ok ? 0 : -1;
+}
+#endif  // MFAT_ENABLE_WRITE
+
+#if MFAT_ENABLE_OPENDIR
+// Initialize a directory stream object, positioned at the first entry of the directory.
+static void _mfat_dir_init(mfat_ctx_t* ctx,
+                           mfat_dir_t* dirp,
+                           int type,
+                           uint32_t part_no,
+                           uint32_t first_cluster) {
+  mfat_partition_t* part = &ctx->partition[part_no];
+  dirp->type = type;
+  dirp->part_no = part_no;
+  if (type == MFAT_FILE_TYPE_FAT16ROOTDIR) {
+    // We use a fake/tweaked cluster pos for FAT16 root directories.
+    dirp->cpos.cluster_no = 0U;
+    dirp->cpos.cluster_idx = 0U;
+    dirp->cpos.cluster_start_blk = part->root_dir_block;
+    dirp->cpos.block_in_cluster = 0U;
+    dirp->blocks_left = part->blocks_in_root_dir;
+  } else {
+    // We use an "infinite" block count for regular cluster chain dirs.
+    dirp->cpos = _mfat_cluster_pos_init(part, first_cluster, 0);
+    dirp->blocks_left = 0xffffffffU;
+  }
+  dirp->block_offset = 0U;
+#if MFAT_ENABLE_LFN
+  dirp->lfn_seq = 0U;
+#endif
+}
+
+static mfat_dir_t* _mfat_opendir_impl(mfat_ctx_t* ctx, int fd) {
+  mfat_file_t* file = _mfat_fd_to_file(ctx, fd);
+  if (file == NULL ||
+      (file->type != MFAT_FILE_TYPE_DIR && file->type != MFAT_FILE_TYPE_FAT16ROOTDIR)) {
+    DBG("The dir fd is not an open dir");
+    return NULL;
+  }
+
+  // Find the next free dir object, and reserve it.
+  _mfat_lock(ctx, MFAT_LOCK_FD_TABLE);
+  int dir_id;
+  for (dir_id = 0; dir_id < MFAT_NUM_DIRS; ++dir_id) {
+    if (!ctx->dir[dir_id].open) {
+      ctx->dir[dir_id].open = true;
+      break;
+    }
+  }
+  _mfat_unlock(ctx, MFAT_LOCK_FD_TABLE);
+  if (dir_id >= MFAT_NUM_DIRS) {
+    DBG("No free dir:s left");
+    return NULL;
+  }
+
+  // Initialize the directory stream object (the stream owns the fd from now on).
+  mfat_dir_t* dirp = &ctx->dir[dir_id];
+  dirp->fd = fd;
+  _mfat_dir_init(ctx, dirp, file->type, file->info.part_no, file->info.first_cluster);
+
+  return dirp;
+}
+
+// Open a directory stream in caller-provided memory. The directory is looked up directly (no fd
+// is used), so the number of such streams is only limited by the memory of the caller.
+static mfat_dir_t* _mfat_opendir_into_impl(mfat_ctx_t* ctx,
+                                           mfat_dir_storage_t* storage,
+                                           const char* path) {
+  // Find the directory in the file system structure.
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  mfat_file_info_t info;
+  int file_type;
+  mfat_bool_t exists;
+  mfat_bool_t ok = _mfat_find_file(
+      ctx, ctx->active_partition, path, false, &info, &file_type, &exists, NULL);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+  if (!ok || !exists) {
+    DBGF("Directory not found: %s", path);
+    return NULL;
+  }
+  if (file_type != MFAT_FILE_TYPE_DIR && file_type != MFAT_FILE_TYPE_FAT16ROOTDIR) {
+    DBGF("Not a directory: %s", path);
+    return NULL;
+  }
+
+  // Initialize the directory stream object.
+  mfat_dir_t* dirp = (mfat_dir_t*)storage;
+  dirp->open = true;
+  dirp->fd = -1;
+  _mfat_dir_init(ctx, dirp, file_type, info.part_no, info.first_cluster);
+
+  return dirp;
+}
+
+int _mfat_closedir_impl(mfat_ctx_t* ctx, mfat_dir_t* dirp) {
+  if (dirp == NULL) {
+    return -1;
+  }
+  if (!dirp->open) {
+    DBG("The dir is already closed");
+    return -1;
+  }
+
+  // Close the file (caller-allocated streams have no file).
+  int result = 0;
+  if (dirp->fd >= 0) {
+    mfat_file_t* file = _mfat_fd_to_file(ctx, dirp->fd);
+    result = (file != NULL) ? _mfat_close_impl(ctx, file) : -1;
+  }
+
+  // The dir is no longer open. This makes the dir object available for future opendir() requests.
+  _mfat_lock(ctx, MFAT_LOCK_FD_TABLE);
+  dirp->open = false;
+  _mfat_unlock(ctx, MFAT_LOCK_FD_TABLE);
+
+  return result;
+}
+#endif
+
+#if MFAT_ENABLE_OPENDIR
+#if MFAT_ENABLE_READAHEAD
+// Prefetch the directory blocks that follow the current position of a directory stream into the
+// data cache: The rest of the current cluster plus any physically contiguous clusters that follow
+// (limited by the cache size), read with a single request.
+static void _mfat_dir_readahead(mfat_ctx_t* ctx, const mfat_dir_t* dirp) {
+  // Just like for file read-ahead, we use at most half of the data cache.
+  uint32_t max_blocks = (uint32_t)ctx->cache[MFAT_CACHE_DATA].num_blocks / 2U;
+#if MFAT_ENABLE_MMAP
+  if (ctx->image != NULL) {
+    return;
+  }
+#endif
+  // Unlike file read-ahead, directory read-ahead is always active, so we only do it when the blocks
+  // can be read with a single request (otherwise we could end up reading unused blocks).
+  uint32_t first_blk = _mfat_cluster_pos_blk_no(&dirp->cpos);
+  if (ctx->read_blocks == NULL || max_blocks < 2U || ctx->cache[MFAT_CACHE_DATA].num_pins > 0 ||
+      _mfat_is_block_cached(ctx, first_blk, MFAT_CACHE_DATA)) {
+    return;
+  }
+
+  // Determine the length of the contiguous run.
+  uint32_t num_blocks;
+  if (dirp->type == MFAT_FILE_TYPE_FAT16ROOTDIR) {
+    num_blocks = _mfat_min(dirp->blocks_left, max_blocks);
+  } else {
+    mfat_partition_t* part = &ctx->partition[dirp->part_no];
+    mfat_cluster_pos_t pos = dirp->cpos;
+    num_blocks = part->blocks_per_cluster - pos.block_in_cluster;
+    while (num_blocks < max_blocks) {
+      pos.block_in_cluster = part->blocks_per_cluster - 1U;
+      if (!_mfat_cluster_pos_advance(ctx, &pos, part) || _mfat_is_eoc(pos.cluster_no) ||
+          _mfat_cluster_pos_blk_no(&pos) != first_blk + num_blocks) {
+        break;
+      }
+      num_blocks += part->blocks_per_cluster;
+    }
+    num_blocks = _mfat_min(num_blocks, max_blocks);
+  }
+
+  // Read-ahead is only a hint, so errors are not fatal (the blocks are read on demand instead).
+  if (num_blocks >= 2U && !_mfat_prefetch_blocks(ctx, first_blk, num_blocks)) {
+    DBG("Directory read-ahead failed");
+  }
+}
+#endif  // MFAT_ENABLE_READAHEAD
+
+// Read up to max_count entries from a directory stream. All the entries of a directory block are
+// decoded in a single pass. Returns the number of entries (zero at the end of the directory), or -1
+// if an error occurred before any entry could be read.
+static int _mfat_read_dirents(mfat_ctx_t* ctx,
+                              mfat_dir_t* dirp,
+                              mfat_dirent_t* dirents,
+                              int max_count) {
+  // Look up the next file names in the directory (blocks_left is zero when we have reached the
+  // end).
+  int count = 0;
+  while (count < max_count && dirp->blocks_left > 0U) {
+    // Do we need to advance to the next block in the directory?
+    if (dirp->block_offset >= MFAT_BLOCK_SIZE) {
+      if (dirp->type == MFAT_FILE_TYPE_FAT16ROOTDIR) {
+        dirp->cpos.block_in_cluster += 1;  // FAT16 style linear block access.
+      } else {
+        mfat_partition_t* part = &ctx->partition[dirp->part_no];
+        if (!_mfat_cluster_pos_advance(ctx, &dirp->cpos, part)) {
+          DBG("readdir: Unable to advance to next cluster.");
+          return count > 0 ? count : -1;
+        }
+      }
+      dirp->block_offset = 0U;
+      if (--dirp->blocks_left == 0U || _mfat_is_eoc(dirp->cpos.cluster_no)) {
+        dirp->blocks_left = 0U;
+        break;
+      }
+    }
+
+#if MFAT_ENABLE_READAHEAD
+    // Read the following directory blocks with a single request.
+    if (dirp->block_offset == 0U) {
+      _mfat_dir_readahead(ctx, dirp);
+    }
+#endif
+
+    // Load the directory table block.
+    uint32_t blk_no = _mfat_cluster_pos_blk_no(&dirp->cpos);
+    const uint8_t* buf = _mfat_view_block(ctx, blk_no, MFAT_CACHE_DATA);
+    if (buf == NULL) {
+      DBGF("Unable to load directory block %" PRIu32, blk_no);
+      return count > 0 ? count : -1;
+    }
+
+    // Decode the remaining file/dir entries of this directory block.
+    uint32_t entry_no = dirp->block_offset / 32U;
+    mfat_dir_scan_t scan;
+    _mfat_scan_dir_block(buf, NULL, &scan);
+    uint32_t files = scan.files & ~((1U << entry_no) - 1U);
+    for (; files != 0U && count < max_count; files &= files - 1U) {
+      uint32_t file_no = _mfat_ctz(files);
+#if MFAT_ENABLE_LFN
+      // Collect the long file name entries that precede the file/dir entry.
+      for (uint32_t k = entry_no; k < file_no; ++k) {
+        if ((scan.lfn & (1U << k)) != 0U) {
+          _mfat_lfn_collect_entry(dirp, &buf[k * 32U]);
+        } else {
+          dirp->lfn_seq = 0U;
+        }
+      }
+#endif
+      const uint8_t* entry = &buf[file_no * 32U];
+      mfat_dirent_t* dirent = &dirents[count++];
+#if MFAT_ENABLE_LFN
+      if (!_mfat_lfn_finish(dirp, entry, dirent->d_name))
+#endif
+      {
+        _mfat_make_printable_fname(entry, dirent->d_name);
+      }
+
+      // Decode the rest of the directory entry too (this saves a stat() per entry for the caller).
+      _mfat_dir_entry_to_stat(entry, &dirent->d_stat);
+      dirent->d_attr = entry[11];
+      dirent->d_first_cluster = _mfat_dir_entry_cluster(entry);
+      dirent->d_dir_entry_block = blk_no;
+      dirent->d_dir_entry_offset = file_no * 32U;
+      entry_no = file_no + 1U;
+    }
+    if (files != 0U) {
+      // The array is full: Continue after the last returned entry next time.
+      dirp->block_offset = entry_no * 32U;
+      break;
+    }
+#if MFAT_ENABLE_LFN
+    // Collect the long file name entries at the end of the block.
+    for (uint32_t k = entry_no; k < scan.end; ++k) {
+      if ((scan.lfn & (1U << k)) != 0U) {
+        _mfat_lfn_collect_entry(dirp, &buf[k * 32U]);
+      } else {
+        dirp->lfn_seq = 0U;
+      }
+    }
+#endif
+
+    // Last entry in the directory structure?
+    if (scan.end < MFAT_DIR_ENTRIES_PER_BLOCK) {
+      dirp->blocks_left = 0U;
+      break;
+    }
+    dirp->block_offset = MFAT_BLOCK_SIZE;
+  }
+
+  return count;
+}
+
+mfat_dirent_t* _mfat_readdir_impl(mfat_ctx_t* ctx, mfat_dir_t* dirp) {
+  return _mfat_read_dirents(ctx, dirp, &dirp->dirent, 1) == 1 ? &dirp->dirent : NULL;
+}
+#endif
+
+//--------------------------------------------------------------------------------------------------
+// Public API functions.
+//--------------------------------------------------------------------------------------------------
+
+int mfat_mount(mfat_read_block_fun_t read_fun, mfat_write_block_fun_t write_fun, void* custom) {
+  mfat_mount_opts_t opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.read = read_fun;
+  opts.write = write_fun;
+  opts.custom = custom;
+  return mfat_mount_ex(&opts);
+}
 
-  // The file is no longer open. This makes the fd available for future open() requests.
-  f->open = false;
+unsigned mfat_num_locks(void) {
+  return MFAT_LOCK_FILE(MFAT_NUM_FDS);
+}
 
-  return 0;
+size_t mfat_ctx_size(void) {
+  return sizeof(mfat_ctx_t);
 }
 
-static int64_t _mfat_read_impl(mfat_file_t* f, uint8_t* buf, uint32_t nbyte) {
-  // Is the file open with read permissions?
-  if ((f->oflag & MFAT_O_RDONLY) == 0) {
-    return -1;
+size_t mfat_cache_mem_size(uint32_t num_blocks) {
+  if (num_blocks == 0U || num_blocks > MFAT_MAX_CACHED_BLOCKS) {
+    return 0U;
   }
+  return MFAT_CACHE_MEM_SIZE(num_blocks);
+}
 
-  // Determine actual size of the operation (clamp to the size of the file).
-  if (nbyte > (f->info.size - f->offset)) {
-    nbyte = f->info.size - f->offset;
-    DBGF("read: Clamped read request to %" PRIu32 " bytes", nbyte);
+int mfat_mount_ctx(mfat_ctx_t* ctx, const mfat_mount_opts_t* opts) {
+  if (opts == NULL) {
+    return -1;
   }
-
-  // Early out if only zero bytes were requested (e.g. if we are at the EOF).
-  if (nbyte == 0U) {
-    return 0;
+#if MFAT_ENABLE_MMAP
+  // The I/O functions are not used for memory mapped images.
+  mfat_bool_t has_image = (opts->image != NULL);
+#else
+  mfat_bool_t has_image = false;
+#endif
+#if MFAT_ENABLE_WRITE
+  if (!has_image && (opts->read == NULL || opts->write == NULL)) {
+#else
+  if (!has_image && opts->read == NULL) {
+#endif
+    DBG("Bad function pointers");
+    return -1;
+  }
+  if ((opts->lock == NULL) != (opts->unlock == NULL)) {
+    DBG("Both or neither of the lock/unlock functions must be provided");
+    return -1;
+  }
+  if ((opts->submit_read == NULL) != (opts->poll == NULL)) {
+    DBG("Both or neither of the submit/poll functions must be provided");
+    return -1;
   }
 
-  // Start out at the current file offset.
-  mfat_partition_t* part = &s_ctx.partition[f->info.part_no];
-  mfat_cluster_pos_t cpos = _mfat_cluster_pos_init_from_file(part, f);
-  uint32_t bytes_read = 0U;
+  // Clear the context state.
+  memset(ctx, 0, sizeof(mfat_ctx_t));
+  ctx->read = opts->read;
+  ctx->read_blocks = opts->read_blocks;
+#if MFAT_ENABLE_WRITE
+  ctx->write = opts->write;
+  ctx->write_blocks = opts->write_blocks;
+#endif
+#if MFAT_ENABLE_THREADS
+  ctx->lock = opts->lock;
+  ctx->unlock = opts->unlock;
+#endif
+#if MFAT_ENABLE_AIO
+  // Reads from a memory mapped image are always synchronous.
+  if (!has_image) {
+    ctx->submit_read = opts->submit_read;
+    ctx->poll = opts->poll;
+  }
+#endif
+#if MFAT_ENABLE_DENTRY_CACHE
+  ctx->dentries = opts->dentry_cache;
+  ctx->num_dentries = (opts->dentry_cache != NULL) ? opts->dentry_cache_size : 0U;
+  if (ctx->dentries != NULL) {
+    memset(ctx->dentries, 0, ctx->num_dentries * sizeof(mfat_dentry_t));
+  }
+#endif
+#if MFAT_ENABLE_DIR_INDEX
+  ctx->dir_index_mem = opts->dir_index_mem;
+  ctx->dir_index_words = (opts->dir_index_mem != NULL) ? opts->dir_index_words : 0U;
+#endif
+#if MFAT_ENABLE_MMAP
+  ctx->image = (const uint8_t*)opts->image;
+  ctx->image_blocks = opts->image_blocks;
+#endif
+  ctx->custom = opts->custom;
+  ctx->active_partition = -1;
 
-  // Align the head of the operation to a block boundary.
-  uint32_t block_offset = f->offset % MFAT_BLOCK_SIZE;
-  if (block_offset != 0U) {
-    // Use the block cache to get a partial block.
-    mfat_cached_block_t* block = _mfat_read_block(_mfat_cluster_pos_blk_no(&cpos), MFAT_CACHE_DATA);
-    if (block == NULL) {
-      DBG("Unable to read block");
+  // Set up the block caches (in caller-provided memory, or in the built-in cache memory).
+  for (int j = 0; j < MFAT_NUM_CACHES; ++j) {
+    void* mem = (j == MFAT_CACHE_DATA) ? opts->data_cache_mem : opts->fat_cache_mem;
+    uint32_t num_blocks = (j == MFAT_CACHE_DATA) ? opts->data_cache_blocks : opts->fat_cache_blocks;
+    if (mem == NULL) {
+#if MFAT_NUM_CACHED_BLOCKS > 0
+      mem = &ctx->cache_mem[j];
+      num_blocks = MFAT_NUM_CACHED_BLOCKS;
+#else
+      DBGF("Cache %d: No cache memory", j);
+      return -1;
+#endif
+    } else if (num_blocks == 0U || num_blocks > MFAT_MAX_CACHED_BLOCKS) {
+      DBGF("Cache %d: Bad number of cached blocks: %" PRIu32, j, num_blocks);
       return -1;
     }
+    _mfat_cache_init(&ctx->cache[j], mem, (int)num_blocks);
+  }
 
-    // Copy the data from the cache to the target buffer.
-    uint32_t tail_bytes_in_block = MFAT_BLOCK_SIZE - block_offset;
-    uint32_t bytes_to_copy = _mfat_min(tail_bytes_in_block, nbyte);
-    memcpy(buf, &block->buf[block_offset], bytes_to_copy);
-    DBGF("read: Head read of %" PRIu32 " bytes", bytes_to_copy);
-
-    buf += bytes_to_copy;
-    bytes_read += bytes_to_copy;
+  // Read the partition tables.
+  if (!_mfat_decode_partition_tables(ctx)) {
+    return -1;
+  }
 
-    // Move to the next block if we have read all the bytes of the block.
-    if (bytes_to_copy == tail_bytes_in_block) {
-      if (!_mfat_cluster_pos_advance(&cpos, part)) {
+#if MFAT_ENABLE_WRITE
+  // Build the free cluster bitmaps (if we have memory for them). The bitmap buffer is split between
+  // the partitions, in partition order. Memory mapped images are read only, so they never need one.
+  if (opts->free_bitmap != NULL && !has_image) {
+    uint32_t* bitmap = opts->free_bitmap;
+    uint32_t words_left = opts->free_bitmap_words;
+    for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
+      mfat_partition_t* part = &ctx->partition[i];
+      if (part->type == MFAT_PART_TYPE_UNKNOWN) {
+        continue;
+      }
+      uint32_t num_words = _mfat_free_bitmap_words(part);
+      if (num_words > words_left) {
+        DBGF("Not enough memory for the free cluster bitmap of partition %d", i);
+        continue;
+      }
+      if (!_mfat_build_free_bitmap(ctx, part, bitmap)) {
         return -1;
       }
+      bitmap += num_words;
+      words_left -= num_words;
     }
   }
+#endif
 
-  // Read aligned blocks directly into the target buffer.
-  while ((nbyte - bytes_read) >= MFAT_BLOCK_SIZE) {
-    if (_mfat_is_eoc(cpos.cluster_no)) {
-      DBG("Unexpected cluster access after EOC");
-      return -1;
-    }
-
-    DBGF("read: Direct read of %d bytes", MFAT_BLOCK_SIZE);
-    if (s_ctx.read((char*)buf, _mfat_cluster_pos_blk_no(&cpos), s_ctx.custom) == -1) {
-      DBG("Unable to read block");
-      return -1;
-    }
-    buf += MFAT_BLOCK_SIZE;
-    bytes_read += MFAT_BLOCK_SIZE;
-
-    // Move to the next block.
-    if (!_mfat_cluster_pos_advance(&cpos, part)) {
-      return -1;
+  // Find the first bootable partition. If no bootable partition is found, pick the first supported
+  // partition.
+  int first_boot_partition = -1;
+  for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
+    if (ctx->partition[i].type != MFAT_PART_TYPE_UNKNOWN) {
+      if (ctx->partition[i].boot && first_boot_partition < 0) {
+        first_boot_partition = i;
+        ctx->active_partition = i;
+      } else if (ctx->active_partition < 0) {
+        ctx->active_partition = i;
+      }
     }
   }
+  if (ctx->active_partition < 0) {
+    return -1;
+  }
+  DBGF("Selected partition %d", ctx->active_partition);
 
-  // Handle the tail of the operation (unaligned tail).
-  if (bytes_read < nbyte) {
-    if (_mfat_is_eoc(cpos.cluster_no)) {
-      DBG("Unexpected cluster access after EOC");
-      return -1;
-    }
+  // MFAT is now initizlied.
+  DBG("Successfully initialized");
+  ctx->initialized = true;
 
-    // Use the block cache to get a partial block.
-    mfat_cached_block_t* block = _mfat_read_block(_mfat_cluster_pos_blk_no(&cpos), MFAT_CACHE_DATA);
-    if (block == NULL) {
-      DBG("Unable to read block");
-      return -1;
-    }
+  return 0;
+}
 
-    // Copy the data from the cache to the target buffer.
-    uint32_t bytes_to_copy = nbyte - bytes_read;
-    memcpy(buf, &block->buf[0], bytes_to_copy);
-    DBGF("read: Tail read of %" PRIu32 " bytes", bytes_to_copy);
+void mfat_unmount_ctx(mfat_ctx_t* ctx) {
+#if MFAT_ENABLE_WRITE
+  // Flush any pending writes (including the FAT copies).
+  _mfat_sync_impl(ctx, true);
+#endif
+  ctx->initialized = false;
+}
 
-    bytes_read += bytes_to_copy;
+int mfat_select_partition_ctx(mfat_ctx_t* ctx, int partition_no) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
+  }
+  if (partition_no < 0 || partition_no >= MFAT_NUM_PARTITIONS) {
+    DBGF("Bad partition number: %d", partition_no);
+    return -1;
+  }
+  if (ctx->partition[partition_no].type == MFAT_PART_TYPE_UNKNOWN) {
+    DBG("Unsupported partition type");
+    return -1;
   }
 
-  // Update file state.
-  f->current_cluster = cpos.cluster_no;
-  f->offset += bytes_read;
+  ctx->active_partition = partition_no;
 
-  return bytes_read;
+  return 0;
 }
 
+void mfat_sync_ctx(mfat_ctx_t* ctx) {
 #if MFAT_ENABLE_WRITE
-static int64_t _mfat_write_impl(mfat_file_t* f, const uint8_t* buf, uint32_t nbyte) {
-  // Is the file open with write permissions?
-  if ((f->oflag & MFAT_O_WRONLY) == 0) {
-    return -1;
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return;
   }
 
-  // TODO(m): Implement me!
-  (void)buf;
-  (void)nbyte;
-  DBG("_mfat_write_impl() - not yet implemented");
-  return -1;
-}
+  _mfat_sync_impl(ctx, false);
+#else
+  (void)ctx;
 #endif
+}
 
-static int64_t _mfat_lseek_impl(mfat_file_t* f, int64_t offset, int whence) {
-  // Calculate the new requested file offset (the arithmetic is done in 64-bit precision in order to
-  // properly handle overflow).
-  int64_t target_offset_64;
-  switch (whence) {
-    case MFAT_SEEK_SET:
-      target_offset_64 = offset;
-      break;
-    case MFAT_SEEK_END:
-      target_offset_64 = ((int64_t)f->info.size) + offset;
-      break;
-    case MFAT_SEEK_CUR:
-      target_offset_64 = ((int64_t)f->offset) + offset;
-      break;
-    default:
-      DBGF("Invalid whence: %d", whence);
-      return -1;
-  }
-
-  // Sanity check the new offset.
-  if (target_offset_64 < 0) {
-    DBG("Seeking to a negative offset is not allowed");
+int mfat_set_fat_mirroring_ctx(mfat_ctx_t* ctx, int mode) {
+#if MFAT_ENABLE_WRITE
+  if (!ctx->initialized) {
+    DBG("Not initialized");
     return -1;
   }
-  if (target_offset_64 > (int64_t)f->info.size) {
-    // TODO(m): POSIX lseek() allows seeking beyond the end of the file. We currently don't.
-    DBG("Seeking beyond the end of the file is not allowed");
+  if (mode != MFAT_FAT_MIRROR_SYNC && mode != MFAT_FAT_MIRROR_UNMOUNT) {
+    DBGF("Bad FAT mirroring mode: %d", mode);
     return -1;
   }
 
-  // This type conversion is safe, since we have verified that the value fits in a 32 bit unsigned
-  // value.
-  uint32_t target_offset = (uint32_t)target_offset_64;
+  _mfat_lock(ctx, MFAT_LOCK_FAT_CACHE);
+  ctx->fat_mirroring = mode;
+  _mfat_unlock(ctx, MFAT_LOCK_FAT_CACHE);
+  return 0;
+#else
+  (void)ctx;
+  (void)mode;
+  return -1;
+#endif
+}
 
-  // Get partition info.
-  mfat_partition_t* part = &s_ctx.partition[f->info.part_no];
-  uint32_t bytes_per_cluster = part->blocks_per_cluster * MFAT_BLOCK_SIZE;
+int mfat_fstat_ctx(mfat_ctx_t* ctx, int fd, mfat_stat_t* stat) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
+  }
 
-  // Define the starting point for the cluster search.
-  uint32_t current_cluster = f->current_cluster;
-  uint32_t cluster_offset = f->offset - (f->offset % bytes_per_cluster);
-  if (target_offset < cluster_offset) {
-    // For reverse seeking we need to start from the beginning of the file since FAT uses singly
-    // linked lists.
-    current_cluster = f->info.first_cluster;
-    cluster_offset = 0;
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL) {
+    return -1;
   }
 
-  // Skip along clusters until we find the cluster that contains the requested offset.
-  while ((target_offset - cluster_offset) >= bytes_per_cluster) {
-    if (_mfat_is_eoc(current_cluster)) {
-      DBG("Unexpected cluster access after EOC");
-      return -1;
-    }
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  int result = _mfat_fstat_impl(ctx, &f->info, stat);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+  _mfat_unlock(ctx, lock_id);
 
-    // Look up the next cluster.
-    if (!_mfat_next_cluster(part, &current_cluster)) {
-      return -1;
-    }
-    cluster_offset += bytes_per_cluster;
+  return result;
+}
+
+int mfat_stat_ctx(mfat_ctx_t* ctx, const char* path, mfat_stat_t* stat) {
+  if (!ctx->initialized || ctx->active_partition < 0) {
+    DBG("Not initialized");
+    return -1;
+  }
+  if (path == NULL || stat == NULL) {
+    return -1;
   }
 
-  // Update the current offset in the file descriptor.
-  f->offset = target_offset;
-  f->current_cluster = current_cluster;
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  int result = _mfat_stat_impl(ctx, path, stat);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
 
-  return (int64_t)target_offset;
+  return result;
 }
 
-#if MFAT_ENABLE_OPENDIR
-static mfat_dir_t* _mfat_opendir_impl(int fd) {
-  // Find the next free dir object.
-  int dir_id;
-  for (dir_id = 0; dir_id < MFAT_NUM_DIRS; ++dir_id) {
-    if (s_ctx.dir[dir_id].file == NULL) {
-      break;
-    }
+int mfat_open_ctx(mfat_ctx_t* ctx, const char* path, int oflag) {
+  if (!ctx->initialized || ctx->active_partition < 0) {
+    DBG("Not initialized");
+    return -1;
   }
-  if (dir_id >= MFAT_NUM_DIRS) {
-    DBG("No free dir:s left");
-    return NULL;
+  if (path == NULL || ((oflag & MFAT_O_RDWR) == 0)) {
+    return -1;
   }
 
-  // Initialize the directory stream object.
-  mfat_dir_t* dirp = &s_ctx.dir[dir_id];
-  dirp->file = _mfat_fd_to_file(fd);
-  if (dirp->file == NULL) {
-    DBG("The dir fd is not an open dir");
-    return NULL;
+  return _mfat_open_impl(ctx, path, oflag);
+}
+
+int mfat_close_ctx(mfat_ctx_t* ctx, int fd) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
   }
-  mfat_partition_t* part = &s_ctx.partition[dirp->file->info.part_no];
-  if (dirp->file->type == MFAT_FILE_TYPE_FAT16ROOTDIR) {
-    // We use a fake/tweaked cluster pos for FAT16 root directories.
-    dirp->cpos.cluster_no = 0U;
-    dirp->cpos.cluster_start_blk = part->root_dir_block;
-    dirp->cpos.block_in_cluster = 0U;
-    dirp->blocks_left = part->blocks_in_root_dir;
-  } else {
-    // We use an "infinite" block count for regular cluster chain dirs.
-    dirp->cpos = _mfat_cluster_pos_init(part, dirp->file->info.first_cluster, 0);
-    dirp->blocks_left = 0xffffffffU;
+
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL) {
+    return -1;
   }
-  dirp->block_offset = 0U;
 
-  // TODO(m): Pointer to first file in directory etc.
-  dirp->items_left = 5;  // HACK!
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int result = _mfat_close_impl(ctx, f);
+  _mfat_unlock(ctx, lock_id);
 
-  return dirp;
+  return result;
 }
-#endif
 
-#if MFAT_ENABLE_OPENDIR
-int _mfat_closedir_impl(mfat_dir_t* dirp) {
-  if (dirp == NULL) {
+int64_t mfat_read_ctx(mfat_ctx_t* ctx, int fd, void* buf, uint32_t nbyte) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
     return -1;
   }
-  if (dirp->file == NULL) {
-    DBG("The dir is already closed");
+
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  // Close the file.
-  int result = _mfat_close_impl(dirp->file);
-
-  // The dir is no longer open. This makes the dir object available for future opendir() requests.
-  dirp->file = NULL;
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int64_t result = _mfat_read_impl(ctx, f, (uint8_t*)buf, nbyte);
+  _mfat_unlock(ctx, lock_id);
 
   return result;
 }
-#endif
 
-#if MFAT_ENABLE_OPENDIR
-mfat_dirent_t* _mfat_readdir_impl(mfat_dir_t* dirp) {
-  // Do we need to advance to the next block in the directory?
-  if (dirp->block_offset >= 512U) {
-    if (dirp->file->type == MFAT_FILE_TYPE_FAT16ROOTDIR) {
-      dirp->cpos.block_in_cluster += 1;  // FAT16 style linear block access.
-    } else {
-      mfat_partition_t* part = &s_ctx.partition[dirp->file->info.part_no];
-      if (!_mfat_cluster_pos_advance(&dirp->cpos, part)) {
-        DBG("readdir: Unable to advance to next cluster.");
-        return NULL;
-      }
-    }
-    dirp->block_offset = 0U;
+int64_t mfat_readv_ctx(mfat_ctx_t* ctx, int fd, const mfat_iovec_t* iov, int iovcnt) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
   }
 
-  // Look up the next file name in the directory.
-  mfat_bool_t found_entry = false;
-  mfat_bool_t no_more_entries = false;
-  for (; !found_entry && !no_more_entries && dirp->blocks_left > 0U; --dirp->blocks_left) {
-    // Load the directory table block.
-    mfat_cached_block_t* block =
-        _mfat_read_block(_mfat_cluster_pos_blk_no(&dirp->cpos), MFAT_CACHE_DATA);
-    if (block == NULL) {
-      DBGF("Unable to load directory block %" PRIu32, _mfat_cluster_pos_blk_no(&dirp->cpos));
-      return false;
-    }
-    uint8_t* buf = &block->buf[0];
-
-    // Loop over all the files in this directory block.
-    for (; !found_entry && dirp->block_offset < 512U; dirp->block_offset += 32U) {
-      uint8_t* entry = &buf[dirp->block_offset];
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
+    return -1;
+  }
 
-      // Empty entry?
-      if (entry[0] == 0xe5) {
-        continue;
-      }
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int64_t result = _mfat_readv_impl(ctx, f, iov, iovcnt);
+  _mfat_unlock(ctx, lock_id);
 
-      // Last entry in the directory structure?
-      if (entry[0] == 0x00) {
-        no_more_entries = true;
-        break;
-      }
+  return result;
+}
 
-      // A file/dir entry?
-      if (_mfat_is_valid_shortname_file(entry)) {
-        // We found the next file.
-        found_entry = true;
-        _mfat_make_printable_fname(entry, dirp->dirent.d_name);
-      }
-    }
+int mfat_read_async_ctx(mfat_ctx_t* ctx, int fd, void* buf, uint32_t nbyte, mfat_aio_t* aio) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
   }
 
-  if (!found_entry) {
-    return NULL;
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR || aio == NULL) {
+    return -1;
   }
 
-  return &dirp->dirent;
-}
-#endif
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int result = _mfat_read_async_impl(ctx, f, (uint8_t*)buf, nbyte, aio);
+  _mfat_unlock(ctx, lock_id);
 
-//--------------------------------------------------------------------------------------------------
-// Public API functions.
-//--------------------------------------------------------------------------------------------------
+  return result;
+}
 
-int mfat_mount(mfat_read_block_fun_t read_fun, mfat_write_block_fun_t write_fun, void* custom) {
-#if MFAT_ENABLE_WRITE
-  if (read_fun == NULL || write_fun == NULL) {
-#else
-  if (read_fun == NULL) {
-#endif
-    DBG("Bad function pointers");
+int mfat_aio_poll_ctx(mfat_ctx_t* ctx, mfat_aio_t* aio) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
+  }
+  if (aio == NULL) {
     return -1;
   }
 
-  // Clear the context state.
-  memset(&s_ctx, 0, sizeof(mfat_ctx_t));
-  s_ctx.read = read_fun;
-#if MFAT_ENABLE_WRITE
-  s_ctx.write = write_fun;
-#else
-  (void)write_fun;
-#endif
-  s_ctx.custom = custom;
-  s_ctx.active_partition = -1;
+  return _mfat_aio_poll_impl(ctx, aio);
+}
 
-#if MFAT_NUM_CACHED_BLOCKS > 1
-  // Initialize the block cache priority queues.
-  for (int j = 0; j < MFAT_NUM_CACHES; ++j) {
-    mfat_cache_t* cache = &s_ctx.cache[j];
-    for (int i = 0; i < MFAT_NUM_CACHED_BLOCKS; ++i) {
-      // Assign initial items to the priority queue.
-      cache->pri[i] = i;
-    }
+int64_t mfat_aio_wait_ctx(mfat_ctx_t* ctx, mfat_aio_t* aio) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
   }
-#endif
-
-  // Read the partition tables.
-  if (!_mfat_decode_partition_tables()) {
+  if (aio == NULL) {
     return -1;
   }
 
-  // Find the first bootable partition. If no bootable partition is found, pick the first supported
-  // partition.
-  int first_boot_partition = -1;
-  for (int i = 0; i < MFAT_NUM_PARTITIONS; ++i) {
-    if (s_ctx.partition[i].type != MFAT_PART_TYPE_UNKNOWN) {
-      if (s_ctx.partition[i].boot && first_boot_partition < 0) {
-        first_boot_partition = i;
-        s_ctx.active_partition = i;
-      } else if (s_ctx.active_partition < 0) {
-        s_ctx.active_partition = i;
-      }
-    }
-  }
-  if (s_ctx.active_partition < 0) {
+  return _mfat_aio_wait_impl(ctx, aio);
+}
+
+int64_t mfat_pread_ctx(mfat_ctx_t* ctx, int fd, void* buf, uint32_t nbyte, int64_t offset) {
+  if (!ctx->initialized) {
+    DBG("Not initialized");
     return -1;
   }
-  DBGF("Selected partition %d", s_ctx.active_partition);
 
-  // MFAT is now initizlied.
-  DBG("Successfully initialized");
-  s_ctx.initialized = true;
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
+    return -1;
+  }
 
-  return 0;
-}
+  // Positional reads do not touch the file offset, so the file lock is only held while we take a
+  // snapshot of the file state. A concurrent writer may append to the extent map, but it never
+  // changes how the extents covered by the snapshot map the clusters within the snapshot size.
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  mfat_file_t snapshot = *f;
+  _mfat_unlock(ctx, lock_id);
 
-void mfat_unmount(void) {
-#if MFAT_ENABLE_WRITE
-  // Flush any pending writes.
-  _mfat_sync_impl();
-#endif
-  s_ctx.initialized = false;
+  return _mfat_pread_impl(ctx, &snapshot, (uint8_t*)buf, nbyte, offset);
 }
 
-int mfat_select_partition(int partition_no) {
-  if (!s_ctx.initialized) {
+int mfat_read_view_ctx(mfat_ctx_t* ctx,
+                       int fd,
+                       uint32_t max_bytes,
+                       const void** ptr,
+                       uint32_t* len) {
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
-  if (partition_no < 0 || partition_no >= MFAT_NUM_PARTITIONS) {
-    DBGF("Bad partition number: %d", partition_no);
+  if (ptr == NULL || len == NULL) {
     return -1;
   }
-  if (s_ctx.partition[partition_no].type == MFAT_PART_TYPE_UNKNOWN) {
-    DBG("Unsupported partition type");
+
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  s_ctx.active_partition = partition_no;
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int result = _mfat_read_view_impl(ctx, f, max_bytes, ptr, len);
+  _mfat_unlock(ctx, lock_id);
 
-  return 0;
+  return result;
 }
 
-void mfat_sync(void) {
-#if MFAT_ENABLE_WRITE
-  if (!s_ctx.initialized) {
+int mfat_release_view_ctx(mfat_ctx_t* ctx, const void* ptr) {
+  if (!ctx->initialized) {
     DBG("Not initialized");
-    return;
+    return -1;
+  }
+  if (ptr == NULL) {
+    return -1;
   }
 
-  _mfat_sync_impl();
-#endif
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  int result = _mfat_release_view_impl(ctx, ptr);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+
+  return result;
 }
 
-int mfat_fstat(int fd, mfat_stat_t* stat) {
-  if (!s_ctx.initialized) {
+int64_t mfat_write_ctx(mfat_ctx_t* ctx, int fd, const void* buf, uint32_t nbyte) {
+#if MFAT_ENABLE_WRITE
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
 
-  mfat_file_t* f = _mfat_fd_to_file(fd);
-  if (f == NULL) {
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  return _mfat_fstat_impl(&f->info, stat);
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int64_t result = _mfat_write_impl(ctx, f, (const uint8_t*)buf, nbyte);
+  _mfat_unlock(ctx, lock_id);
+
+  return result;
+#else
+  DBG("mfat_write() was disabled at compile-time");
+  (void)ctx;
+  (void)fd;
+  (void)buf;
+  (void)nbyte;
+  return -1;
+#endif
 }
 
-int mfat_stat(const char* path, mfat_stat_t* stat) {
-  if (!s_ctx.initialized || s_ctx.active_partition < 0) {
+int64_t mfat_writev_ctx(mfat_ctx_t* ctx, int fd, const mfat_iovec_t* iov, int iovcnt) {
+#if MFAT_ENABLE_WRITE
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
-  if (path == NULL || stat == NULL) {
+
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  return _mfat_stat_impl(path, stat);
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int64_t result = _mfat_writev_impl(ctx, f, iov, iovcnt);
+  _mfat_unlock(ctx, lock_id);
+
+  return result;
+#else
+  DBG("mfat_writev() was disabled at compile-time");
+  (void)ctx;
+  (void)fd;
+  (void)iov;
+  (void)iovcnt;
+  return -1;
+#endif
 }
 
-int mfat_open(const char* path, int oflag) {
-  if (!s_ctx.initialized || s_ctx.active_partition < 0) {
+int64_t mfat_pwrite_ctx(mfat_ctx_t* ctx, int fd, const void* buf, uint32_t nbyte, int64_t offset) {
+#if MFAT_ENABLE_WRITE
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
-  if (path == NULL || ((oflag & MFAT_O_RDWR) == 0)) {
+
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  return _mfat_open_impl(path, oflag);
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int64_t result = _mfat_pwrite_impl(ctx, f, (const uint8_t*)buf, nbyte, offset);
+  _mfat_unlock(ctx, lock_id);
+
+  return result;
+#else
+  DBG("mfat_pwrite() was disabled at compile-time");
+  (void)ctx;
+  (void)fd;
+  (void)buf;
+  (void)nbyte;
+  (void)offset;
+  return -1;
+#endif
 }
 
-int mfat_close(int fd) {
-  if (!s_ctx.initialized) {
+int mfat_fallocate_ctx(mfat_ctx_t* ctx, int fd, uint32_t length) {
+#if MFAT_ENABLE_WRITE
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
 
-  mfat_file_t* f = _mfat_fd_to_file(fd);
-  if (f == NULL) {
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
+  if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  return _mfat_close_impl(f);
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int result = _mfat_fallocate_impl(ctx, f, length);
+  _mfat_unlock(ctx, lock_id);
+
+  return result;
+#else
+  DBG("mfat_fallocate() was disabled at compile-time");
+  (void)ctx;
+  (void)fd;
+  (void)length;
+  return -1;
+#endif
 }
 
-int64_t mfat_read(int fd, void* buf, uint32_t nbyte) {
-  if (!s_ctx.initialized) {
+int64_t mfat_lseek_ctx(mfat_ctx_t* ctx, int fd, int64_t offset, int whence) {
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
 
-  mfat_file_t* f = _mfat_fd_to_file(fd);
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
   if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  return _mfat_read_impl(f, (uint8_t*)buf, nbyte);
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  int64_t result = _mfat_lseek_impl(ctx, f, offset, whence);
+  _mfat_unlock(ctx, lock_id);
+
+  return result;
 }
 
-int64_t mfat_write(int fd, const void* buf, uint32_t nbyte) {
-#if MFAT_ENABLE_WRITE
-  if (!s_ctx.initialized) {
+int mfat_build_extent_map_ctx(mfat_ctx_t* ctx,
+                              int fd,
+                              mfat_extent_t* extents,
+                              uint32_t max_extents) {
+#if MFAT_ENABLE_EXTENTS
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
 
-  mfat_file_t* f = _mfat_fd_to_file(fd);
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
   if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  return _mfat_write_impl(f, (const uint8_t*)buf, nbyte);
+  // Detach any previous extent map.
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  f->extents = NULL;
+  f->num_extents = 0U;
+  f->max_extents = 0U;
+  f->extents_complete = false;
+  int result = 0;
+  if (extents != NULL && max_extents > 0U) {
+    f->extents = extents;
+    f->max_extents = max_extents;
+    if (_mfat_build_extent_map(ctx, f)) {
+      result = (int)f->num_extents;
+    } else {
+      f->extents = NULL;
+      f->num_extents = 0U;
+      result = -1;
+    }
+  }
+  _mfat_unlock(ctx, lock_id);
+
+  return result;
 #else
-  DBG("mfat_write() was disabled at compile-time");
+  DBG("mfat_build_extent_map() was disabled at compile-time");
+  (void)ctx;
   (void)fd;
-  (void)buf;
-  (void)nbyte;
+  (void)extents;
+  (void)max_extents;
   return -1;
 #endif
 }
 
-int64_t mfat_lseek(int fd, int64_t offset, int whence) {
-  if (!s_ctx.initialized) {
+int mfat_set_readahead_ctx(mfat_ctx_t* ctx, int fd, uint32_t num_clusters) {
+#if MFAT_ENABLE_READAHEAD
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
 
-  mfat_file_t* f = _mfat_fd_to_file(fd);
+  mfat_file_t* f = _mfat_fd_to_file(ctx, fd);
   if (f == NULL || f->type != MFAT_FILE_TYPE_REGULAR) {
     return -1;
   }
 
-  return _mfat_lseek_impl(f, offset, whence);
+  unsigned lock_id = _mfat_file_lock_id(ctx, f);
+  _mfat_lock(ctx, lock_id);
+  f->ra_clusters = num_clusters;
+  _mfat_unlock(ctx, lock_id);
+
+  return 0;
+#else
+  DBG("mfat_set_readahead() was disabled at compile-time");
+  (void)ctx;
+  (void)fd;
+  (void)num_clusters;
+  return -1;
+#endif
 }
 
-mfat_dir_t* mfat_fdopendir(int fd) {
+mfat_dir_t* mfat_fdopendir_ctx(mfat_ctx_t* ctx, int fd) {
 #if MFAT_ENABLE_OPENDIR
-  if (!s_ctx.initialized) {
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return NULL;
   }
 
-  return _mfat_opendir_impl(fd);
+  return _mfat_opendir_impl(ctx, fd);
 #else
   DBG("mfat_opendir() was disabled at compile-time");
+  (void)ctx;
   (void)fd;
   return NULL;
 #endif
 }
 
-mfat_dir_t* mfat_opendir(const char* path) {
+mfat_dir_t* mfat_opendir_ctx(mfat_ctx_t* ctx, const char* path) {
 #if MFAT_ENABLE_OPENDIR
-  if (!s_ctx.initialized || s_ctx.active_partition < 0) {
+  if (!ctx->initialized || ctx->active_partition < 0) {
     DBG("Not initialized");
     return NULL;
   }
 
-  int fd = mfat_open(path, MFAT_O_DIRECTORY | MFAT_O_RDONLY);
+  int fd = mfat_open_ctx(ctx, path, MFAT_O_DIRECTORY | MFAT_O_RDONLY);
   if (fd == -1) {
     return NULL;
   }
-  return _mfat_opendir_impl(fd);
+  mfat_dir_t* dirp = _mfat_opendir_impl(ctx, fd);
+  if (dirp == NULL) {
+    // Do not leak the fd if there are no free dir objects.
+    (void)mfat_close_ctx(ctx, fd);
+  }
+  return dirp;
 #else
+  (void)ctx;
   (void)path;
   return NULL;
 #endif
 }
 
-int mfat_closedir(mfat_dir_t* dirp) {
+mfat_dir_t* mfat_opendir_into_ctx(mfat_ctx_t* ctx, mfat_dir_storage_t* storage, const char* path) {
 #if MFAT_ENABLE_OPENDIR
-  if (!s_ctx.initialized) {
+  if (!ctx->initialized || ctx->active_partition < 0) {
+    DBG("Not initialized");
+    return NULL;
+  }
+  if (storage == NULL) {
+    DBG("Invalid dir storage");
+    return NULL;
+  }
+
+  return _mfat_opendir_into_impl(ctx, storage, path);
+#else
+  (void)ctx;
+  (void)storage;
+  (void)path;
+  return NULL;
+#endif
+}
+
+int mfat_closedir_ctx(mfat_ctx_t* ctx, mfat_dir_t* dirp) {
+#if MFAT_ENABLE_OPENDIR
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return -1;
   }
 
-  return _mfat_closedir_impl(dirp);
+  return _mfat_closedir_impl(ctx, dirp);
 #else
+  (void)ctx;
   (void)dirp;
   return -1;
 #endif
 }
 
-mfat_dirent_t* mfat_readdir(mfat_dir_t* dirp) {
+mfat_dirent_t* mfat_readdir_ctx(mfat_ctx_t* ctx, mfat_dir_t* dirp) {
 #if MFAT_ENABLE_OPENDIR
-  if (!s_ctx.initialized) {
+  if (!ctx->initialized) {
     DBG("Not initialized");
     return NULL;
   }
-  if (dirp == NULL || dirp->file == NULL) {
+  if (dirp == NULL || !dirp->open) {
     DBG("Invalid dir");
     return NULL;
   }
 
   // Advance to the next entry in the directory.
-  return _mfat_readdir_impl(dirp);
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  mfat_dirent_t* dirent = _mfat_readdir_impl(ctx, dirp);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+
+  return dirent;
 #else
+  (void)ctx;
   (void)dirp;
   return NULL;
 #endif
 }
+
+int mfat_getdents_ctx(mfat_ctx_t* ctx,
+                      mfat_dir_t* dirp,
+                      mfat_dirent_t* entries,
+                      int max_entries,
+                      int* count) {
+#if MFAT_ENABLE_OPENDIR
+  if (!ctx->initialized) {
+    DBG("Not initialized");
+    return -1;
+  }
+  if (dirp == NULL || !dirp->open) {
+    DBG("Invalid dir");
+    return -1;
+  }
+  if (entries == NULL || max_entries <= 0 || count == NULL) {
+    DBG("Invalid arguments");
+    return -1;
+  }
+
+  // Read as many entries as possible from the directory.
+  _mfat_lock(ctx, MFAT_LOCK_DATA_CACHE);
+  int result = _mfat_read_dirents(ctx, dirp, entries, max_entries);
+  _mfat_unlock(ctx, MFAT_LOCK_DATA_CACHE);
+  if (result < 0) {
+    return -1;
+  }
+
+  *count = result;
+  return 0;
+#else
+  (void)ctx;
+  (void)dirp;
+  (void)entries;
+  (void)max_entries;
+  (void)count;
+  return -1;
+#endif
+}
+
+//--------------------------------------------------------------------------------------------------
+// Public API functions that operate on the default context.
+//--------------------------------------------------------------------------------------------------
+
+int mfat_mount_ex(const mfat_mount_opts_t* opts) {
+  return mfat_mount_ctx(&s_ctx, opts);
+}
+
+void mfat_unmount(void) {
+  mfat_unmount_ctx(&s_ctx);
+}
+
+int mfat_select_partition(int partition_no) {
+  return mfat_select_partition_ctx(&s_ctx, partition_no);
+}
+
+void mfat_sync(void) {
+  mfat_sync_ctx(&s_ctx);
+}
+
+int mfat_set_fat_mirroring(int mode) {
+  return mfat_set_fat_mirroring_ctx(&s_ctx, mode);
+}
+
+int mfat_fstat(int fd, mfat_stat_t* stat) {
+  return mfat_fstat_ctx(&s_ctx, fd, stat);
+}
+
+int mfat_stat(const char* path, mfat_stat_t* stat) {
+  return mfat_stat_ctx(&s_ctx, path, stat);
+}
+
+int mfat_open(const char* path, int oflag) {
+  return mfat_open_ctx(&s_ctx, path, oflag);
+}
+
+int mfat_close(int fd) {
+  return mfat_close_ctx(&s_ctx, fd);
+}
+
+int64_t mfat_read(int fd, void* buf, uint32_t nbyte) {
+  return mfat_read_ctx(&s_ctx, fd, buf, nbyte);
+}
+
+int64_t mfat_readv(int fd, const mfat_iovec_t* iov, int iovcnt) {
+  return mfat_readv_ctx(&s_ctx, fd, iov, iovcnt);
+}
+
+int mfat_read_async(int fd, void* buf, uint32_t nbyte, mfat_aio_t* aio) {
+  return mfat_read_async_ctx(&s_ctx, fd, buf, nbyte, aio);
+}
+
+int mfat_aio_poll(mfat_aio_t* aio) {
+  return mfat_aio_poll_ctx(&s_ctx, aio);
+}
+
+int64_t mfat_aio_wait(mfat_aio_t* aio) {
+  return mfat_aio_wait_ctx(&s_ctx, aio);
+}
+
+int64_t mfat_pread(int fd, void* buf, uint32_t nbyte, int64_t offset) {
+  return mfat_pread_ctx(&s_ctx, fd, buf, nbyte, offset);
+}
+
+int mfat_read_view(int fd, uint32_t max_bytes, const void** ptr, uint32_t* len) {
+  return mfat_read_view_ctx(&s_ctx, fd, max_bytes, ptr, len);
+}
+
+int mfat_release_view(const void* ptr) {
+  return mfat_release_view_ctx(&s_ctx, ptr);
+}
+
+int64_t mfat_write(int fd, const void* buf, uint32_t nbyte) {
+  return mfat_write_ctx(&s_ctx, fd, buf, nbyte);
+}
+
+int64_t mfat_writev(int fd, const mfat_iovec_t* iov, int iovcnt) {
+  return mfat_writev_ctx(&s_ctx, fd, iov, iovcnt);
+}
+
+int64_t mfat_pwrite(int fd, const void* buf, uint32_t nbyte, int64_t offset) {
+  return mfat_pwrite_ctx(&s_ctx, fd, buf, nbyte, offset);
+}
+
+int mfat_fallocate(int fd, uint32_t length) {
+  return mfat_fallocate_ctx(&s_ctx, fd, length);
+}
+
+int64_t mfat_lseek(int fd, int64_t offset, int whence) {
+  return mfat_lseek_ctx(&s_ctx, fd, offset, whence);
+}
+
+int mfat_build_extent_map(int fd, mfat_extent_t* extents, uint32_t max_extents) {
+  return mfat_build_extent_map_ctx(&s_ctx, fd, extents, max_extents);
+}
+
+int mfat_set_readahead(int fd, uint32_t num_clusters) {
+  return mfat_set_readahead_ctx(&s_ctx, fd, num_clusters);
+}
+
+mfat_dir_t* mfat_fdopendir(int fd) {
+  return mfat_fdopendir_ctx(&s_ctx, fd);
+}
+
+mfat_dir_t* mfat_opendir(const char* path) {
+  return mfat_opendir_ctx(&s_ctx, path);
+}
+
+mfat_dir_t* mfat_opendir_into(mfat_dir_storage_t* storage, const char* path) {
+  return mfat_opendir_into_ctx(&s_ctx, storage, path);
+}
+
+int mfat_closedir(mfat_dir_t* dirp) {
+  return mfat_closedir_ctx(&s_ctx, dirp);
+}
+
+mfat_dirent_t* mfat_readdir(mfat_dir_t* dirp) {
+  return mfat_readdir_ctx(&s_ctx, dirp);
+}
+
+int mfat_getdents(mfat_dir_t* dirp, mfat_dirent_t* entries, int max_entries, int* count) {
+  return mfat_getdents_ctx(&s_ctx, dirp, entries, max_entries, count);
+}
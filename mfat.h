@@ -31,6 +31,7 @@
 #ifndef MFAT_H_
 #define MFAT_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -48,6 +49,10 @@ extern "C" {
 #define MFAT_O_CREAT 8
 #define MFAT_O_DIRECTORY 16
 
+// FAT mirroring modes for mfat_set_fat_mirroring().
+#define MFAT_FAT_MIRROR_SYNC 0     ///< Update the FAT copies on sync (default).
+#define MFAT_FAT_MIRROR_UNMOUNT 1  ///< Only update the FAT copies on unmount.
+
 // Whence values for mfat_lseek().
 #define MFAT_SEEK_SET 0  ///< The offset is set to offset bytes.
 #define MFAT_SEEK_CUR 1  ///< The offset is set to its current location plus offset bytes.
@@ -70,8 +75,17 @@ extern "C" {
 #define MFAT_S_ISREG(m) (((m)&MFAT_S_IFREG) != 0U)
 #define MFAT_S_ISDIR(m) (((m)&MFAT_S_IFDIR) != 0U)
 
-// Maximum length of a filename (for mfat_dirent_t).
-#define MFAT_NAME_MAX 12
+// FAT file attribute bits (for mfat_dirent_t.d_attr).
+#define MFAT_ATTR_READ_ONLY 0x01  ///< Read only.
+#define MFAT_ATTR_HIDDEN 0x02     ///< Hidden.
+#define MFAT_ATTR_SYSTEM 0x04     ///< System file.
+#define MFAT_ATTR_VOLUME_ID 0x08  ///< Volume label.
+#define MFAT_ATTR_DIRECTORY 0x10  ///< Directory.
+#define MFAT_ATTR_ARCHIVE 0x20    ///< Archive (modified since the last backup).
+
+// Maximum length of a filename in bytes, excluding the terminating zero (for mfat_dirent_t). Long
+// file names are UTF-8 encoded.
+#define MFAT_NAME_MAX 255
 
 // The values of this struct are compatible with struct tm in <time.h>, so it is easy to convert the
 // date/time to other representations using mktime(), for instance.
@@ -90,13 +104,56 @@ typedef struct {
   mfat_time_t st_mtim;  ///< Modification time.
 } mfat_stat_t;
 
+/// A directory entry, as returned by mfat_readdir().
+///
+/// Besides the name, the entire directory entry is decoded, so listing a directory does not need a
+/// mfat_stat() call per entry. The directory entry locator (block and offset) uniquely identifies
+/// the entry on the volume.
 typedef struct {
   char d_name[MFAT_NAME_MAX + 1];  ///< Filename of the directory entry.
+  mfat_stat_t d_stat;              ///< File status (same as mfat_stat() returns).
+  uint8_t d_attr;                  ///< FAT attribute bits (MFAT_ATTR_*).
+  uint32_t d_first_cluster;        ///< First cluster of the file (0 for empty files).
+  uint32_t d_dir_entry_block;      ///< Absolute block number of the directory entry.
+  uint32_t d_dir_entry_offset;     ///< Offset of the directory entry within its block.
 } mfat_dirent_t;
 
+/// A cluster extent: A run of physically contiguous clusters of a file.
+typedef struct {
+  uint32_t file_cluster;  ///< Index of the first cluster of the run, relative to the file start.
+  uint32_t disk_cluster;  ///< Cluster number of the first cluster of the run.
+  uint32_t num_clusters;  ///< Number of clusters in the run.
+} mfat_extent_t;
+
+/// A directory entry cache item (see mfat_mount_ex()). The fields are private to MFAT.
+typedef struct {
+  uint32_t dir_cluster;       ///< First cluster of the parent directory.
+  uint32_t dir_entry_block;   ///< Block number of the directory entry (0 = unused item).
+  uint16_t dir_entry_offset;  ///< Offset of the directory entry within the block.
+  uint16_t part_no;           ///< Partition number.
+  uint8_t entry[32];          ///< A copy of the directory entry.
+} mfat_dentry_t;
+
+/// An I/O vector segment, for scatter/gather I/O (see mfat_readv() and mfat_writev()).
+typedef struct {
+  void* iov_base;    ///< Start of the buffer.
+  uint32_t iov_len;  ///< Size of the buffer, in bytes.
+} mfat_iovec_t;
+
 struct mfat_dir_struct;
 typedef struct mfat_dir_struct mfat_dir_t;
 
+/// Memory for a caller-allocated directory stream (see mfat_opendir_into()). The fields are private
+/// to MFAT.
+typedef struct {
+  mfat_dirent_t dirent;  ///< The current dirent.
+  uint32_t priv[12];     ///< Private stream state.
+} mfat_dir_storage_t;
+
+/// A context holds all the state of a set of mounted volumes (see mfat_mount_ctx()).
+struct mfat_ctx_struct;
+typedef struct mfat_ctx_struct mfat_ctx_t;
+
 /// @brief Block reader function pointer.
 /// @param ptr Pointer to the buffer to read to.
 /// @param block_no The block to read (relative to start of the storage medium).
@@ -111,6 +168,114 @@ typedef int (*mfat_read_block_fun_t)(char* ptr, unsigned block_no, void* custom)
 /// @returns zero (0) on success, or -1 on failure.
 typedef int (*mfat_write_block_fun_t)(const char* ptr, unsigned block_no, void* custom);
 
+/// @brief Multi-block reader function pointer.
+///
+/// This is an optional alternative to mfat_read_block_fun_t, that reads a run of consecutive blocks
+/// with a single request to the storage medium.
+/// @param ptr Pointer to the buffer to read to (num_blocks * MFAT_BLOCK_SIZE bytes).
+/// @param first_block The first block to read (relative to start of the storage medium).
+/// @param num_blocks The number of consecutive blocks to read (at least 1).
+/// @param custom The custom data pointer that was passed to mfat_init().
+/// @returns zero (0) on success, or -1 on failure.
+typedef int (*mfat_read_blocks_fun_t)(char* ptr,
+                                      unsigned first_block,
+                                      unsigned num_blocks,
+                                      void* custom);
+
+/// @brief Multi-block writer function pointer.
+///
+/// This is an optional alternative to mfat_write_block_fun_t, that writes a run of consecutive
+/// blocks with a single request to the storage medium.
+/// @param ptr Pointer to the buffer to write from (num_blocks * MFAT_BLOCK_SIZE bytes).
+/// @param first_block The first block to write (relative to start of the storage medium).
+/// @param num_blocks The number of consecutive blocks to write (at least 1).
+/// @param custom The custom data pointer that was passed to mfat_init().
+/// @returns zero (0) on success, or -1 on failure.
+typedef int (*mfat_write_blocks_fun_t)(const char* ptr,
+                                       unsigned first_block,
+                                       unsigned num_blocks,
+                                       void* custom);
+
+/// @brief Asynchronous multi-block read submission function pointer.
+///
+/// Queues a read of a run of consecutive blocks, and returns without waiting for the read to
+/// complete. The completion of the request is reported by the mfat_poll_fun_t function. At most
+/// MFAT_AIO_QUEUE_DEPTH requests (a compile time setting, 8 by default) are in flight at any time.
+/// @param ptr Pointer to the buffer to read to (num_blocks * MFAT_BLOCK_SIZE bytes).
+/// @param first_block The first block to read (relative to start of the storage medium).
+/// @param num_blocks The number of consecutive blocks to read (at least 1).
+/// @param tag A tag that identifies the request when it completes.
+/// @param custom The custom data pointer that was passed in the mount options.
+/// @returns zero (0) if the request was queued, or -1 on failure.
+typedef int (*mfat_submit_read_fun_t)(char* ptr,
+                                      unsigned first_block,
+                                      unsigned num_blocks,
+                                      unsigned tag,
+                                      void* custom);
+
+/// @brief Asynchronous I/O completion poll function pointer.
+///
+/// Reports one completed request that was queued by the mfat_submit_read_fun_t function.
+/// @param wait Non-zero if the function should block until a request has completed.
+/// @param tag Set to the tag of the completed request.
+/// @param status Set to zero (0) if the request succeeded, or -1 if it failed.
+/// @param custom The custom data pointer that was passed in the mount options.
+/// @returns 1 if a completed request was reported, zero (0) if no request has completed (only when
+/// wait is zero), or -1 on failure.
+typedef int (*mfat_poll_fun_t)(int wait, unsigned* tag, int* status, void* custom);
+
+/// @brief State of an asynchronous read operation (see mfat_read_async()).
+///
+/// The object is owned by the caller, and must stay valid until the operation has completed. The
+/// fields should not be accessed directly (use mfat_aio_poll() and mfat_aio_wait() instead).
+typedef struct {
+  uint32_t pending;  ///< Number of pending block requests.
+  int64_t result;    ///< Number of bytes read, or -1 on failure.
+} mfat_aio_t;
+
+/// @brief Lock/unlock function pointer (only used when MFAT_ENABLE_THREADS is enabled).
+///
+/// Locks are identified by a lock ID in the range [0, mfat_num_locks()), see MFAT_LOCK_*. The
+/// function must block until the lock has been acquired (or released). Locks are never acquired
+/// recursively.
+/// @param lock_id The lock to acquire or release.
+/// @param custom The custom data pointer that was passed in the mount options.
+typedef void (*mfat_lock_fun_t)(unsigned lock_id, void* custom);
+
+// Lock ID:s.
+#define MFAT_LOCK_DATA_CACHE 0         ///< Lock for the data block cache.
+#define MFAT_LOCK_FAT_CACHE 1          ///< Lock for the FAT block cache (and cluster allocation).
+#define MFAT_LOCK_FD_TABLE 2           ///< Lock for the file descriptor and dir tables.
+#define MFAT_LOCK_FILE(fd) (3 + (fd))  ///< Lock for the file descriptor fd.
+
+/// @brief Mount options for mfat_mount_ex().
+///
+/// Zero-initialize the struct and fill out the relevant fields. Optional fields that are left as
+/// zero/NULL are ignored.
+typedef struct {
+  mfat_read_block_fun_t read;            ///< Block reader function (required).
+  mfat_write_block_fun_t write;          ///< Block writer function (required for writing).
+  mfat_read_blocks_fun_t read_blocks;    ///< Multi-block reader function (optional).
+  mfat_write_blocks_fun_t write_blocks;  ///< Multi-block writer function (optional).
+  void* custom;                          ///< Custom data handle passed to the I/O functions.
+  uint32_t* free_bitmap;                 ///< Memory for free cluster bitmaps (optional).
+  uint32_t free_bitmap_words;            ///< Number of 32-bit words in free_bitmap.
+  mfat_lock_fun_t lock;                  ///< Lock function (optional, see MFAT_ENABLE_THREADS).
+  mfat_lock_fun_t unlock;                ///< Unlock function (optional, see MFAT_ENABLE_THREADS).
+  mfat_submit_read_fun_t submit_read;    ///< Asynchronous read submission function (optional).
+  mfat_poll_fun_t poll;                  ///< Asynchronous read completion function (optional).
+  const void* image;                     ///< Memory mapped image (optional, see MFAT_ENABLE_MMAP).
+  uint32_t image_blocks;                 ///< Size of the memory mapped image, in blocks.
+  mfat_dentry_t* dentry_cache;           ///< Memory for a directory entry cache (optional).
+  uint32_t dentry_cache_size;            ///< Number of items in dentry_cache.
+  uint32_t* dir_index_mem;               ///< Memory for directory name indexes (optional).
+  uint32_t dir_index_words;              ///< Number of 32-bit words in dir_index_mem.
+  void* data_cache_mem;                  ///< Memory for the data block cache (optional).
+  uint32_t data_cache_blocks;            ///< Number of blocks in the data block cache.
+  void* fat_cache_mem;                   ///< Memory for the FAT block cache (optional).
+  uint32_t fat_cache_blocks;             ///< Number of blocks in the FAT block cache.
+} mfat_mount_opts_t;
+
 /// @brief Mount FAT volumes.
 ///
 /// The provided read and write functions implement access to the storage medium, and the optional
@@ -126,6 +291,73 @@ typedef int (*mfat_write_block_fun_t)(const char* ptr, unsigned block_no, void*
 /// @returns zero (0) on success, or -1 on failure.
 int mfat_mount(mfat_read_block_fun_t read_fun, mfat_write_block_fun_t write_fun, void* custom);
 
+/// @brief Mount FAT volumes, with extended options.
+///
+/// This works just like mfat_mount(), but accepts additional (optional) I/O functions and settings.
+///
+/// If a multi-block reader function is provided, reads of physically contiguous blocks (e.g. large
+/// mfat_read() requests) are coalesced into a single request to the storage medium. Similarly, if a
+/// multi-block writer function is provided, runs of adjacent dirty blocks are written with a single
+/// request when the cache is flushed.
+///
+/// If memory for free cluster bitmaps is provided, the FAT of each partition is scanned once during
+/// mount, and a bitmap with one bit per cluster is built. Cluster allocation then searches the
+/// bitmap instead of the FAT. A partition needs (N + 32) / 32 words, where N is the number of
+/// clusters of the partition (e.g. 32768 words = 128 KiB for a 32 GB volume with 32 KiB clusters).
+/// The memory is split between the partitions in partition order, and partitions that do not fit
+/// fall back to searching the FAT. The memory must stay valid until the volumes are unmounted.
+///
+/// If the library is built with MFAT_ENABLE_THREADS, and lock and unlock functions are provided,
+/// the API functions may be called concurrently from several threads. Both or neither of the
+/// functions must be provided. Note that the I/O functions may then be called concurrently too.
+/// Operations on different files run in parallel as long as they do not need the same block cache,
+/// while concurrent operations on the same file descriptor are serialized.
+///
+/// If asynchronous submit and poll functions are provided, mfat_read_async() keeps several block
+/// requests in flight at the same time (both or neither of the functions must be provided).
+///
+/// If the library is built with MFAT_ENABLE_MMAP, and a memory mapped image of the storage medium
+/// is provided, blocks are accessed directly in the image instead of via the I/O functions and the
+/// block caches (which saves a copy per block access). The I/O functions are optional, and the
+/// volumes are read only (files can not be opened for writing). The image must stay valid until
+/// the volumes are unmounted.
+///
+/// If the library is built with MFAT_ENABLE_DENTRY_CACHE, and memory for a directory entry cache
+/// is provided, the directory entries that are found by path lookups (e.g. in mfat_open() and
+/// mfat_stat()) are remembered in a hash table, keyed by parent directory and name. Repeated
+/// lookups of the same paths then do not need to scan any directory blocks. Colliding entries
+/// replace each other, so a few hundred items are enough for a few hundred hot paths. The memory
+/// must stay valid until the volumes are unmounted.
+///
+/// If the library is built with MFAT_ENABLE_DIR_INDEX, and memory for directory name indexes is
+/// provided, the first lookup in a directory scans the entire directory and builds a hash table of
+/// its file names (short and long). Later lookups in the same directory (including lookups of names
+/// that do not exist) then only need to read the directory blocks that hold the entry. An index
+/// needs 24-48 words per directory block (e.g. 4096 words = 16 KiB for a directory of 100 blocks).
+/// Up to MFAT_NUM_DIR_INDEXES directories are indexed at a time, and the least recently used index
+/// is evicted when the memory runs out. The memory must stay valid until the volumes are unmounted.
+///
+/// MFAT keeps two block caches: One for FAT blocks, and one for all other blocks (directory blocks,
+/// file data, etc). By default the caches use built-in memory, with MFAT_NUM_CACHED_BLOCKS blocks
+/// per cache (a compile time setting). If memory for a cache is provided, the cache uses that
+/// memory instead, which makes it possible to size each cache at runtime (e.g. a few FAT blocks and
+/// a large data cache). A cache with N blocks needs mfat_cache_mem_size(N) bytes, suitably aligned
+/// for any object type (e.g. memory from malloc()). The memory must stay valid until the volumes
+/// are unmounted.
+/// @param opts The mount options.
+/// @returns zero (0) on success, or -1 on failure.
+int mfat_mount_ex(const mfat_mount_opts_t* opts);
+
+/// @brief Get the size of the memory for a block cache (see mfat_mount_ex()).
+/// @param num_blocks The number of blocks in the cache.
+/// @returns the number of bytes that are required for the cache, or zero if the number of blocks
+/// is not supported.
+size_t mfat_cache_mem_size(uint32_t num_blocks);
+
+/// @brief Get the number of locks that are used in thread safe mode.
+/// @returns the number of lock ID:s (see MFAT_LOCK_*).
+unsigned mfat_num_locks(void);
+
 /// @brief Unmount all FAT volumes.
 ///
 /// Any pending write operations will be flushed to the storage medium.
@@ -139,6 +371,20 @@ int mfat_select_partition(int partition_no);
 /// @brief Flush pending data updates to storage.
 void mfat_sync(void);
 
+/// @brief Select when the secondary FAT copies are updated.
+///
+/// Changes to the FAT are made to the first FAT copy only, and the modified FAT blocks are tracked.
+/// With MFAT_FAT_MIRROR_SYNC (the default), the modified blocks are copied to the other FAT copies
+/// by mfat_sync(), mfat_close() (for files that are open for writing) and mfat_unmount(), using
+/// one write request per run of adjacent blocks and FAT copy.
+///
+/// With MFAT_FAT_MIRROR_UNMOUNT, the FAT copies are only updated by mfat_unmount(), which reduces
+/// the write traffic during throughput-critical phases. Until then, the FAT copies on the storage
+/// medium are out of date. Switching back to MFAT_FAT_MIRROR_SYNC makes the next sync update them.
+/// @param mode The FAT mirroring mode (MFAT_FAT_MIRROR_SYNC or MFAT_FAT_MIRROR_UNMOUNT).
+/// @returns zero (0) on success, or -1 on failure.
+int mfat_set_fat_mirroring(int mode);
+
 /// @brief Obtain information about a open file.
 /// @param fd The file descriptor.
 /// @param stat Pointer to a stat structure into which information is placed concerning the file.
@@ -152,6 +398,16 @@ int mfat_fstat(int fd, mfat_stat_t* stat);
 int mfat_stat(const char* path, mfat_stat_t* stat);
 
 /// @brief Open a file.
+///
+/// If MFAT_O_CREAT is given and the file does not exist, an empty regular file is created. New
+/// files must have valid 8.3 names.
+///
+/// A file can be open by several file descriptors at once only if none of them has write access.
+/// Opening a file that is already open fails if either file descriptor has write access.
+///
+/// Path parts that are not valid 8.3 names (e.g. "My Photos") are matched against long file names
+/// (UTF-8 encoded, case insensitive for ASCII letters), unless the library is built without
+/// MFAT_ENABLE_LFN.
 /// @param path The path to the file.
 /// @param oflag The open flags (OR of MFAT_O_* flags).
 /// @returns a non-negative integer representing the lowest numbered unused file descriptor, or -1
@@ -175,6 +431,96 @@ int mfat_close(int fd);
 /// called, or -1 on failure.
 int64_t mfat_read(int fd, void* buf, uint32_t nbyte);
 
+/// @brief Start an asynchronous read from a file.
+///
+/// This works like mfat_read(), except that the function returns as soon as all the block requests
+/// of the operation have been submitted, without waiting for them to complete. Use mfat_aio_poll()
+/// or mfat_aio_wait() to complete the operation. The file offset is advanced immediately, so that
+/// several sequential reads can be in flight at the same time.
+///
+/// Block aligned parts of the read are submitted directly to the storage medium (into the target
+/// buffer), while partial blocks at the start and the end of the read are read synchronously
+/// through the block cache. If no asynchronous I/O functions were provided in the mount options,
+/// the entire read is done synchronously, and the operation is complete when the function returns.
+///
+/// The contents of the target buffer are undefined until the operation has completed.
+/// @param fd The file descriptor.
+/// @param buf Buffer to read data into.
+/// @param nbyte Number of bytes to read.
+/// @param aio The state object of the operation.
+/// @returns zero (0) if the operation was started, or -1 on failure.
+int mfat_read_async(int fd, void* buf, uint32_t nbyte, mfat_aio_t* aio);
+
+/// @brief Check if an asynchronous read has completed, without blocking.
+///
+/// Completed block requests (of any asynchronous operation) are processed.
+/// @param aio The state object of the operation.
+/// @returns 1 if the operation is still in progress, zero (0) if it has completed, or -1 on
+/// failure.
+int mfat_aio_poll(mfat_aio_t* aio);
+
+/// @brief Wait for an asynchronous read to complete.
+///
+/// Note: Only one thread at a time may wait for asynchronous operations to complete (using
+/// mfat_aio_poll() or mfat_aio_wait()).
+///
+/// If polling for completed requests fails, the operation is abandoned: Its state object is no
+/// longer referenced by the library, but the contents of the target buffer are undefined.
+/// @param aio The state object of the operation.
+/// @returns the number of bytes that were read, or -1 on failure.
+int64_t mfat_aio_wait(mfat_aio_t* aio);
+
+/// @brief Read from a file at a given offset.
+///
+/// This works just like mfat_read(), except that the data is read from the given offset, and that
+/// the file offset is neither used nor modified. The extent map of the file (if any, see
+/// mfat_build_extent_map()) is used for finding the position in the file.
+///
+/// In thread safe mode (see mfat_mount_ex()), several threads may call mfat_pread() on the same
+/// file descriptor concurrently, and concurrently with other reading functions. It must not be
+/// called concurrently with functions that modify the file (e.g. mfat_write() or mfat_pwrite()) on
+/// the same file descriptor, though.
+/// @param fd The file descriptor.
+/// @param buf Buffer to read data into.
+/// @param nbyte Number of bytes to read.
+/// @param offset The file offset to read from.
+/// @returns a non-negative integer indicating the number of bytes actually read if the operation
+/// was succesful, zero (0) if the offset is at or beyond the end of the file, or -1 on failure.
+int64_t mfat_pread(int fd, void* buf, uint32_t nbyte, int64_t offset);
+
+/// @brief Read from a file into several buffers (scatter read).
+///
+/// This works like calling mfat_read() once for each buffer, in order, but the position in the
+/// cluster chain is only looked up once for the entire request. Block aligned parts of the buffers
+/// are read directly from the storage medium.
+/// @param fd The file descriptor.
+/// @param iov Array of buffers to read data into.
+/// @param iovcnt Number of buffers in the iov array.
+/// @returns a non-negative integer indicating the total number of bytes actually read if the
+/// operation was succesful, or -1 on failure.
+int64_t mfat_readv(int fd, const mfat_iovec_t* iov, int iovcnt);
+
+/// @brief Read from a file without copying the data.
+///
+/// Instead of copying data to a caller provided buffer, this function lends out a pointer to the
+/// data in the block cache, and advances the file offset just like mfat_read(). At most the rest of
+/// the current block is returned, so a view is never longer than MFAT_BLOCK_SIZE bytes.
+///
+/// The cached block is pinned (it will not be evicted from the cache) until the view is released
+/// with mfat_release_view(). Views should be released as soon as possible, since pinned blocks
+/// reduce the effective cache size. When all cached blocks are pinned, further reads fail.
+/// @param fd The file descriptor.
+/// @param max_bytes The maximum number of bytes to read.
+/// @param[out] ptr Pointer to the data (NULL if no data was read).
+/// @param[out] len Number of bytes that are available at ptr (zero at the end of the file).
+/// @returns zero (0) on success, or -1 on failure.
+int mfat_read_view(int fd, uint32_t max_bytes, const void** ptr, uint32_t* len);
+
+/// @brief Release a view that was returned by mfat_read_view().
+/// @param ptr The data pointer of the view.
+/// @returns zero (0) on success, or -1 on failure.
+int mfat_release_view(const void* ptr);
+
 /// @brief Write to a file.
 /// @param fd The file descriptor.
 /// @param buf Buffer that contains the data to write.
@@ -183,6 +529,47 @@ int64_t mfat_read(int fd, void* buf, uint32_t nbyte);
 /// was succesful, or -1 on failure.
 int64_t mfat_write(int fd, const void* buf, uint32_t nbyte);
 
+/// @brief Write to a file at a given offset.
+///
+/// This works just like mfat_write(), except that the data is written to the given offset, and that
+/// the file offset is not modified (also in append mode). The offset must not be beyond the end of
+/// the file.
+/// @param fd The file descriptor.
+/// @param buf Buffer to write data from.
+/// @param nbyte Number of bytes to write.
+/// @param offset The file offset to write to.
+/// @returns a non-negative integer indicating the number of bytes actually written if the operation
+/// was succesful, or -1 on failure.
+int64_t mfat_pwrite(int fd, const void* buf, uint32_t nbyte, int64_t offset);
+
+/// @brief Write to a file from several buffers (gather write).
+///
+/// This works like calling mfat_write() once for each buffer, in order, but the position in the
+/// cluster chain is only looked up once for the entire request. Block aligned parts of the buffers
+/// are written directly to the storage medium.
+/// @param fd The file descriptor.
+/// @param iov Array of buffers to write data from.
+/// @param iovcnt Number of buffers in the iov array.
+/// @returns a non-negative integer indicating the total number of bytes actually written if the
+/// operation was succesful, or -1 on failure.
+int64_t mfat_writev(int fd, const mfat_iovec_t* iov, int iovcnt);
+
+/// @brief Preallocate storage space for a file.
+///
+/// Clusters are appended to the cluster chain of the file until it can hold at least @c length
+/// bytes. The clusters are allocated as physically contiguous as possible: the end of the file is
+/// extended first, and then the best fitting run of free clusters is used. If that run is too
+/// short, the following free clusters are used (in cluster order). Subsequent writes
+/// within the preallocated space do not need to allocate any clusters, and large reads and writes
+/// can be done with few requests to the storage medium.
+///
+/// The file size is not changed. Note that file system checkers may report clusters that are past
+/// the end of the file as lost space, so files should be written to their full length.
+/// @param fd The file descriptor (the file must be open for writing).
+/// @param length The number of bytes to allocate space for.
+/// @returns zero (0) on success, or -1 on failure (e.g. if there is not enough free space).
+int mfat_fallocate(int fd, uint32_t length);
+
 /// @brief Reposition read/write file offset.
 /// @param fd The file descriptor.
 /// @param offset The offset.
@@ -192,6 +579,35 @@ int64_t mfat_write(int fd, const void* buf, uint32_t nbyte);
 /// @note It is possible to query the current file position with mfat_lseek(fd, 0, MFAT_SEEK_CUR).
 int64_t mfat_lseek(int fd, int64_t offset, int whence);
 
+/// @brief Build a cluster extent map for an open file.
+///
+/// The extent map is a compact run-length representation of the cluster chain of the file. Once it
+/// has been built, seeking and reading resolve file positions with a binary search in the extent
+/// map instead of walking the cluster chain in the FAT.
+///
+/// The extent map is stored in a caller provided array, which must stay valid until the file is
+/// closed (or until the extent map is detached). If the array is too small to hold all the extents
+/// of the file, only the first part of the file is mapped.
+/// @param fd The file descriptor.
+/// @param extents The extent array to use (NULL to detach the current extent map, if any).
+/// @param max_extents The number of items in the extent array.
+/// @returns the number of extents in the map on success, or -1 on failure.
+int mfat_build_extent_map(int fd, mfat_extent_t* extents, uint32_t max_extents);
+
+/// @brief Set the read-ahead window of an open file.
+///
+/// When a file is read sequentially and a block is not in the cache, the rest of the current
+/// cluster plus the following num_clusters clusters are prefetched into the block cache (with as
+/// few storage requests as possible). This makes small sequential reads much faster, provided that
+/// the data block cache is large enough. Read-ahead needs a cache of at least two blocks, and uses
+/// at most half of caches with eight blocks or more. With the default cache size
+/// (MFAT_NUM_CACHED_BLOCKS = 2), at most two blocks are read per request, so a larger cache (e.g.
+/// via mfat_mount_ex()) is recommended.
+/// @param fd The file descriptor.
+/// @param num_clusters The number of clusters to read ahead (zero disables read-ahead).
+/// @returns zero (0) on success, or -1 on failure.
+int mfat_set_readahead(int fd, uint32_t num_clusters);
+
 /// @brief Open directory associated with file descriptor.
 /// @param fd The file descriptor.
 /// @returns a pointer to a directory stream object, or NULL if the directory could not be opened.
@@ -202,17 +618,109 @@ mfat_dir_t* mfat_fdopendir(int fd);
 /// @returns a pointer to a directory stream object, or NULL if the directory could not be opened.
 mfat_dir_t* mfat_opendir(const char* path);
 
+/// @brief Open directory with the given name, using caller-provided memory for the stream.
+///
+/// Unlike mfat_opendir(), this does not use a file descriptor nor one of the statically allocated
+/// directory stream objects, so any number of directories can be open at the same time (e.g. one
+/// per level during a recursive directory walk). The stream is closed with mfat_closedir().
+/// @param storage Memory for the directory stream object. The memory must stay valid until the
+/// stream is closed.
+/// @param path The path to the directory.
+/// @returns a pointer to a directory stream object, or NULL if the directory could not be opened.
+mfat_dir_t* mfat_opendir_into(mfat_dir_storage_t* storage, const char* path);
+
 /// @brief Close a directory stream.
 /// @param dirp A pointer to the directory stream object.
 /// @returns zero (0) on success, or -1 on failure.
 int mfat_closedir(mfat_dir_t* dirp);
 
 /// @brief Read the next directory entry of a directory stream.
+///
+/// If a directory entry has a long file name, d_name holds the long file name (UTF-8 encoded).
+/// Otherwise d_name holds the 8.3 name.
 /// @param dirp A pointer to the directory stream object.
 /// @returns a pointer to a structure representing the directory entry at the current position in
 /// the directory stream, or NULL if the end of the directory was reached or an error occurred.
 mfat_dirent_t* mfat_readdir(mfat_dir_t* dirp);
 
+/// @brief Read several directory entries of a directory stream.
+///
+/// This works like repeated calls to mfat_readdir(), but all the entries of a directory block are
+/// decoded in a single pass, and the directory blocks are read with as few storage requests as
+/// possible. This is much faster than mfat_readdir() for large directories.
+/// @param dirp A pointer to the directory stream object.
+/// @param entries The array that will receive the directory entries.
+/// @param max_entries The number of items in the entries array.
+/// @param count Will receive the number of directory entries that were read (zero if the end of
+/// the directory was reached).
+/// @returns zero (0) on success, or -1 on failure.
+int mfat_getdents(mfat_dir_t* dirp, mfat_dirent_t* entries, int max_entries, int* count);
+
+//--------------------------------------------------------------------------------------------------
+// Reentrant API.
+//
+// The functions above operate on a default context, and thus only one storage medium can be
+// mounted at a time. The following functions work just like their counterparts without the _ctx
+// suffix, except that they operate on a caller-provided context. Independent contexts share no
+// state, so different contexts may be used concurrently (e.g. one context per thread). File
+// descriptors and directory streams are only valid within the context that created them.
+//--------------------------------------------------------------------------------------------------
+
+/// @brief Get the size of a context.
+/// @returns the number of bytes that are required for holding an mfat_ctx_t object.
+size_t mfat_ctx_size(void);
+
+/// @brief Mount FAT volumes in a context.
+///
+/// This works just like mfat_mount_ex(), but the state is kept in the given context.
+/// @param ctx Memory for the context: At least mfat_ctx_size() bytes, suitably aligned for any
+/// object type (e.g. memory from malloc()). The memory must stay valid until the volumes are
+/// unmounted.
+/// @param opts The mount options.
+/// @returns zero (0) on success, or -1 on failure.
+int mfat_mount_ctx(mfat_ctx_t* ctx, const mfat_mount_opts_t* opts);
+
+void mfat_unmount_ctx(mfat_ctx_t* ctx);
+int mfat_select_partition_ctx(mfat_ctx_t* ctx, int partition_no);
+void mfat_sync_ctx(mfat_ctx_t* ctx);
+int mfat_set_fat_mirroring_ctx(mfat_ctx_t* ctx, int mode);
+int mfat_fstat_ctx(mfat_ctx_t* ctx, int fd, mfat_stat_t* stat);
+int mfat_stat_ctx(mfat_ctx_t* ctx, const char* path, mfat_stat_t* stat);
+int mfat_open_ctx(mfat_ctx_t* ctx, const char* path, int oflag);
+int mfat_close_ctx(mfat_ctx_t* ctx, int fd);
+int64_t mfat_read_ctx(mfat_ctx_t* ctx, int fd, void* buf, uint32_t nbyte);
+int mfat_read_async_ctx(mfat_ctx_t* ctx, int fd, void* buf, uint32_t nbyte, mfat_aio_t* aio);
+int mfat_aio_poll_ctx(mfat_ctx_t* ctx, mfat_aio_t* aio);
+int64_t mfat_aio_wait_ctx(mfat_ctx_t* ctx, mfat_aio_t* aio);
+int64_t mfat_pread_ctx(mfat_ctx_t* ctx, int fd, void* buf, uint32_t nbyte, int64_t offset);
+int64_t mfat_readv_ctx(mfat_ctx_t* ctx, int fd, const mfat_iovec_t* iov, int iovcnt);
+int mfat_read_view_ctx(mfat_ctx_t* ctx,
+                       int fd,
+                       uint32_t max_bytes,
+                       const void** ptr,
+                       uint32_t* len);
+int mfat_release_view_ctx(mfat_ctx_t* ctx, const void* ptr);
+int64_t mfat_write_ctx(mfat_ctx_t* ctx, int fd, const void* buf, uint32_t nbyte);
+int64_t mfat_pwrite_ctx(mfat_ctx_t* ctx, int fd, const void* buf, uint32_t nbyte, int64_t offset);
+int64_t mfat_writev_ctx(mfat_ctx_t* ctx, int fd, const mfat_iovec_t* iov, int iovcnt);
+int mfat_fallocate_ctx(mfat_ctx_t* ctx, int fd, uint32_t length);
+int64_t mfat_lseek_ctx(mfat_ctx_t* ctx, int fd, int64_t offset, int whence);
+int mfat_build_extent_map_ctx(mfat_ctx_t* ctx,
+                              int fd,
+                              mfat_extent_t* extents,
+                              uint32_t max_extents);
+int mfat_set_readahead_ctx(mfat_ctx_t* ctx, int fd, uint32_t num_clusters);
+mfat_dir_t* mfat_fdopendir_ctx(mfat_ctx_t* ctx, int fd);
+mfat_dir_t* mfat_opendir_ctx(mfat_ctx_t* ctx, const char* path);
+mfat_dir_t* mfat_opendir_into_ctx(mfat_ctx_t* ctx, mfat_dir_storage_t* storage, const char* path);
+int mfat_closedir_ctx(mfat_ctx_t* ctx, mfat_dir_t* dirp);
+mfat_dirent_t* mfat_readdir_ctx(mfat_ctx_t* ctx, mfat_dir_t* dirp);
+int mfat_getdents_ctx(mfat_ctx_t* ctx,
+                      mfat_dir_t* dirp,
+                      mfat_dirent_t* entries,
+                      int max_entries,
+                      int* count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,318 @@
+//--------------------------------------------------------------------------------------------------
+// Copyright (C) 2022 Marcus Geelnard
+//
+// Redistribution and use in source and binary forms, with or without modification, are permitted
+// provided that the following conditions are met:
+//
+//   1. Redistributions of source code must retain the above copyright notice, this list of
+//      conditions and the following disclaimer.
+//
+//   2. Redistributions in binary form must reproduce the above copyright notice, this list of
+//      conditions and the following disclaimer in the documentation and/or other materials provided
+//      with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR
+// IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND
+// FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+// WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//--------------------------------------------------------------------------------------------------
+
+#include <mfat.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//--------------------------------------------------------------------------------------------------
+// An in-memory FAT16 image.
+//--------------------------------------------------------------------------------------------------
+
+#define IMG_BLOCKS 8192U       // 4 MiB.
+#define IMG_RESERVED 1U        // Reserved blocks (the BPB).
+#define IMG_NUM_FATS 2U        // Number of FAT copies.
+#define IMG_FAT_BLOCKS 32U     // Blocks per FAT.
+#define IMG_ROOT_ENTRIES 512U  // Number of root directory entries.
+#define IMG_ROOT_BLOCKS (IMG_ROOT_ENTRIES * 32U / MFAT_BLOCK_SIZE)
+#define IMG_FIRST_DATA_BLOCK (IMG_RESERVED + IMG_NUM_FATS * IMG_FAT_BLOCKS + IMG_ROOT_BLOCKS)
+#define IMG_NUM_CLUSTERS (IMG_BLOCKS - IMG_FIRST_DATA_BLOCK)  // One block per cluster.
+
+static uint8_t s_img[IMG_BLOCKS * MFAT_BLOCK_SIZE];
+
+static void set_word(uint8_t* buf, uint32_t value) {
+  buf[0] = (uint8_t)value;
+  buf[1] = (uint8_t)(value >> 8);
+}
+
+static uint32_t get_word(const uint8_t* buf) {
+  return ((uint32_t)buf[0]) | (((uint32_t)buf[1]) << 8);
+}
+
+static uint32_t get_dword(const uint8_t* buf) {
+  return get_word(&buf[0]) | (get_word(&buf[2]) << 16);
+}
+
+// Create an empty FAT16 file system (without a partition table).
+static void format_image(void) {
+  memset(&s_img[0], 0, sizeof(s_img));
+
+  // The BPB.
+  uint8_t* bpb = &s_img[0];
+  bpb[0] = 0xebU;
+  bpb[1] = 0x3cU;
+  bpb[2] = 0x90U;
+  memcpy(&bpb[3], "MFATTEST", 8);
+  set_word(&bpb[11], MFAT_BLOCK_SIZE);
+  bpb[13] = 1U;
+  set_word(&bpb[14], IMG_RESERVED);
+  bpb[16] = IMG_NUM_FATS;
+  set_word(&bpb[17], IMG_ROOT_ENTRIES);
+  set_word(&bpb[19], IMG_BLOCKS);
+  bpb[21] = 0xf8U;
+  set_word(&bpb[22], IMG_FAT_BLOCKS);
+  bpb[510] = 0x55U;
+  bpb[511] = 0xaaU;
+
+  // The reserved FAT entries.
+  for (uint32_t i = 0U; i < IMG_NUM_FATS; ++i) {
+    uint8_t* fat = &s_img[(IMG_RESERVED + i * IMG_FAT_BLOCKS) * MFAT_BLOCK_SIZE];
+    set_word(&fat[0], 0xfff8U);
+    set_word(&fat[2], 0xffffU);
+  }
+}
+
+static int read_block(char* ptr, unsigned block_no, void* custom) {
+  (void)custom;
+  if (block_no >= IMG_BLOCKS) {
+    return -1;
+  }
+  memcpy(ptr, &s_img[block_no * MFAT_BLOCK_SIZE], MFAT_BLOCK_SIZE);
+  return 0;
+}
+
+static int write_block(const char* ptr, unsigned block_no, void* custom) {
+  (void)custom;
+  if (block_no >= IMG_BLOCKS) {
+    return -1;
+  }
+  memcpy(&s_img[block_no * MFAT_BLOCK_SIZE], ptr, MFAT_BLOCK_SIZE);
+  return 0;
+}
+
+// Mount the image with caller-provided block caches (this works for any MFAT_NUM_CACHED_BLOCKS)
+// and a directory entry cache.
+static void* s_data_cache_mem;
+static void* s_fat_cache_mem;
+static mfat_dentry_t s_dentries[64];
+
+static int mount_image(uint32_t data_cache_blocks) {
+  mfat_mount_opts_t opts;
+  memset(&opts, 0, sizeof(opts));
+  opts.read = read_block;
+  opts.write = write_block;
+  s_data_cache_mem = malloc(mfat_cache_mem_size(data_cache_blocks));
+  s_fat_cache_mem = malloc(mfat_cache_mem_size(4U));
+  opts.data_cache_mem = s_data_cache_mem;
+  opts.data_cache_blocks = data_cache_blocks;
+  opts.fat_cache_mem = s_fat_cache_mem;
+  opts.fat_cache_blocks = 4U;
+  opts.dentry_cache = &s_dentries[0];
+  opts.dentry_cache_size = sizeof(s_dentries) / sizeof(s_dentries[0]);
+  return mfat_mount_ex(&opts);
+}
+
+static void unmount_image(void) {
+  mfat_unmount();
+  free(s_data_cache_mem);
+  free(s_fat_cache_mem);
+  s_data_cache_mem = NULL;
+  s_fat_cache_mem = NULL;
+}
+
+// Check the consistency of the image: Every allocated cluster must belong to exactly one file in
+// the root directory, and each cluster chain must match the size of its file.
+static int check_image(void) {
+  static uint8_t s_owned[IMG_NUM_CLUSTERS + 2U];
+  memset(&s_owned[0], 0, sizeof(s_owned));
+  const uint8_t* fat = &s_img[IMG_RESERVED * MFAT_BLOCK_SIZE];
+  const uint8_t* root = &s_img[(IMG_RESERVED + IMG_NUM_FATS * IMG_FAT_BLOCKS) * MFAT_BLOCK_SIZE];
+
+  for (uint32_t i = 0U; i < IMG_ROOT_ENTRIES; ++i) {
+    const uint8_t* entry = &root[i * 32U];
+    if (entry[0] == 0x00U) {
+      break;
+    }
+    if (entry[0] == 0xe5U || (entry[11] & 0x08U) != 0U) {
+      continue;
+    }
+    uint32_t size = get_dword(&entry[28]);
+    uint32_t wanted = (size + MFAT_BLOCK_SIZE - 1U) / MFAT_BLOCK_SIZE;
+    uint32_t count = 0U;
+    for (uint32_t cluster = get_word(&entry[26]); cluster >= 2U && cluster < 0xfff8U;
+         cluster = get_word(&fat[cluster * 2U])) {
+      if (cluster >= IMG_NUM_CLUSTERS + 2U || s_owned[cluster] || count > IMG_NUM_CLUSTERS) {
+        printf("  Bad cluster chain for %.11s (cluster %u)\n", (const char*)entry, cluster);
+        return 0;
+      }
+      s_owned[cluster] = 1U;
+      ++count;
+    }
+    if (count != wanted) {
+      printf("  %.11s: %u clusters for %u bytes\n", (const char*)entry, count, size);
+      return 0;
+    }
+  }
+
+  for (uint32_t cluster = 2U; cluster < IMG_NUM_CLUSTERS + 2U; ++cluster) {
+    if (get_word(&fat[cluster * 2U]) != 0U && !s_owned[cluster]) {
+      printf("  Lost cluster %u\n", cluster);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//--------------------------------------------------------------------------------------------------
+// Tests.
+//--------------------------------------------------------------------------------------------------
+
+static int s_num_failed;
+
+#define CHECK(_cond)                                              \
+  do {                                                            \
+    if (!(_cond)) {                                               \
+      printf("  %s:%d: CHECK(%s)\n", __FILE__, __LINE__, #_cond); \
+      ++s_num_failed;                                             \
+    }                                                             \
+  } while (0)
+
+static void fill(uint8_t* buf, uint32_t nbyte, uint8_t seed) {
+  for (uint32_t i = 0U; i < nbyte; ++i) {
+    buf[i] = (uint8_t)(seed + i * 7U);
+  }
+}
+
+// A file must not be open by several fds if any of them can write to it, since each fd has its own
+// copy of the file size and the cluster chain state.
+static void test_open_twice(void) {
+  printf("test_open_twice\n");
+  format_image();
+  CHECK(mount_image(4U) == 0);
+
+  static uint8_t s_buf[8000];
+  fill(&s_buf[0], sizeof(s_buf), 1U);
+
+  int fd_a = mfat_open("/TWO.TXT", MFAT_O_RDWR | MFAT_O_CREAT);
+  CHECK(fd_a >= 0);
+  CHECK(mfat_open("/TWO.TXT", MFAT_O_WRONLY) == -1);
+  CHECK(mfat_open("/TWO.TXT", MFAT_O_RDONLY) == -1);
+  CHECK(mfat_write(fd_a, &s_buf[0], 5000U) == 5000);
+  CHECK(mfat_close(fd_a) == 0);
+
+  // Several readers are fine, but then there can be no writer.
+  int fd_b = mfat_open("/TWO.TXT", MFAT_O_RDONLY);
+  int fd_c = mfat_open("/TWO.TXT", MFAT_O_RDONLY);
+  CHECK(fd_b >= 0 && fd_c >= 0);
+  CHECK(mfat_open("/TWO.TXT", MFAT_O_WRONLY | MFAT_O_APPEND) == -1);
+  CHECK(mfat_close(fd_b) == 0);
+  CHECK(mfat_close(fd_c) == 0);
+
+  // Append on a single fd, and read the whole file back.
+  fd_a = mfat_open("/TWO.TXT", MFAT_O_WRONLY | MFAT_O_APPEND);
+  CHECK(fd_a >= 0);
+  CHECK(mfat_write(fd_a, &s_buf[5000], 3000U) == 3000);
+  CHECK(mfat_close(fd_a) == 0);
+
+  static uint8_t s_read_buf[8000];
+  fd_b = mfat_open("/TWO.TXT", MFAT_O_RDONLY);
+  CHECK(fd_b >= 0);
+  CHECK(mfat_read(fd_b, &s_read_buf[0], sizeof(s_read_buf)) == (int64_t)sizeof(s_read_buf));
+  CHECK(memcmp(&s_read_buf[0], &s_buf[0], sizeof(s_buf)) == 0);
+  CHECK(mfat_close(fd_b) == 0);
+
+  unmount_image();
+  CHECK(check_image());
+}
+
+// Preallocation in fragmented free space must give the file a valid cluster chain.
+static void test_fallocate_fragmented(void) {
+  printf("test_fallocate_fragmented\n");
+  format_image();
+
+  // Fragment the free space: A file that owns every fourth cluster leaves runs of three free
+  // clusters.
+  uint8_t* root = &s_img[(IMG_RESERVED + IMG_NUM_FATS * IMG_FAT_BLOCKS) * MFAT_BLOCK_SIZE];
+  uint32_t num_owned = 0U;
+  for (uint32_t i = 0U; i < IMG_NUM_FATS; ++i) {
+    uint8_t* fat = &s_img[(IMG_RESERVED + i * IMG_FAT_BLOCKS) * MFAT_BLOCK_SIZE];
+    num_owned = 0U;
+    for (uint32_t cluster = 2U; cluster < IMG_NUM_CLUSTERS + 2U; cluster += 4U) {
+      uint32_t next = (cluster + 4U < IMG_NUM_CLUSTERS + 2U) ? cluster + 4U : 0xffffU;
+      set_word(&fat[cluster * 2U], next);
+      ++num_owned;
+    }
+  }
+  memcpy(&root[0], "FRAG    BIN", 11);
+  set_word(&root[26], 2U);
+  set_word(&root[28], num_owned * MFAT_BLOCK_SIZE);
+  set_word(&root[30], (num_owned * MFAT_BLOCK_SIZE) >> 16);
+  CHECK(check_image());
+
+  CHECK(mount_image(4U) == 0);
+  static uint8_t s_buf[20U * MFAT_BLOCK_SIZE];
+  fill(&s_buf[0], sizeof(s_buf), 3U);
+  int fd = mfat_open("/PRE.BIN", MFAT_O_RDWR | MFAT_O_CREAT);
+  CHECK(fd >= 0);
+  CHECK(mfat_fallocate(fd, sizeof(s_buf)) == 0);
+  CHECK(mfat_write(fd, &s_buf[0], sizeof(s_buf)) == (int64_t)sizeof(s_buf));
+  CHECK(mfat_close(fd) == 0);
+
+  static uint8_t s_read_buf[sizeof(s_buf)];
+  fd = mfat_open("/PRE.BIN", MFAT_O_RDONLY);
+  CHECK(fd >= 0);
+  CHECK(mfat_read(fd, &s_read_buf[0], sizeof(s_read_buf)) == (int64_t)sizeof(s_read_buf));
+  CHECK(memcmp(&s_read_buf[0], &s_buf[0], sizeof(s_buf)) == 0);
+  CHECK(mfat_close(fd) == 0);
+
+  unmount_image();
+  CHECK(check_image());
+}
+
+// Path lookups that are served by the directory entry cache must see file size changes.
+static void test_dentry_cache_size(void) {
+  printf("test_dentry_cache_size\n");
+  format_image();
+  CHECK(mount_image(4U) == 0);
+
+  static uint8_t s_buf[3000];
+  fill(&s_buf[0], sizeof(s_buf), 5U);
+  mfat_stat_t st;
+  int fd = mfat_open("/LOG.TXT", MFAT_O_WRONLY | MFAT_O_CREAT);
+  CHECK(fd >= 0);
+  CHECK(mfat_stat("/LOG.TXT", &st) == 0 && st.st_size == 0U);
+  CHECK(mfat_write(fd, &s_buf[0], 1000U) == 1000);
+  CHECK(mfat_stat("/LOG.TXT", &st) == 0 && st.st_size == 1000U);
+  CHECK(mfat_write(fd, &s_buf[1000], 2000U) == 2000);
+  CHECK(mfat_stat("/LOG.TXT", &st) == 0 && st.st_size == 3000U);
+  CHECK(mfat_close(fd) == 0);
+
+  unmount_image();
+  CHECK(check_image());
+}
+
+int main(void) {
+  test_open_twice();
+  test_fallocate_fragmented();
+  test_dentry_cache_size();
+
+  if (s_num_failed > 0) {
+    printf("%d check(s) failed\n", s_num_failed);
+    return 1;
+  }
+  printf("All tests passed\n");
+  return 0;
+}